@@ -1,11 +1,26 @@
 #pragma once
 /// august 28, 2025
 /// ryan z
-/// simple fixed-size allocator. intended to be thread-local, so no
-/// synchronization or thread safety is allowed. Another way to do this would be
+/// simple fixed-size (slab) allocator. intended to be thread-local, so no
+/// synchronization or thread safety is allowed (the one shared piece is the
+/// optional block_exchange, see exchange.hh). Another way to do this would be
 /// to use std::hive (c++26), but not 100% sure how that's implemented yet
+#include "exchange.hh"
+#include "numa.hh"
+
+#include <algorithm>
+#include <bit>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <memory_resource>
+#include <new>
+#include <optional>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 namespace tftf {
 
@@ -16,75 +31,398 @@ namespace tftf {
 struct stats {
   uint64_t alloc_count{0};
   uint64_t dealloc_count{0};
-  uint64_t freenodes_allocated{0};
+  // allocations that had to go upstream
+  uint64_t upstream_count{0};
+  // blocks handed to / taken from a block_exchange
+  uint64_t donated_count{0};
+  uint64_t refilled_count{0};
 };
-/// @brief extremely basic fixed size bucket-freelist allocator
-/// note that the size is fixed at runtime, maybe template to make it correct
-template <std::size_t alloc_size>
-class node_resource : public std::pmr::memory_resource {
+
+/// @brief free blocks are chained through their first word
+inline auto get_link(const void *block) -> void * {
+  void *next;
+  std::memcpy(&next, block, sizeof(next));
+  return next;
+}
+inline void set_link(void *block, void *next) {
+  std::memcpy(block, &next, sizeof(next));
+}
+
+/// @brief a resource of fixed size blocks that can take back a whole chain of
+/// them (linked through their first word, see get_link) in one go
+class block_pool : public std::pmr::memory_resource {
+public:
+  virtual auto block_size() const -> std::size_t = 0;
+  /// @brief `first` ... `last` are `count` blocks chained through their first
+  /// word, last's link is ignored
+  virtual void deallocate_chain(void *first, void *last, std::size_t count) = 0;
+};
+
+/// @brief how a node_resource gets its memory from upstream
+struct slab_options {
+  // bytes per slab, a power of two (slabs are aligned to their size so a
+  // block finds its slab with a mask). 0 takes blocks from upstream one at a
+  // time instead
+  std::size_t slab_size{std::size_t{2} << 20};
+  // madvise every slab for transparent huge pages. only useful when
+  // slab_size is a multiple of the huge page size
+  bool hugepages{false};
+  // place every slab on this numa node (its kernel id, see numa.hh) before
+  // it's first touched, wherever the allocating thread runs. a hint like
+  // hugepages
+  std::optional<unsigned> numa_node{};
+  // completely free slabs kept around instead of going back upstream
+  std::size_t retain_empty{1};
+  // shared with the other workers' resources (same block size) so one that
+  // only frees can feed one that only allocates. past `high_watermark` free
+  // blocks we donate batches to it, and when the freelist runs dry we take
+  // batches until we have `low_watermark` before carving new slab memory.
+  // it has to outlive the resource, which leaves its slabs to it on the way
+  // out (see block_exchange::adopt)
+  block_exchange *exchange{nullptr};
+  std::size_t low_watermark{1'024};
+  std::size_t high_watermark{8'192};
+};
+
+/// @brief fixed size slab allocator. memory comes from upstream a slab at a
+/// time and is carved into `alloc_size` blocks, free blocks are chained
+/// through their first word (so deallocating never allocates). Every so
+/// often (when the freelist has doubled since last time) `trim` regroups the
+/// freelist by slab and hands completely free slabs back upstream.
+///
+/// with an exchange, the freelist can hold blocks from other resources' slabs.
+/// those are reused like our own but only their owner ever releases a slab
+///
+/// everything about the layout is a compile time constant, so every size
+/// (24 byte int nodes included) gets the same branch-and-pop fast path
+template <std::size_t alloc_size> class node_resource : public block_pool {
+  static_assert(alloc_size >= sizeof(void *),
+                "free blocks hold the freelist link");
+
 public:
-  explicit node_resource(std::pmr::memory_resource &upstream)
-      : m_upstream(upstream) {}
+  explicit node_resource(std::pmr::memory_resource &upstream,
+                         slab_options options = {})
+      : m_upstream(upstream), m_options(options) {
+    assert(m_options.slab_size == 0 ||
+           (std::has_single_bit(m_options.slab_size) &&
+            m_options.slab_size >= first_block + alloc_size));
+    // the exchange mixes blocks between resources, and trim tells them apart
+    // by their slab: every resource on it needs the same slab size
+    if (m_options.exchange != nullptr) {
+      m_options.exchange->attach(alloc_size, m_options.slab_size);
+      assert(m_options.high_watermark >= m_options.exchange->batch_blocks());
+    }
+    if (m_options.slab_size != 0) {
+      m_trim_at = 2 * blocks_per_slab();
+    }
+    update_surplus_at();
+  }
+
+  node_resource(const node_resource &) = delete;
+  node_resource &operator=(const node_resource &) = delete;
+
+  ~node_resource() {
+    if (m_options.exchange != nullptr) {
+      leave(*m_options.exchange);
+      return;
+    }
+    while (m_slabs != nullptr) {
+      slab *next = m_slabs->next;
+      release_slab(m_slabs);
+      m_slabs = next;
+    }
+  }
 
-  /// @brief allocation strategy: try using the freelist,
-  /// otherwise use upstream
+  /// @brief allocation strategy: try using the freelist, then the current
+  /// slab, otherwise go upstream for a new one
   auto do_allocate(std::size_t bytes, std::size_t align) -> void * override {
-    // check freelist
     assert(bytes == alloc_size);
     m_stats.alloc_count++;
-    if (m_freelist == nullptr) {
-      return m_upstream.allocate(bytes, align);
+    if (m_freelist != nullptr) [[likely]] {
+      void *block = m_freelist;
+      m_freelist = get_link(block);
+      m_free_count--;
+      return block;
     }
 
-    // grab off freelist
-    freenode *node = m_freelist;
-    m_freelist = m_freelist->next;
-
-    // put on freenode freelist
-    node->next = m_free_freenodes;
-    m_free_freenodes = node;
-
-    return node->ptr;
+    if (m_options.exchange != nullptr && refill()) {
+      void *block = m_freelist;
+      m_freelist = get_link(block);
+      m_free_count--;
+      return block;
+    }
+    if (m_options.slab_size == 0) {
+      m_stats.upstream_count++;
+      return m_upstream.allocate(bytes, align);
+    }
+    assert(align <= block_align);
+    if (m_bump == m_bump_end) [[unlikely]] {
+      new_slab();
+    }
+    void *block = m_bump;
+    m_bump += alloc_size;
+    return block;
   }
-  /// @brief deallocate and put into freenode: may actually allocate due to
-  /// freelist nodes being required
+  /// @brief deallocate onto the freelist, which lives inside the free blocks
+  /// so this never allocates
   void do_deallocate(void *p, std::size_t /* bytes */,
                      size_t /* align*/) override {
     m_stats.dealloc_count++;
-    freenode *node = get_freenode();
-    node->ptr = p;
-    node->next = m_freelist;
-    m_freelist = node;
+    set_link(p, m_freelist);
+    m_freelist = p;
+    if (++m_free_count >= m_surplus_at) [[unlikely]] {
+      on_surplus();
+    }
   }
   auto do_is_equal(const std::pmr::memory_resource &other) const noexcept
       -> bool override {
     return this == &other;
   }
 
+  auto block_size() const -> std::size_t override { return alloc_size; }
+  void deallocate_chain(void *first, void *last, std::size_t count) override {
+    m_stats.dealloc_count += count;
+    set_link(last, m_freelist);
+    m_freelist = first;
+    m_free_count += count;
+    if (m_free_count >= m_surplus_at) [[unlikely]] {
+      on_surplus();
+    }
+  }
+
+  /// @brief sort the freelist by slab (so consecutive allocations come from
+  /// the same slab again) and hand every completely free slab but
+  /// `retain_empty` of them back upstream. amortized against the frees that
+  /// triggered it
+  void trim() {
+    if (m_options.slab_size == 0) {
+      return;
+    }
+
+    for (slab *s = m_slabs; s != nullptr; s = s->next) {
+      s->free = 0;
+      s->chain = s->chain_tail = nullptr;
+    }
+    // blocks from other resources' slabs (via the exchange) stay at the front
+    // of the freelist, their slab headers aren't ours to touch
+    void *foreign = nullptr;
+    void *foreign_tail = nullptr;
+    std::size_t foreign_count = 0;
+    for (void *p = m_freelist; p != nullptr;) {
+      void *next = get_link(p);
+      slab *s = slab_of(p);
+      if (s->owner != this) {
+        set_link(p, foreign);
+        if (foreign_tail == nullptr) {
+          foreign_tail = p;
+        }
+        foreign = p;
+        foreign_count++;
+        p = next;
+        continue;
+      }
+      set_link(p, s->chain);
+      if (s->chain_tail == nullptr) {
+        s->chain_tail = p;
+      }
+      s->chain = p;
+      s->free++;
+      p = next;
+    }
+
+    m_freelist = nullptr;
+    m_free_count = 0;
+    size_t kept_empty = 0;
+    slab **link = &m_slabs;
+    while (slab *s = *link) {
+      const bool current = m_bump_end == end_of(s);
+      if (s->free == carved(s) && !current &&
+          kept_empty++ >= m_options.retain_empty) {
+        *link = s->next;
+        release_slab(s);
+        continue;
+      }
+      if (s->chain != nullptr) {
+        set_link(s->chain_tail, m_freelist);
+        m_freelist = s->chain;
+        m_free_count += s->free;
+      }
+      link = &s->next;
+    }
+    if (foreign != nullptr) {
+      set_link(foreign_tail, m_freelist);
+      m_freelist = foreign;
+      m_free_count += foreign_count;
+    }
+    m_trim_at = std::max(m_free_count * 2, 2 * blocks_per_slab());
+    update_surplus_at();
+  }
+
+  /// @brief slabs currently held from upstream
+  auto slab_count() const -> std::size_t {
+    std::size_t count = 0;
+    for (const slab *s = m_slabs; s != nullptr; s = s->next) {
+      count++;
+    }
+    return count;
+  }
+
   // we observe this publicly
   stats m_stats{};
 
 private:
-  struct freenode {
-    void *ptr;
-    freenode *next{nullptr};
+  // sits at the start of every slab
+  struct slab {
+    // the resource that carved it, null once that's gone and the exchange
+    // holds the slab
+    const void *owner;
+    slab *next;
+    // scratch for trim
+    std::size_t free;
+    void *chain;
+    void *chain_tail;
   };
-  std::pmr::memory_resource &m_upstream;
-  freenode *m_freelist{nullptr};
-  freenode *m_free_freenodes{nullptr};
 
-  /// @brief get a freelist node, either through allocation or the freenode
-  /// freelist
-  auto get_freenode() -> freenode * {
-    if (m_free_freenodes == nullptr) {
-      m_stats.freenodes_allocated++;
-      return static_cast<freenode *>(m_upstream.allocate(sizeof(freenode)));
+  // the strongest alignment every block has, blocks start a cache line in
+  static constexpr std::size_t block_align =
+      std::min<std::size_t>(alloc_size & (~alloc_size + 1), 64);
+  static constexpr std::size_t first_block = 64;
+  static_assert(sizeof(slab) <= first_block);
+
+  auto blocks_per_slab() const -> std::size_t {
+    return (m_options.slab_size - first_block) / alloc_size;
+  }
+  auto slab_of(const void *p) const -> slab * {
+    return reinterpret_cast<slab *>(reinterpret_cast<std::uintptr_t>(p) &
+                                    ~(m_options.slab_size - 1));
+  }
+  auto end_of(slab *s) const -> std::byte * {
+    return reinterpret_cast<std::byte *>(s) + first_block +
+           blocks_per_slab() * alloc_size;
+  }
+  /// @brief blocks handed out of `s` so far, only the current slab is partly
+  /// carved
+  auto carved(slab *s) const -> std::size_t {
+    if (m_bump_end == end_of(s)) {
+      return (m_bump - (reinterpret_cast<std::byte *>(s) + first_block)) /
+             alloc_size;
+    }
+    return blocks_per_slab();
+  }
+
+  void new_slab() {
+    m_stats.upstream_count++;
+    void *mem = m_upstream.allocate(m_options.slab_size, m_options.slab_size);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (m_options.hugepages) {
+      // a hint, carry on with small pages if the kernel says no
+      madvise(mem, m_options.slab_size, MADV_HUGEPAGE);
+    }
+#endif
+    if (m_options.numa_node) {
+      bind_to_node(mem, m_options.slab_size, *m_options.numa_node);
+    }
+    slab *s = new (mem) slab{this, m_slabs, 0, nullptr, nullptr};
+    m_slabs = s;
+    m_bump = reinterpret_cast<std::byte *>(s) + first_block;
+    m_bump_end = end_of(s);
+  }
+  /// @brief the freelist passed a watermark: donate to the exchange and/or trim
+  void on_surplus() {
+    if (block_exchange *exchange = m_options.exchange;
+        exchange != nullptr && m_free_count > m_options.high_watermark) {
+      donate(*exchange);
+    }
+    if (m_free_count >= m_trim_at) {
+      trim();
+    }
+    update_surplus_at();
+  }
+  void update_surplus_at() {
+    m_surplus_at = m_trim_at;
+    if (m_options.exchange != nullptr) {
+      m_surplus_at = std::min(m_surplus_at, m_options.high_watermark + 1);
+    }
+  }
+
+  /// @brief hand batches off the front of the freelist to the exchange until
+  /// we're back under the high watermark (or it's full)
+  void donate(block_exchange &exchange) {
+    const std::size_t n = exchange.batch_blocks();
+    while (m_free_count > m_options.high_watermark) {
+      void *last = m_freelist;
+      for (std::size_t i = 1; i < n; ++i) {
+        last = get_link(last);
+      }
+      void *rest = get_link(last);
+      if (!exchange.push({m_freelist, last, n})) {
+        return;
+      }
+      m_freelist = rest;
+      m_free_count -= n;
+      m_stats.donated_count += n;
+    }
+  }
+
+  /// @brief the freelist is empty: take batches from the exchange up to the
+  /// low watermark. returns whether we got anything
+  auto refill() -> bool {
+    block_batch batch;
+    while (m_free_count < m_options.low_watermark &&
+           m_options.exchange->pop(batch)) {
+      set_link(batch.last, m_freelist);
+      m_freelist = batch.first;
+      m_free_count += batch.count;
+      m_stats.refilled_count += batch.count;
     }
-    freenode *node = m_free_freenodes;
-    m_free_freenodes = m_free_freenodes->next;
-    return node;
+    return m_freelist != nullptr;
   }
+
+  /// @brief we're going away, but blocks carved from our slabs can still be
+  /// in use elsewhere. completely free slabs go back upstream like in trim,
+  /// our free blocks go to the exchange for someone else to use (any it has
+  /// no room for are dropped) and every other slab is left for it to release
+  void leave(block_exchange &exchange) noexcept {
+    m_options.retain_empty = 0;
+    trim();
+    while (m_freelist != nullptr) {
+      void *last = m_freelist;
+      std::size_t count = 1;
+      while (count < exchange.batch_blocks() && get_link(last) != nullptr) {
+        last = get_link(last);
+        count++;
+      }
+      void *rest = get_link(last);
+      if (!exchange.push({m_freelist, last, count})) {
+        break;
+      }
+      m_freelist = rest;
+      m_free_count -= count;
+      m_stats.donated_count += count;
+    }
+    while (m_slabs != nullptr) {
+      slab *next = m_slabs->next;
+      m_slabs->owner = nullptr;
+      exchange.adopt(m_slabs, m_upstream);
+      m_slabs = next;
+    }
+  }
+
+  void release_slab(slab *s) {
+    m_upstream.deallocate(s, m_options.slab_size, m_options.slab_size);
+  }
+
+  std::pmr::memory_resource &m_upstream;
+  slab_options m_options;
+  void *m_freelist{nullptr};
+  std::size_t m_free_count{0};
+  std::size_t m_trim_at{SIZE_MAX};
+  // min of m_trim_at and the high watermark, the one check frees pay for
+  std::size_t m_surplus_at{SIZE_MAX};
+  slab *m_slabs{nullptr};
+  // uncarved part of the newest slab
+  std::byte *m_bump{nullptr};
+  std::byte *m_bump_end{nullptr};
 };
-template <> class node_resource<24>;
 
 } // namespace tftf
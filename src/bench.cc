@@ -14,21 +14,830 @@
  * threads, but it is also not fair because of threading nondeterminism. so we
  * assume the law of large numbers and hope that the benchmark is expected fair.
  * what more can you ask for
+ *
+ * usage: bench [--threads N] [--keys N] [--ops N] [--dist uniform|zipf]
+ *              [--theta F] [--mix read:upsert:rmw:delete[:scan]] [--batch N]
+ *              [--scan-length N] [--table a,b,..|none]
+ *              [--wal none|async|sync] [--hashes std,multiply_shift,wy]
+ *              [--stats json|prometheus] [--help]
+ *
+ * --hashes first prints how each hasher spreads a few key patterns over a
+ * table sized for --keys (see hash.hh). --stats prints each faster table's
+ * own counters after its run (see metrics.hh). a scan reads --scan-length
+ * consecutive keys from a random one, with range() on ordered tables
+ * (faster_skip) and one get per key on everything else
  */
 
+#include "allocator.hh"
+#include "faster.hh"
+#include "sharded.hh"
+
+#include <algorithm>
+#include <array>
 #include <atomic>
-#include <format>
+#include <barrier>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // what's the format of this?
-// we have a TABLE and we want to construct it?
-// like we have a few setups
+// we have a TABLE and we want to construct it, then every thread makes a
+// WORKER from it (its thread local state) and runs ops through the worker.
+// a TableBench looks like
 //
+//   struct some_bench {
+//     using Table = ...;
+//     struct Worker {
+//       explicit Worker(Table &);
+//       auto read(uint64_t key) -> bool;
+//       void upsert(uint64_t key, uint64_t value);
+//       void rmw(uint64_t key);
+//       auto erase(uint64_t key) -> bool;
+//       // optional, for tables that can do better than a get per key
+//       auto scan(uint64_t lo, uint64_t hi) -> uint64_t;
+//     };
+//     static auto name() -> std::string;
+//     auto get_table() -> std::unique_ptr<Table>;
+//   };
+//
+// workers are kept alive until every thread is done, since other threads can
+// still be reading nodes out of a worker's resource
 
 namespace tftf {
 
-struct BenchResults {};
-template <class TableBench> BenchResults benchmark(TableBench bench) {
-  typename TableBench::Table table = bench.get_table();
+enum op_type : size_t {
+  op_read,
+  op_upsert,
+  op_rmw,
+  op_delete,
+  op_scan,
+  op_count
+};
+constexpr std::string_view op_names[op_count] = {"read", "upsert", "rmw",
+                                                 "delete", "scan"};
+
+struct BenchConfig {
+  size_t threads{4};
+  uint64_t keys{1'000'000};
+  uint64_t ops_per_thread{1'000'000};
+  bool zipf{false};
+  double theta{0.99};
+  // read:upsert:rmw:delete:scan
+  std::array<unsigned, op_count> mix{50, 30, 15, 5, 0};
+  // reads are issued through get_batch this many keys at a time
+  size_t batch{1};
+  // keys per scan
+  uint64_t scan_length{100};
+  std::vector<std::string> tables{"faster", "faster_bucket", "locked_map"};
+  // faster tables write ahead to a log in the temp dir with this durability
+  std::optional<durability> wal{};
+  // hashers to report the key spread of before the runs
+  std::vector<std::string> hashers{};
+  // "json" or "prometheus" to dump faster::collect_stats after each run
+  std::string stats{};
+  // --help was passed, print usage and run nothing
+  bool help{false};
+};
+
+constexpr std::string_view usage =
+    "usage: bench [--threads N] [--keys N] [--ops N] [--dist uniform|zipf]\n"
+    "             [--theta F] [--mix read:upsert:rmw:delete[:scan]]\n"
+    "             [--batch N] [--scan-length N] [--table a,b,..|none]\n"
+    "             [--wal none|async|sync] [--hashes std,multiply_shift,wy]\n"
+    "             [--stats json|prometheus] [--help]\n";
+
+struct BenchResults {
+  std::string name;
+  double seconds{0};
+  std::array<uint64_t, op_count> ops{};
+  std::array<latency_histogram, op_count> latency{};
+  uint64_t read_hits{0};
+  // entries the scans came back with
+  uint64_t scanned{0};
+  // the table's collect_stats, rendered per --stats
+  std::string stats{};
+};
+
+/// @brief YCSB's scrambled zipfian: ranks are drawn zipfian and then hashed
+/// over the key space so the hot keys aren't all neighbours
+class zipfian_generator {
+public:
+  zipfian_generator(uint64_t n, double theta)
+      : m_n(n), m_theta(theta), m_alpha(1.0 / (1.0 - theta)),
+        m_zetan(zeta(n, theta)) {
+    const double zeta2 = zeta(2, theta);
+    m_eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / m_zetan);
+  }
+
+  template <class Rng> auto operator()(Rng &rng) const -> uint64_t {
+    const double u = std::uniform_real_distribution<double>{0, 1}(rng);
+    const double uz = u * m_zetan;
+    uint64_t rank;
+    if (uz < 1.0) {
+      rank = 0;
+    } else if (uz < 1.0 + std::pow(0.5, m_theta)) {
+      rank = 1;
+    } else {
+      rank = static_cast<uint64_t>(m_n *
+                                   std::pow(m_eta * u - m_eta + 1.0, m_alpha));
+    }
+    return scramble(std::min(rank, m_n - 1)) % m_n;
+  }
+
+private:
+  static auto zeta(uint64_t n, double theta) -> double {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; ++i) {
+      sum += 1.0 / std::pow(static_cast<double>(i), theta);
+    }
+    return sum;
+  }
+  // splitmix64 finalizer
+  static auto scramble(uint64_t x) -> uint64_t {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
+  uint64_t m_n;
+  double m_theta;
+  double m_alpha;
+  double m_zetan;
+  double m_eta;
+};
+
+/// @brief batched reads if the worker has them, one by one otherwise
+template <class Worker>
+auto read_batch(Worker &worker, std::span<const uint64_t> keys) -> uint64_t {
+  if constexpr (requires { worker.read_batch(keys); }) {
+    return worker.read_batch(keys);
+  } else {
+    uint64_t hits = 0;
+    for (uint64_t key : keys) {
+      hits += worker.read(key);
+    }
+    return hits;
+  }
+}
+
+/// @brief the entries with lo <= key < hi, in one range call if the worker
+/// has one, one read per key otherwise
+template <class Worker>
+auto scan(Worker &worker, uint64_t lo, uint64_t hi) -> uint64_t {
+  if constexpr (requires { worker.scan(lo, hi); }) {
+    return worker.scan(lo, hi);
+  } else {
+    uint64_t found = 0;
+    for (uint64_t key = lo; key < hi; ++key) {
+      found += worker.read(key);
+    }
+    return found;
+  }
+}
+
+template <class TableBench>
+BenchResults benchmark(TableBench bench, const BenchConfig &config,
+                       const zipfian_generator *zipf) {
+  std::unique_ptr<typename TableBench::Table> table = bench.get_table();
+
+  BenchResults results{};
+  results.name = TableBench::name();
+  std::vector<BenchResults> per_thread(config.threads);
+
+  using clock = std::chrono::steady_clock;
+  clock::time_point start, end;
+
+  // the first phase to complete is the preload, the second the run
+  std::barrier sync{static_cast<std::ptrdiff_t>(config.threads),
+                    [&, phase = 0]() mutable noexcept {
+                      (phase++ == 0 ? start : end) = clock::now();
+                    }};
+
+  unsigned mix_total = 0;
+  for (unsigned m : config.mix) {
+    mix_total += m;
+  }
+
+  auto job = [&](size_t thread) {
+    typename TableBench::Worker worker{*table};
+    BenchResults &local = per_thread[thread];
+
+    // preload every key, split between the threads
+    for (uint64_t k = thread; k < config.keys; k += config.threads) {
+      worker.upsert(k, k);
+    }
+    sync.arrive_and_wait();
+
+    std::mt19937_64 rng{0x2f2f + thread};
+    std::uniform_int_distribution<uint64_t> uniform{0, config.keys - 1};
+    std::uniform_int_distribution<unsigned> pick{0, mix_total - 1};
+    std::vector<uint64_t> batch_keys(config.batch);
+
+    for (uint64_t i = 0; i < config.ops_per_thread; ++i) {
+      const uint64_t key = zipf ? (*zipf)(rng) : uniform(rng);
+      unsigned p = pick(rng);
+      size_t op = 0;
+      while (p >= config.mix[op]) {
+        p -= config.mix[op];
+        op++;
+      }
+
+      if (op == op_read && config.batch > 1) {
+        // the whole batch counts as `batch` reads at the amortized latency
+        batch_keys[0] = key;
+        for (size_t b = 1; b < config.batch; ++b) {
+          batch_keys[b] = zipf ? (*zipf)(rng) : uniform(rng);
+        }
+        const clock::time_point before = clock::now();
+        local.read_hits += read_batch(worker, batch_keys);
+        const clock::time_point after = clock::now();
+
+        local.ops[op] += config.batch;
+        local.latency[op].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(after -
+                                                                 before)
+                    .count() /
+                config.batch,
+            config.batch);
+        i += config.batch - 1;
+        continue;
+      }
+
+      const clock::time_point before = clock::now();
+      switch (op) {
+      case op_read:
+        local.read_hits += worker.read(key);
+        break;
+      case op_upsert:
+        worker.upsert(key, i);
+        break;
+      case op_rmw:
+        worker.rmw(key);
+        break;
+      case op_delete:
+        worker.erase(key);
+        break;
+      case op_scan:
+        local.scanned += scan(worker, key, key + config.scan_length);
+        break;
+      }
+      const clock::time_point after = clock::now();
+
+      local.ops[op]++;
+      local.latency[op].record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(after - before)
+              .count());
+    }
+
+    // nobody tears down their worker until every thread has stopped touching
+    // the table
+    sync.arrive_and_wait();
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < config.threads; ++i) {
+    threads.emplace_back(job, i);
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  results.seconds = std::chrono::duration<double>(end - start).count();
+  if constexpr (requires { table->collect_stats(); }) {
+    if (config.stats == "json") {
+      results.stats = table->collect_stats().to_json() + "\n";
+    } else if (config.stats == "prometheus") {
+      results.stats = table->collect_stats().to_prometheus();
+    }
+  }
+
+  for (const BenchResults &local : per_thread) {
+    for (size_t op = 0; op < op_count; ++op) {
+      results.ops[op] += local.ops[op];
+      results.latency[op].merge(local.latency[op]);
+    }
+    results.read_hits += local.read_hits;
+    results.scanned += local.scanned;
+  }
+  return results;
+}
+
+/// @brief tftf::faster with a node_resource per worker
+template <class Traits> struct faster_bench {
+  using Table = faster<uint64_t, uint64_t, Traits>;
+
+  struct Worker {
+    explicit Worker(Table &table) : m_table(table) {
+      m_table.register_worker(m_state);
+    }
+    auto read(uint64_t key) -> bool {
+      return m_table.get(m_state, key).has_value();
+    }
+    auto read_batch(std::span<const uint64_t> keys) -> uint64_t {
+      m_out.resize(keys.size());
+      return m_table.get_batch(m_state, keys, m_out);
+    }
+    void upsert(uint64_t key, uint64_t value) {
+      m_table.put(m_state, key, value);
+    }
+    void rmw(uint64_t key) {
+      m_table.upsert_rmw(m_state, key, uint64_t{1},
+                         [](uint64_t v) { return v + 1; });
+    }
+    auto erase(uint64_t key) -> bool { return m_table.erase(m_state, key); }
+    auto scan(uint64_t lo, uint64_t hi) -> uint64_t
+      requires requires(Table &t, worker_state &s, const uint64_t &k) {
+        t.range(s, k, k, [](const uint64_t &, const uint64_t &) {});
+      }
+    {
+      uint64_t found = 0;
+      m_table.range(m_state, lo, hi,
+                    [&](const uint64_t &, const uint64_t &) { found++; });
+      return found;
+    }
+
+    Table &m_table;
+    std::pmr::unsynchronized_pool_resource m_upstream{};
+    // engines that allocate nothing (alloc_size 0) still get a valid resource
+    node_resource<std::max(Table::alloc_size, sizeof(void *))> m_resource{
+        m_upstream};
+    worker_state m_state{m_resource};
+    std::vector<std::optional<uint64_t>> m_out{};
+  };
+
+  static auto name() -> std::string { return Traits::bench_name; }
+  auto get_table() -> std::unique_ptr<Table> {
+    auto table = std::make_unique<Table>(table_size);
+    if (wal) {
+      log = std::make_unique<typename Table::wal_t>(wal_options{
+          .path =
+              (std::filesystem::temp_directory_path() / "tftf_bench.wal")
+                  .string(),
+          .mode = *wal});
+      table->attach_wal(log.get());
+    }
+    return table;
+  }
+
+  size_t table_size{128};
+  std::optional<durability> wal{};
+  // outlives the table, which benchmark() drops first
+  std::unique_ptr<typename Table::wal_t> log{};
+};
+
+struct list_bench_traits : default_faster_traits {
+  static constexpr const char *bench_name = "faster";
+};
+// same list hashing with wyhash instead of the identity
+struct wy_bench_traits : default_faster_traits {
+  static constexpr const char *bench_name = "faster_wy";
+  using hasher = wy_hash;
+};
+// same list with interval based reclamation, to measure what bounding the
+// garbage of a stalled worker costs the readers
+struct interval_bench_traits : default_faster_traits {
+  static constexpr const char *bench_name = "faster_ibr";
+  using reclaim = interval_reclaim;
+};
+struct bucket_bench_traits : default_faster_traits {
+  static constexpr const char *bench_name = "faster_bucket";
+  template <class Key, class Value, class Traits>
+  using engine = bucket_engine<Key, Value, Traits>;
+};
+// same buckets probed with the widest simd kernel, to measure the kernel
+struct simd_bucket_bench_traits : default_faster_traits {
+  static constexpr const char *bench_name = "faster_bucket_simd";
+  template <class Key, class Value, class Traits>
+  using engine = bucket_engine<Key, Value, Traits, probe_for<Key, Value>>;
+};
+
+// records in a log with 64MB of it in memory and the rest in a temp file, run
+// with more --keys than that to see the disk
+struct hybrid_bench_traits : default_faster_traits {
+  static constexpr const char *bench_name = "faster_hybrid";
+  template <class Key, class Value, class Traits>
+  using engine = hybrid_log_engine<Key, Value, Traits>;
+};
+
+// one ordered skip list instead of hash buckets: point ops go O(log n), and
+// scans become a single range() walk
+struct skip_bench_traits : default_faster_traits {
+  static constexpr const char *bench_name = "faster_skip";
+  template <class Key, class Value, class Traits>
+  using engine = skip_list_engine<Key, Value, Traits>;
+};
+
+/// @brief sharded_faster with one default list table per numa node of this
+/// box, workers pinned round robin over the nodes. no wal
+struct sharded_bench {
+  using Table = sharded_faster<uint64_t, uint64_t>;
+
+  struct Worker {
+    explicit Worker(Table &table)
+        : m_table(table), m_worker(table.make_worker()) {}
+    auto read(uint64_t key) -> bool {
+      return m_table.get(m_worker, key).has_value();
+    }
+    void upsert(uint64_t key, uint64_t value) {
+      m_table.put(m_worker, key, value);
+    }
+    void rmw(uint64_t key) {
+      m_table.upsert_rmw(m_worker, key, uint64_t{1},
+                         [](uint64_t v) { return v + 1; });
+    }
+    auto erase(uint64_t key) -> bool { return m_table.erase(m_worker, key); }
+
+    Table &m_table;
+    Table::worker &m_worker;
+  };
+
+  static auto name() -> std::string { return "faster_sharded"; }
+  auto get_table() -> std::unique_ptr<Table> {
+    return std::make_unique<Table>(numa_topology::from_sysfs());
+  }
+};
+
+/// @brief the bucket engine (and the hybrid log's index) doesn't grow, so
+/// size it ~50% full once preloaded
+template <class Traits>
+auto bucket_bench(const BenchConfig &config) -> faster_bench<Traits> {
+  using engine_t = typename faster_bench<Traits>::Table::engine_t;
+  return {.table_size = std::max<size_t>(1, config.keys * 2 / engine_t::slots),
+          .wal = config.wal};
+}
+
+/// @brief the baseline everything gets measured against
+struct locked_map_bench {
+  struct Table {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, uint64_t> map;
+  };
+
+  struct Worker {
+    explicit Worker(Table &table) : m_table(table) {}
+    auto read(uint64_t key) -> bool {
+      std::lock_guard lock{m_table.mutex};
+      return m_table.map.find(key) != m_table.map.end();
+    }
+    void upsert(uint64_t key, uint64_t value) {
+      std::lock_guard lock{m_table.mutex};
+      m_table.map.insert_or_assign(key, value);
+    }
+    void rmw(uint64_t key) {
+      std::lock_guard lock{m_table.mutex};
+      m_table.map[key]++;
+    }
+    auto erase(uint64_t key) -> bool {
+      std::lock_guard lock{m_table.mutex};
+      return m_table.map.erase(key) != 0;
+    }
+
+    Table &m_table;
+  };
+
+  static auto name() -> std::string { return "locked_map"; }
+  auto get_table() -> std::unique_ptr<Table> {
+    return std::make_unique<Table>();
+  }
+};
+
+/// @brief how evenly a hasher spreads a key pattern over a table's buckets
+struct hash_spread {
+  uint64_t max_load{0};
+  // fraction of buckets left empty, ~1/e at one key per bucket
+  double empty{0};
+  // variance over mean of the bucket loads, ~1 for a random hash
+  double dispersion{0};
+  double ns_per_hash{0};
+};
+
+/// @brief the low bits of every key's hash pick its bucket like the engines'
+/// masks do
+template <class Hasher, class Key>
+auto measure_spread(const std::vector<Key> &keys, size_t buckets)
+    -> hash_spread {
+  using clock = std::chrono::steady_clock;
+  std::vector<uint64_t> hashes(keys.size());
+  const clock::time_point start = clock::now();
+  for (size_t i = 0; i < keys.size(); ++i) {
+    hashes[i] = key_hash<Key, Hasher>{}(keys[i]);
+  }
+  const clock::time_point end = clock::now();
+
+  std::vector<uint64_t> load(buckets);
+  for (uint64_t hash : hashes) {
+    load[hash & (buckets - 1)]++;
+  }
+  hash_spread spread{};
+  const double mean = 1.0 * keys.size() / buckets;
+  double variance = 0;
+  for (uint64_t l : load) {
+    spread.max_load = std::max(spread.max_load, l);
+    spread.empty += l == 0;
+    variance += (l - mean) * (l - mean);
+  }
+  spread.empty /= buckets;
+  spread.dispersion = variance / buckets / mean;
+  spread.ns_per_hash =
+      std::chrono::duration<double, std::nano>(end - start).count() /
+      keys.size();
+  return spread;
+}
+
+/// @brief the spread table for the hashers named in --hashes, over as many
+/// buckets as the list engine has once it holds --keys keys
+void report_hashes(const BenchConfig &config) {
+  const size_t buckets = std::bit_ceil(std::max<uint64_t>(
+      1, config.keys / default_faster_traits::max_load_factor));
+  std::vector<uint64_t> sequential(config.keys), strided(config.keys),
+      packed(config.keys);
+  std::vector<std::string> names(config.keys);
+  for (uint64_t i = 0; i < config.keys; ++i) {
+    sequential[i] = i;
+    // aligned ids, like addresses or ids with flag bits below them
+    strided[i] = i << 12;
+    // two 32 bit fields, a small tenant id over a per tenant counter
+    packed[i] = ((i % 64) << 32) | (i / 64);
+    names[i] = "user:" + std::to_string(i);
+  }
+
+  std::cout << "hash spread of " << config.keys << " keys over " << buckets
+            << " buckets\n";
+  std::cout << "  " << std::left << std::setw(12) << "keys" << std::setw(16)
+            << "hasher" << std::right << std::setw(10) << "max" << std::setw(10)
+            << "empty" << std::setw(12) << "dispersion" << std::setw(10)
+            << "ns/hash" << "\n";
+  auto row = [&]<class Hasher, class Key>(std::string_view pattern,
+                                          std::string_view hasher,
+                                          const std::vector<Key> &keys,
+                                          Hasher) {
+    if constexpr (requires(const Key &key) { key_hash<Key, Hasher>{}(key); }) {
+      const hash_spread spread = measure_spread<Hasher>(keys, buckets);
+      std::cout << "  " << std::left << std::setw(12) << pattern
+                << std::setw(16) << hasher << std::right << std::setw(10)
+                << spread.max_load << std::setw(10) << std::fixed
+                << std::setprecision(3) << spread.empty << std::setw(12)
+                << spread.dispersion << std::setw(10) << spread.ns_per_hash
+                << "\n";
+    }
+  };
+  auto rows = [&](std::string_view hasher, auto h) {
+    row("sequential", hasher, sequential, h);
+    row("strided", hasher, strided, h);
+    row("packed", hasher, packed, h);
+    row("strings", hasher, names, h);
+  };
+  for (const std::string &hasher : config.hashers) {
+    if (hasher == "std") {
+      rows(hasher, std_hash{});
+    } else if (hasher == "multiply_shift") {
+      rows(hasher, multiply_shift_hash{});
+    } else if (hasher == "wy") {
+      rows(hasher, wy_hash{});
+    } else {
+      throw std::invalid_argument("unknown hasher " + hasher);
+    }
+  }
+}
+
+// a row of the results table
+void print_row(std::string_view op, uint64_t count, double seconds,
+               const latency_histogram &h) {
+  std::cout << "  " << std::left << std::setw(8) << op << std::right
+            << std::setw(12) << count << std::setw(10) << std::fixed
+            << std::setprecision(3) << count / seconds / 1e6 << std::setw(10)
+            << h.percentile(0.5) << std::setw(10) << h.percentile(0.99)
+            << std::setw(10) << h.percentile(0.999) << "\n";
+}
+
+void print_results(const BenchResults &results) {
+  uint64_t total = 0;
+  latency_histogram all{};
+  std::cout << results.name << ": " << std::fixed << std::setprecision(3)
+            << results.seconds << "s\n";
+  std::cout << "  " << std::left << std::setw(8) << "op" << std::right
+            << std::setw(12) << "count" << std::setw(10) << "Mops/s"
+            << std::setw(10) << "p50(ns)" << std::setw(10) << "p99(ns)"
+            << std::setw(10) << "p999(ns)" << "\n";
+  for (size_t op = 0; op < op_count; ++op) {
+    total += results.ops[op];
+    all.merge(results.latency[op]);
+    if (results.ops[op] != 0) {
+      print_row(op_names[op], results.ops[op], results.seconds,
+                results.latency[op]);
+    }
+  }
+  print_row("total", total, results.seconds, all);
+  if (results.ops[op_read] != 0) {
+    std::cout << "  read hit rate " << std::setprecision(4)
+              << 1.0 * results.read_hits / results.ops[op_read] << "\n";
+  }
+  if (results.ops[op_scan] != 0) {
+    std::cout << "  entries per scan " << std::setprecision(1)
+              << 1.0 * results.scanned / results.ops[op_scan] << "\n";
+  }
+  std::cout << results.stats;
+}
+
+auto split(std::string_view s, char sep) -> std::vector<std::string> {
+  std::vector<std::string> out;
+  size_t begin = 0;
+  while (true) {
+    const size_t end = s.find(sep, begin);
+    out.emplace_back(s.substr(begin, end - begin));
+    if (end == std::string_view::npos) {
+      return out;
+    }
+    begin = end + 1;
+  }
+}
+
+auto parse_args(int argc, char **argv) -> BenchConfig {
+  BenchConfig config{};
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      config.help = true;
+      return config;
+    }
+    if (i + 1 >= argc) {
+      throw std::invalid_argument("missing value for " + std::string{arg});
+    }
+    const std::string_view value = argv[++i];
+    if (arg == "--threads") {
+      config.threads = std::stoull(std::string{value});
+    } else if (arg == "--keys") {
+      config.keys = std::stoull(std::string{value});
+    } else if (arg == "--ops") {
+      config.ops_per_thread = std::stoull(std::string{value});
+    } else if (arg == "--dist") {
+      if (value != "uniform" && value != "zipf") {
+        throw std::invalid_argument("unknown dist " + std::string{value});
+      }
+      config.zipf = value == "zipf";
+    } else if (arg == "--theta") {
+      config.theta = std::stod(std::string{value});
+      // zipfian_generator divides by 1 - theta, and past 1 zeta blows up
+      if (!(config.theta >= 0.0 && config.theta < 1.0)) {
+        throw std::invalid_argument("theta must be in [0, 1)");
+      }
+    } else if (arg == "--mix") {
+      const auto parts = split(value, ':');
+      // the scan share is optional and 0 if left out
+      if (parts.size() != op_count && parts.size() != op_count - 1) {
+        throw std::invalid_argument("mix is read:upsert:rmw:delete[:scan]");
+      }
+      config.mix = {};
+      for (size_t op = 0; op < parts.size(); ++op) {
+        config.mix[op] = std::stoul(parts[op]);
+      }
+    } else if (arg == "--batch") {
+      config.batch = std::max<size_t>(1, std::stoull(std::string{value}));
+    } else if (arg == "--scan-length") {
+      config.scan_length = std::stoull(std::string{value});
+    } else if (arg == "--table") {
+      config.tables = split(value, ',');
+      if (value == "none") {
+        config.tables.clear();
+      }
+    } else if (arg == "--hashes") {
+      config.hashers = split(value, ',');
+    } else if (arg == "--stats") {
+      if (value != "json" && value != "prometheus") {
+        throw std::invalid_argument("unknown stats format " +
+                                    std::string{value});
+      }
+      config.stats = value;
+    } else if (arg == "--wal") {
+      if (value == "none") {
+        config.wal.reset();
+      } else if (value == "async") {
+        config.wal = durability::async;
+      } else if (value == "sync") {
+        config.wal = durability::group_sync;
+      } else {
+        throw std::invalid_argument("unknown wal mode " + std::string{value});
+      }
+    } else {
+      throw std::invalid_argument("unknown flag " + std::string{arg});
+    }
+  }
+  if (config.threads == 0 || config.keys == 0) {
+    throw std::invalid_argument("need at least one thread and one key");
+  }
+  unsigned mix_total = 0;
+  for (unsigned m : config.mix) {
+    mix_total += m;
+  }
+  if (mix_total == 0) {
+    throw std::invalid_argument("mix can't be all zero");
+  }
+  return config;
 }
 } // namespace tftf
+
+auto main(int argc, char **argv) -> int {
+  tftf::BenchConfig config;
+  try {
+    config = tftf::parse_args(argc, argv);
+  } catch (const std::exception &e) {
+    std::cerr << "bench: " << e.what() << "\n" << tftf::usage;
+    return 1;
+  }
+  if (config.help) {
+    std::cout << tftf::usage;
+    return 0;
+  }
+
+  std::unique_ptr<tftf::zipfian_generator> zipf;
+  if (config.zipf) {
+    zipf = std::make_unique<tftf::zipfian_generator>(config.keys, config.theta);
+  }
+
+  std::cout << "threads=" << config.threads << " keys=" << config.keys
+            << " ops/thread=" << config.ops_per_thread
+            << " batch=" << config.batch << " dist=";
+  if (config.zipf) {
+    std::cout << "zipf(" << config.theta << ")";
+  } else {
+    std::cout << "uniform";
+  }
+  std::cout << " mix=" << config.mix[0] << ":" << config.mix[1] << ":"
+            << config.mix[2] << ":" << config.mix[3] << ":" << config.mix[4];
+  if (config.mix[tftf::op_scan] != 0) {
+    std::cout << " scan_length=" << config.scan_length;
+  }
+  if (config.wal) {
+    std::cout << " wal="
+              << (*config.wal == tftf::durability::async ? "async" : "sync");
+  }
+  std::cout << "\n";
+
+  if (!config.hashers.empty()) {
+    try {
+      tftf::report_hashes(config);
+    } catch (const std::exception &e) {
+      std::cerr << "bench: " << e.what() << "\n";
+      return 1;
+    }
+  }
+
+  for (const std::string &table : config.tables) {
+    if (table == "faster") {
+      tftf::print_results(tftf::benchmark(
+          tftf::faster_bench<tftf::list_bench_traits>{.wal = config.wal},
+          config, zipf.get()));
+    } else if (table == "faster_wy") {
+      tftf::print_results(tftf::benchmark(
+          tftf::faster_bench<tftf::wy_bench_traits>{.wal = config.wal}, config,
+          zipf.get()));
+    } else if (table == "faster_ibr") {
+      tftf::print_results(tftf::benchmark(
+          tftf::faster_bench<tftf::interval_bench_traits>{.wal = config.wal},
+          config, zipf.get()));
+    } else if (table == "faster_bucket") {
+      tftf::print_results(tftf::benchmark(
+          tftf::bucket_bench<tftf::bucket_bench_traits>(config), config,
+          zipf.get()));
+    } else if (table == "faster_bucket_simd") {
+      tftf::print_results(tftf::benchmark(
+          tftf::bucket_bench<tftf::simd_bucket_bench_traits>(config), config,
+          zipf.get()));
+    } else if (table == "faster_hybrid") {
+      tftf::print_results(tftf::benchmark(
+          tftf::bucket_bench<tftf::hybrid_bench_traits>(config), config,
+          zipf.get()));
+    } else if (table == "faster_skip") {
+      tftf::print_results(tftf::benchmark(
+          tftf::faster_bench<tftf::skip_bench_traits>{.wal = config.wal},
+          config, zipf.get()));
+    } else if (table == "faster_sharded") {
+      tftf::print_results(
+          tftf::benchmark(tftf::sharded_bench{}, config, zipf.get()));
+    } else if (table == "locked_map") {
+      tftf::print_results(
+          tftf::benchmark(tftf::locked_map_bench{}, config, zipf.get()));
+    } else {
+      std::cerr << "bench: unknown table " << table << "\n";
+      return 1;
+    }
+  }
+}
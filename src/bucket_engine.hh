@@ -0,0 +1,432 @@
+#pragma once
+
+#include "common.hh"
+#include "hash.hh"
+#include "probe.hh"
+#include "state.hh"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+namespace tftf {
+
+/// @brief open addressing storage engine for faster, laid out like FASTER's
+/// hash index: cache line aligned buckets of `slots` entries stored inline,
+/// with a tag byte per entry and a chain of overflow buckets when the home
+/// bucket fills up. A lookup checks all the tags at once with the `Probe`
+/// kernel (see probe.hh, scalar unless probe_for is passed) and usually only
+/// touches the bucket's first line plus the line holding the matching entry.
+///
+/// readers are optimistic (a seqlock per bucket, so they never write shared
+/// memory), writers serialize on their home bucket's lock bit. entries never
+/// move, so erase just clears the tag. The bucket count is fixed at
+/// construction, size it up front.
+///
+/// keys and values are copied racily and then validated, so both have to be
+/// trivially copyable
+template <class Key, class Value, class Traits,
+          class Probe = scalar_probe>
+class bucket_engine {
+  static_assert(std::is_trivially_copyable_v<Key> &&
+                    std::is_trivially_copyable_v<Value>,
+                "bucket_engine stores keys and values inline");
+
+public:
+  // nothing comes out of the workers' resources
+  static constexpr size_t alloc_size = 0;
+  static constexpr size_t alloc_align = 1;
+  static constexpr size_t slots = Probe::width;
+
+  bucket_engine(std::size_t table_size)
+      : m_mask(std::bit_ceil(std::max<std::size_t>(table_size, 1)) - 1),
+        m_buckets(new bucket[m_mask + 1]) {}
+
+  bucket_engine(const bucket_engine &) = delete;
+  bucket_engine &operator=(const bucket_engine &) = delete;
+
+  ~bucket_engine() {
+    for (size_t i = 0; i <= m_mask; ++i) {
+      bucket *b = m_buckets[i].overflow.load(std::memory_order_acquire);
+      while (b != nullptr) {
+        bucket *next = b->overflow.load(std::memory_order_acquire);
+        delete b;
+        b = next;
+      }
+    }
+  }
+
+  auto get(worker_state &state, const Key &key) -> std::optional<Value> {
+    return get_hashed(state, hash_of(key), key);
+  }
+
+  template <class Key_, class Value_>
+  auto put(worker_state &state, Key_ &&key, Value_ &&value) -> bool {
+    const Key k(std::forward<Key_>(key));
+    return put_hashed(state, hash_of(k), k, std::forward<Value_>(value));
+  }
+
+  /// @brief get with the key's hash already computed
+  auto get_hashed(worker_state &state, uint64_t hash, const Key &key)
+      -> std::optional<Value> {
+    const uint8_t tag = tag_of(hash);
+
+    bucket *b = &m_buckets[hash & m_mask];
+    while (b != nullptr) {
+      const uint64_t version = b->version.load(std::memory_order_acquire);
+      if (version & 1) {
+        cpu_relax();
+        continue;
+      }
+      std::optional<Value> found{};
+      for (auto m = Probe::match(b->tags, tag); m != 0; m &= m - 1) {
+        const entry e = b->load(slot_of(m));
+        if (e.key == key) {
+          found = e.value;
+          break;
+        }
+      }
+      bucket *next = b->overflow.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (b->version.load(std::memory_order_relaxed) != version) {
+        // a writer got in, reread this bucket
+        state.count(table_event::read_retries);
+        continue;
+      }
+      if (found) {
+        return found;
+      }
+      b = next;
+    }
+    return std::nullopt;
+  }
+
+  /// @brief put with the key's hash already computed
+  template <class Value_>
+  auto put_hashed(worker_state &state, uint64_t hash, const Key &k,
+                  Value_ &&value) -> bool {
+    return upsert_hashed(state, hash, k,
+                         [&](const std::optional<Value> &) -> Value {
+                           return Value(value);
+                         });
+  }
+
+  /// @brief insert or overwrite with fn(old) -> new, where old is nullopt if
+  /// the key isn't there. fn runs under the home bucket's lock like update's.
+  /// returns if the key was inserted
+  template <class UpsertFn>
+  auto upsert(worker_state &state, const Key &key, UpsertFn &&fn) -> bool {
+    return upsert_hashed(state, hash_of(key), key, std::forward<UpsertFn>(fn));
+  }
+
+  template <class UpsertFn>
+  auto upsert_hashed(worker_state & /* state */, uint64_t hash, const Key &k,
+                     UpsertFn &&fn) -> bool {
+    const uint8_t tag = tag_of(hash);
+
+    bucket &home = m_buckets[hash & m_mask];
+    const uint64_t version = lock(home);
+    auto unlock_on_exit =
+        tftf::on_scope_exit([&]() { unlock(home, version); });
+
+    bucket *free_bucket = nullptr;
+    size_t free_slot = 0;
+    bucket *last = &home;
+    for (bucket *b = &home; b != nullptr;
+         b = b->overflow.load(std::memory_order_relaxed)) {
+      if (const int i = b->find(tag, k); i >= 0) {
+        const Value updated = fn(std::optional<Value>{b->load(i).value});
+        write(home, *b, [&] { b->store_value(i, updated); });
+        return false;
+      }
+      if (const auto empty = Probe::match(b->tags, 0);
+          free_bucket == nullptr && empty != 0) {
+        free_bucket = b;
+        free_slot = slot_of(empty);
+      }
+      last = b;
+    }
+
+    const Value value = fn(std::optional<Value>{});
+    if (free_bucket == nullptr) {
+      // fill the new bucket before anyone can see it
+      bucket *fresh = new bucket{};
+      fresh->store(0, k, value);
+      fresh->tags[0] = tag;
+      last->overflow.store(fresh, std::memory_order_release);
+    } else {
+      write(home, *free_bucket, [&] {
+        free_bucket->store(free_slot, k, value);
+        free_bucket->set_tag(free_slot, tag);
+      });
+    }
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /// @brief look up a batch of keys: every home bucket is prefetched, then
+  /// every tag group is probed and the first candidate entry prefetched,
+  /// before any key is compared. returns how many were found
+  auto get_batch(worker_state &state, std::span<const Key> keys,
+                 std::span<std::optional<Value>> out) -> size_t {
+    assert(out.size() >= keys.size());
+    size_t found = 0;
+    for (size_t base = 0; base < keys.size(); base += batch_window) {
+      const size_t n = std::min(batch_window, keys.size() - base);
+      uint64_t hashes[batch_window];
+      prefetch_homes(keys.subspan(base, n), hashes);
+      for (size_t i = 0; i < n; ++i) {
+        const bucket &home = m_buckets[hashes[i] & m_mask];
+        if (const auto m = Probe::match(home.tags, tag_of(hashes[i]))) {
+          __builtin_prefetch(home.storage + slot_of(m) * sizeof(entry));
+        }
+      }
+      for (size_t i = 0; i < n; ++i) {
+        out[base + i] = get_hashed(state, hashes[i], keys[base + i]);
+        found += out[base + i].has_value();
+      }
+    }
+    return found;
+  }
+
+  /// @brief insert/overwrite a batch with every home bucket prefetched
+  /// first. returns how many were inserted
+  auto put_batch(worker_state &state, std::span<const Key> keys,
+                 std::span<const Value> values) -> size_t {
+    assert(values.size() >= keys.size());
+    size_t inserted = 0;
+    for (size_t base = 0; base < keys.size(); base += batch_window) {
+      const size_t n = std::min(batch_window, keys.size() - base);
+      uint64_t hashes[batch_window];
+      prefetch_homes(keys.subspan(base, n), hashes);
+      for (size_t i = 0; i < n; ++i) {
+        inserted +=
+            put_hashed(state, hashes[i], keys[base + i], values[base + i]);
+      }
+    }
+    return inserted;
+  }
+
+  /// @brief fn runs under the home bucket's lock, so concurrent updates of a
+  /// key are never lost
+  template <class UpdateFn>
+  auto update(worker_state &state, const Key &key, UpdateFn &&fn)
+      -> std::optional<Value> {
+    return update_hashed(state, hash_of(key), key, std::forward<UpdateFn>(fn));
+  }
+
+  template <class UpdateFn>
+  auto update_hashed(worker_state & /* state */, uint64_t hash,
+                     const Key &key, UpdateFn &&fn) -> std::optional<Value> {
+    const uint8_t tag = tag_of(hash);
+
+    bucket &home = m_buckets[hash & m_mask];
+    const uint64_t version = lock(home);
+    auto unlock_on_exit =
+        tftf::on_scope_exit([&]() { unlock(home, version); });
+
+    for (bucket *b = &home; b != nullptr;
+         b = b->overflow.load(std::memory_order_relaxed)) {
+      if (const int i = b->find(tag, key); i >= 0) {
+        const Value old = b->load(i).value;
+        const Value updated = fn(old);
+        write(home, *b, [&] { b->store_value(i, updated); });
+        return old;
+      }
+    }
+    return std::nullopt;
+  }
+
+  /// @brief update with fn if the key is there, insert `init` if not. one
+  /// trip through the lock. returns the old value, nullopt if we inserted
+  template <class Fn>
+  auto upsert_rmw(worker_state &state, const Key &key, const Value &init,
+                  Fn &&fn) -> std::optional<Value> {
+    std::optional<Value> old;
+    upsert(state, key, [&](const std::optional<Value> &current) -> Value {
+      old = current;
+      return current ? fn(*current) : init;
+    });
+    return old;
+  }
+
+  auto erase(worker_state &state, const Key &key) -> bool {
+    return erase_hashed(state, hash_of(key), key);
+  }
+
+  auto erase_hashed(worker_state & /* state */, uint64_t hash, const Key &key)
+      -> bool {
+    const uint8_t tag = tag_of(hash);
+
+    bucket &home = m_buckets[hash & m_mask];
+    const uint64_t version = lock(home);
+    auto unlock_on_exit =
+        tftf::on_scope_exit([&]() { unlock(home, version); });
+
+    for (bucket *b = &home; b != nullptr;
+         b = b->overflow.load(std::memory_order_relaxed)) {
+      if (const int i = b->find(tag, key); i >= 0) {
+        write(home, *b, [&] { b->set_tag(i, 0); });
+        m_count.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// @brief visit the entries of home buckets [first, last) as fn(key, value).
+  /// each chain is copied optimistically and validated against the home
+  /// version, so fn never runs with a lock held and sees each chain as of a
+  /// single moment. `buckets` is always bucket_count() here
+  template <class Fn>
+  void for_each(worker_state & /* state */, size_t first, size_t last,
+                size_t buckets, Fn &&fn) {
+    assert(buckets == m_mask + 1);
+    (void)buckets;
+    std::vector<entry> chain;
+    for (size_t i = first; i < last; ++i) {
+      const bucket &home = m_buckets[i];
+      while (true) {
+        const uint64_t version = home.version.load(std::memory_order_acquire);
+        if (version & 1) {
+          cpu_relax();
+          continue;
+        }
+        chain.clear();
+        for (const bucket *b = &home; b != nullptr;
+             b = b->overflow.load(std::memory_order_acquire)) {
+          for (size_t slot = 0; slot < slots; ++slot) {
+            if (b->tag(slot) != 0) {
+              chain.push_back(b->load(slot));
+            }
+          }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (home.version.load(std::memory_order_relaxed) == version) {
+          break;
+        }
+      }
+      for (const entry &e : chain) {
+        fn(e.key, e.value);
+      }
+    }
+  }
+
+  auto size() const -> std::size_t {
+    return m_count.load(std::memory_order_relaxed);
+  }
+  auto bucket_count() const -> std::size_t { return m_mask + 1; }
+
+private:
+  struct entry {
+    Key key;
+    Value value;
+  };
+
+  struct alignas(64) bucket {
+    // odd while a writer is in the bucket. the home bucket's version doubles
+    // as the lock for its whole overflow chain
+    tftf::atomic<uint64_t> version{0};
+    tftf::atomic<bucket *> overflow{nullptr};
+    // one byte per slot, 0 is empty. written through atomic_ref, read a whole
+    // group at a time by the probe and validated like the entries
+    alignas(16) uint8_t tags[slots]{};
+    alignas(entry) unsigned char storage[sizeof(entry) * slots];
+
+    auto load(size_t i) const -> entry {
+      std::array<unsigned char, sizeof(entry)> raw;
+      std::memcpy(raw.data(), storage + i * sizeof(entry), sizeof(entry));
+      return std::bit_cast<entry>(raw);
+    }
+    void store(size_t i, const Key &key, const Value &value) {
+      const entry e{key, value};
+      std::memcpy(storage + i * sizeof(entry), static_cast<const void *>(&e),
+                  sizeof(entry));
+    }
+    void store_value(size_t i, const Value &value) {
+      std::memcpy(storage + i * sizeof(entry) + offsetof(entry, value),
+                  static_cast<const void *>(&value), sizeof(Value));
+    }
+    auto tag(size_t i) const -> uint8_t {
+      return std::atomic_ref<uint8_t>(const_cast<uint8_t &>(tags[i]))
+          .load(std::memory_order_relaxed);
+    }
+    void set_tag(size_t i, uint8_t tag) {
+      std::atomic_ref<uint8_t>(tags[i]).store(tag, std::memory_order_relaxed);
+    }
+    /// @brief slot holding key, or -1. only for writers holding the lock
+    auto find(uint8_t tag, const Key &key) const -> int {
+      for (auto m = Probe::match(tags, tag); m != 0; m &= m - 1) {
+        const size_t i = slot_of(m);
+        if (load(i).key == key) {
+          return static_cast<int>(i);
+        }
+      }
+      return -1;
+    }
+  };
+
+  // lookups in flight per batch round
+  static constexpr size_t batch_window = 16;
+
+  void prefetch_homes(std::span<const Key> keys, uint64_t *hashes) const {
+    for (size_t i = 0; i < keys.size(); ++i) {
+      hashes[i] = hash_of(keys[i]);
+      __builtin_prefetch(&m_buckets[hashes[i] & m_mask]);
+    }
+  }
+
+  static auto hash_of(const Key &key) -> uint64_t {
+    return key_hash<Key, typename Traits::hasher>{}(key);
+  }
+  /// @brief 7 bits of fingerprint with the top bit set so it's never empty.
+  /// taken from a remix of the hash since the low bits already picked the
+  /// bucket (and the default hash of an integer is the identity)
+  static auto tag_of(uint64_t hash) -> uint8_t {
+    return 0x80 | static_cast<uint8_t>((hash * 0x9e3779b97f4a7c15ull) >> 57);
+  }
+
+  template <class Mask> static auto slot_of(Mask matches) -> size_t {
+    return std::countr_zero(matches) >> Probe::slot_shift;
+  }
+
+  static auto lock(bucket &home) -> uint64_t {
+    while (true) {
+      uint64_t version = home.version.load(std::memory_order_relaxed);
+      if (!(version & 1) &&
+          home.version.compare_exchange_weak(version, version + 1,
+                                             std::memory_order_acquire)) {
+        return version + 1;
+      }
+      cpu_relax();
+    }
+  }
+  static void unlock(bucket &home, uint64_t version) {
+    home.version.store(version + 1, std::memory_order_release);
+  }
+  /// @brief modify a bucket in home's chain, home's own version is already
+  /// odd from the lock
+  template <class Fn> static void write(bucket &home, bucket &b, Fn &&fn) {
+    if (&b == &home) {
+      fn();
+      return;
+    }
+    b.version.fetch_add(1, std::memory_order_acq_rel);
+    fn();
+    b.version.fetch_add(1, std::memory_order_release);
+  }
+
+  const uint64_t m_mask;
+  std::unique_ptr<bucket[]> m_buckets;
+  tftf::atomic<size_t> m_count{0};
+};
+} // namespace tftf
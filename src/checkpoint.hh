@@ -0,0 +1,239 @@
+#pragma once
+/// checkpoints: a fuzzy snapshot of a faster table written to a flat binary
+/// file while writers keep going, and a restore that maps the file and bulk
+/// loads it with put_batch.
+///
+/// like FASTER's fuzzy checkpoints, the snapshot isn't a single instant: every
+/// entry that exists for the whole scan is in it, entries changed during the
+/// scan may or may not be. replaying a write-ahead log rotated in right
+/// before the scan on top of the restored table (see wal.hh) brings it to a
+/// consistent state. the header records the table's epoch before and after
+/// the scan.
+///
+/// file layout (native endianness, everything 8 byte aligned):
+///   checkpoint_header
+///   chunks: { uint64_t count; Key keys[count]; pad; Value values[count]; pad }
+/// keys and values are stored column-wise per chunk so restore can hand them
+/// straight to put_batch
+
+#include "faster.hh"
+#include "io.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace tftf {
+
+struct checkpoint_header {
+  char magic[8];
+  std::uint32_t key_size;
+  std::uint32_t value_size;
+  // entries and chunks in the file
+  std::uint64_t count;
+  std::uint64_t chunks;
+  // the table's epoch when the scan started / finished
+  std::uint64_t start_epoch;
+  std::uint64_t end_epoch;
+  // bucket count of the table when the scan started, to presize the restore
+  std::uint64_t bucket_count;
+};
+
+namespace detail {
+inline constexpr char checkpoint_magic[8] = {'t', 'f', 't', 'f',
+                                             'c', 'k', 'p', '1'};
+// entries per chunk
+inline constexpr std::size_t checkpoint_chunk = 4'096;
+
+constexpr auto pad8(std::size_t bytes) -> std::size_t {
+  return (bytes + 7) & ~std::size_t{7};
+}
+} // namespace detail
+
+/// @brief write a fuzzy checkpoint of `table` to `path`. writers are never
+/// stopped, the scan takes epoch guards per bucket like for_each. the file
+/// is written next to `path` and renamed over it once it's synced, so a
+/// crash mid-checkpoint leaves the previous one in place
+template <class Key, class Value, class Traits>
+auto write_checkpoint(faster<Key, Value, Traits> &table, worker_state &state,
+                      const std::string &path) -> checkpoint_header {
+  static_assert(std::is_trivially_copyable_v<Key> &&
+                    std::is_trivially_copyable_v<Value>,
+                "checkpoints copy keys and values byte for byte");
+  static_assert(alignof(Key) <= 8 && alignof(Value) <= 8);
+
+  const std::string tmp = path + ".tmp";
+  const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    detail::throw_errno("open " + tmp);
+  }
+  auto close_on_exit = on_scope_exit([fd]() { ::close(fd); });
+
+  checkpoint_header header{};
+  std::memcpy(header.magic, detail::checkpoint_magic, sizeof(header.magic));
+  header.key_size = sizeof(Key);
+  header.value_size = sizeof(Value);
+  header.bucket_count = table.bucket_count();
+  header.start_epoch = table.current_epoch();
+  // placeholder, rewritten once we know the counts
+  detail::write_all(fd, &header, sizeof(header), tmp);
+
+  // one chunk is staged column-wise, then written with its padding
+  std::vector<std::byte> out;
+  out.reserve(sizeof(std::uint64_t) +
+              detail::pad8(detail::checkpoint_chunk * sizeof(Key)) +
+              detail::pad8(detail::checkpoint_chunk * sizeof(Value)));
+  std::vector<Key> keys;
+  std::vector<Value> values;
+  keys.reserve(detail::checkpoint_chunk);
+  values.reserve(detail::checkpoint_chunk);
+
+  auto flush_chunk = [&]() {
+    if (keys.empty()) {
+      return;
+    }
+    const std::uint64_t count = keys.size();
+    const std::size_t key_bytes = detail::pad8(count * sizeof(Key));
+    const std::size_t value_bytes = detail::pad8(count * sizeof(Value));
+    out.assign(sizeof(count) + key_bytes + value_bytes, std::byte{0});
+    std::memcpy(out.data(), &count, sizeof(count));
+    std::memcpy(out.data() + sizeof(count), keys.data(), count * sizeof(Key));
+    std::memcpy(out.data() + sizeof(count) + key_bytes, values.data(),
+                count * sizeof(Value));
+    detail::write_all(fd, out.data(), out.size(), tmp);
+    header.count += count;
+    header.chunks++;
+    keys.clear();
+    values.clear();
+  };
+
+  table.for_each(state, [&](const Key &key, const Value &value) {
+    keys.push_back(key);
+    values.push_back(value);
+    if (keys.size() == detail::checkpoint_chunk) {
+      flush_chunk();
+    }
+  });
+  flush_chunk();
+  header.end_epoch = table.current_epoch();
+
+  if (::pwrite(fd, &header, sizeof(header), 0) !=
+      static_cast<ssize_t>(sizeof(header))) {
+    detail::throw_errno("write " + tmp);
+  }
+  if (::fdatasync(fd) != 0) {
+    detail::throw_errno("fdatasync " + tmp);
+  }
+  if (::rename(tmp.c_str(), path.c_str()) != 0) {
+    detail::throw_errno("rename " + tmp);
+  }
+  return header;
+}
+
+/// @brief a checkpoint file mapped read-only. construct the table with
+/// `bucket_count()` buckets and `load_into` it
+class checkpoint_reader {
+public:
+  explicit checkpoint_reader(const std::string &path) : m_path(path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      detail::throw_errno("open " + path);
+    }
+    auto close_on_exit = on_scope_exit([fd]() { ::close(fd); });
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      detail::throw_errno("stat " + path);
+    }
+    m_size = static_cast<std::size_t>(st.st_size);
+    if (m_size < sizeof(checkpoint_header)) {
+      throw std::runtime_error(path + ": too small to be a checkpoint");
+    }
+    // the whole file gets read front to back, so fault it in up front
+    void *data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                        fd, 0);
+    if (data == MAP_FAILED) {
+      detail::throw_errno("mmap " + path);
+    }
+    m_data = static_cast<const std::byte *>(data);
+    ::madvise(data, m_size, MADV_SEQUENTIAL);
+
+    std::memcpy(&m_header, m_data, sizeof(m_header));
+    if (std::memcmp(m_header.magic, detail::checkpoint_magic,
+                    sizeof(m_header.magic)) != 0) {
+      ::munmap(data, m_size);
+      throw std::runtime_error(path + ": not a checkpoint");
+    }
+  }
+
+  checkpoint_reader(const checkpoint_reader &) = delete;
+  checkpoint_reader &operator=(const checkpoint_reader &) = delete;
+
+  ~checkpoint_reader() {
+    ::munmap(const_cast<std::byte *>(m_data), m_size);
+  }
+
+  auto header() const -> const checkpoint_header & { return m_header; }
+  auto count() const -> std::size_t { return m_header.count; }
+  /// @brief what to construct the table with so it doesn't have to grow (or,
+  /// for fixed size engines, is sized like the original)
+  auto bucket_count() const -> std::size_t { return m_header.bucket_count; }
+
+  /// @brief put every entry into `table`, a chunk at a time through
+  /// put_batch. returns how many were inserted
+  template <class Key, class Value, class Traits>
+  auto load_into(faster<Key, Value, Traits> &table, worker_state &state) const
+      -> std::size_t {
+    static_assert(std::is_trivially_copyable_v<Key> &&
+                      std::is_trivially_copyable_v<Value>,
+                  "checkpoints copy keys and values byte for byte");
+    static_assert(alignof(Key) <= 8 && alignof(Value) <= 8);
+    if (m_header.key_size != sizeof(Key) ||
+        m_header.value_size != sizeof(Value)) {
+      throw std::runtime_error(m_path + ": key/value sizes don't match");
+    }
+
+    std::size_t inserted = 0;
+    std::size_t offset = sizeof(checkpoint_header);
+    for (std::uint64_t chunk = 0; chunk < m_header.chunks; ++chunk) {
+      std::uint64_t count;
+      if (offset + sizeof(count) > m_size) {
+        throw std::runtime_error(m_path + ": truncated");
+      }
+      std::memcpy(&count, m_data + offset, sizeof(count));
+      offset += sizeof(count);
+      const std::size_t key_bytes = detail::pad8(count * sizeof(Key));
+      const std::size_t value_bytes = detail::pad8(count * sizeof(Value));
+      if (count > detail::checkpoint_chunk ||
+          offset + key_bytes + value_bytes > m_size) {
+        throw std::runtime_error(m_path + ": truncated");
+      }
+      // the mapping is page aligned and every section 8 byte aligned
+      const std::span<const Key> keys{
+          reinterpret_cast<const Key *>(m_data + offset), count};
+      const std::span<const Value> values{
+          reinterpret_cast<const Value *>(m_data + offset + key_bytes), count};
+      inserted += table.put_batch(state, keys, values);
+      offset += key_bytes + value_bytes;
+    }
+    return inserted;
+  }
+
+private:
+  std::string m_path;
+  const std::byte *m_data{nullptr};
+  std::size_t m_size{0};
+  checkpoint_header m_header{};
+};
+
+} // namespace tftf
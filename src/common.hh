@@ -1,8 +1,16 @@
 #pragma once
 
 #include <atomic>
+#include <cstddef>
+#include <thread>
 #include <type_traits>
 
+#if defined(__linux__)
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace tftf {
 template <class T> class atomic : public std::atomic<T> {
 public:
@@ -17,6 +25,60 @@ public:
   }
 };
 
+/// @brief what we pad shared atomics to. this is
+/// std::hardware_destructive_interference_size on every target we build for,
+/// but gcc warns (-Winterference-size) about using that one in a header since
+/// it changes with -mtune
+inline constexpr std::size_t cache_line = 64;
+
+/// @brief a T alone on its cache line(s), for per-worker slots in arrays
+template <class T> struct alignas(cache_line) padded {
+  T value{};
+};
+
+/// @brief whether the kernel will run a full barrier on every thread of the
+/// process for us (linux membarrier). registered once, on first use
+inline auto membarrier_available() -> bool {
+#if defined(__linux__) && defined(SYS_membarrier)
+  static const bool available =
+      syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) ==
+      0;
+  return available;
+#else
+  return false;
+#endif
+}
+
+/// @brief asymmetric fences: `light_fence` on the hot side is only a compiler
+/// barrier when membarrier works, and the rare side pays for both with
+/// `heavy_fence`. together they order a store before a later load like a
+/// seq_cst fence on each side would
+inline void light_fence() {
+  if (membarrier_available()) [[likely]] {
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  } else {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+inline void heavy_fence() {
+#if defined(__linux__) && defined(SYS_membarrier)
+  if (membarrier_available()) [[likely]] {
+    syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    return;
+  }
+#endif
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+/// @brief spin-wait hint
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
 template <class F> struct ScopeExit {
   template <class F_>
     requires std::is_convertible_v<F_, F>
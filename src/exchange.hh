@@ -0,0 +1,180 @@
+#pragma once
+/// lock-free exchange of free blocks between node_resources, so memory erased
+/// on one worker can be reused by another (see slab_options::exchange)
+
+#include "common.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+namespace tftf {
+
+/// @brief a chain of free blocks linked through their first word (see
+/// get_link), last's link is ignored
+struct block_batch {
+  void *first{nullptr};
+  void *last{nullptr};
+  std::size_t count{0};
+};
+
+/// @brief bounded MPMC queue of block batches (Vyukov's array queue). Only
+/// the batch descriptors live in the queue, it never dereferences a block, so
+/// a block being reused by its new owner can't confuse anyone and no ABA
+/// tagging is needed. Every resource sharing an exchange must hand out the
+/// same block size, and carve it out of slabs of the same size (a block
+/// finds its slab header by masking with it): resources check in with
+/// `attach`, which refuses any that don't match the first.
+///
+/// blocks outlive the resource that carved them (another worker's table
+/// nodes, our queue, someone's freelist), so a resource that goes away hands
+/// its slabs to `adopt` and we give them back upstream in our destructor. the
+/// exchange has to outlive every resource on it, and their upstreams have to
+/// outlive the exchange
+class block_exchange {
+public:
+  /// @brief room for `capacity` batches (rounded up to a power of two) of
+  /// `batch_blocks` blocks each
+  explicit block_exchange(std::size_t capacity = 1'024,
+                          std::size_t batch_blocks = 256)
+      : m_mask(std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1),
+        m_batch_blocks(batch_blocks), m_cells(new cell[m_mask + 1]) {
+    for (std::size_t i = 0; i <= m_mask; ++i) {
+      m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  block_exchange(const block_exchange &) = delete;
+  block_exchange &operator=(const block_exchange &) = delete;
+
+  ~block_exchange() {
+    const std::size_t slab_size = m_slab_size.load(std::memory_order_relaxed);
+    for (const orphan &o : m_orphans) {
+      o.upstream->deallocate(o.slab, slab_size, slab_size);
+    }
+  }
+
+  /// @brief blocks per batch donors should hand over
+  auto batch_blocks() const -> std::size_t { return m_batch_blocks; }
+
+  /// @brief a resource with `block_size` blocks in `slab_size` slabs will use
+  /// this exchange. the first one sets both, throws std::invalid_argument
+  /// for anyone after it that differs (or that has no slabs)
+  void attach(std::size_t block_size, std::size_t slab_size) {
+    if (slab_size == 0) {
+      throw std::invalid_argument("block_exchange: resources need slabs");
+    }
+    std::size_t expected = 0;
+    if (!m_block_size.compare_exchange_strong(expected, block_size,
+                                              std::memory_order_acq_rel) &&
+        expected != block_size) {
+      throw std::invalid_argument("block_exchange: block size mismatch");
+    }
+    expected = 0;
+    if (!m_slab_size.compare_exchange_strong(expected, slab_size,
+                                             std::memory_order_acq_rel) &&
+        expected != slab_size) {
+      throw std::invalid_argument("block_exchange: slab size mismatch");
+    }
+  }
+
+  /// @brief keep a departing resource's `slab` (from `upstream`) alive until
+  /// we go, other resources may still be using blocks carved from it. rare
+  /// enough for a lock
+  void adopt(void *slab, std::pmr::memory_resource &upstream) noexcept {
+    const std::lock_guard lock{m_orphans_mutex};
+    try {
+      m_orphans.push_back({slab, &upstream});
+    } catch (const std::bad_alloc &) {
+      // leaking the slab beats freeing memory someone is still using
+    }
+  }
+
+  /// @brief false (and the batch stays with the caller) when the exchange is
+  /// full
+  auto push(const block_batch &batch) -> bool {
+    std::size_t pos = m_enqueue.load(std::memory_order_relaxed);
+    cell *c;
+    while (true) {
+      c = &m_cells[pos & m_mask];
+      const std::size_t sequence = c->sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+      if (diff == 0) {
+        if (m_enqueue.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = m_enqueue.load(std::memory_order_relaxed);
+      }
+    }
+    c->batch = batch;
+    c->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// @brief false when there's nothing to take
+  auto pop(block_batch &batch) -> bool {
+    std::size_t pos = m_dequeue.load(std::memory_order_relaxed);
+    cell *c;
+    while (true) {
+      c = &m_cells[pos & m_mask];
+      const std::size_t sequence = c->sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(sequence - (pos + 1));
+      if (diff == 0) {
+        if (m_dequeue.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = m_dequeue.load(std::memory_order_relaxed);
+      }
+    }
+    batch = c->batch;
+    c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// @brief batches waiting, only exact when nobody is pushing or popping
+  auto size() const -> std::size_t {
+    return m_enqueue.load(std::memory_order_acquire) -
+           m_dequeue.load(std::memory_order_acquire);
+  }
+
+private:
+  struct alignas(cache_line) cell {
+    tftf::atomic<std::size_t> sequence{0};
+    block_batch batch{};
+  };
+  struct orphan {
+    void *slab;
+    std::pmr::memory_resource *upstream;
+  };
+
+  const std::size_t m_mask;
+  const std::size_t m_batch_blocks;
+  // what the attached resources agreed on, 0 until the first attaches
+  tftf::atomic<std::size_t> m_block_size{0};
+  tftf::atomic<std::size_t> m_slab_size{0};
+  std::unique_ptr<cell[]> m_cells;
+  // slabs of resources that are gone, see adopt
+  std::mutex m_orphans_mutex;
+  std::vector<orphan> m_orphans;
+  alignas(cache_line) tftf::atomic<std::size_t> m_enqueue{0};
+  alignas(cache_line) tftf::atomic<std::size_t> m_dequeue{0};
+};
+
+} // namespace tftf
@@ -1,35 +1,179 @@
 #pragma once
 
+#include "bucket_engine.hh"
 #include "common.hh"
-#include "list.hh"
+#include "hash.hh"
+#include "hybrid_log_engine.hh"
+#include "list_engine.hh"
+#include "metrics.hh"
+#include "skip_list_engine.hh"
 #include "state.hh"
+#include "wal.hh"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <optional>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <utility>
 #include <vector>
 
 namespace tftf {
 struct default_faster_traits {
   static constexpr size_t max_workers = 1'024;
   static constexpr size_t minor_ticks_per_major = 10'000;
+  // entries per bucket before the bucket count doubles
+  static constexpr size_t max_load_factor = 2;
+  // list_engine: an update that had to retry more than this many times
+  // hands its bucket's writes to a combiner for a while (see
+  // list_engine::delegate). 0 never combines
+  static constexpr size_t combine_after_retries = 4;
+  // storage engine: list_engine (split-ordered harris list, grows online),
+  // bucket_engine (inline cache line buckets, fixed size),
+  // hybrid_log_engine (records in a log spilling to disk, for data bigger
+  // than memory) or skip_list_engine (ordered, for range scans)
+  template <class Key, class Value, class Traits>
+  using engine = list_engine<Key, Value, Traits>;
+  // how retired nodes are reclaimed: epoch_reclaim (cheapest reads) or
+  // interval_reclaim (a stalled worker can't hold everything back), see
+  // state.hh
+  using reclaim = epoch_reclaim;
+  // how list_engine stores values: inline_values, boxed_values (out of
+  // line, for big or non trivially copyable values) or auto_values (boxed
+  // unless std::atomic<Value> is lock free), see list.hh
+  using value_storage = auto_values;
+  // hashes keys for every engine: std_hash, multiply_shift_hash or wy_hash,
+  // see hash.hh
+  using hasher = std_hash;
+};
+
+/// @brief fills in anything a user supplied traits struct leaves out with the
+/// defaults, so older traits keep compiling as knobs get added
+template <class Traits> struct faster_traits {
+  static constexpr size_t max_workers = Traits::max_workers;
+  static constexpr size_t minor_ticks_per_major =
+      Traits::minor_ticks_per_major;
+  static constexpr size_t max_load_factor = [] {
+    if constexpr (requires { Traits::max_load_factor; }) {
+      return Traits::max_load_factor;
+    } else {
+      return default_faster_traits::max_load_factor;
+    }
+  }();
+  static constexpr size_t combine_after_retries = [] {
+    if constexpr (requires { Traits::combine_after_retries; }) {
+      return Traits::combine_after_retries;
+    } else {
+      return default_faster_traits::combine_after_retries;
+    }
+  }();
+
+  using reclaim = decltype([] {
+    if constexpr (requires { typename Traits::reclaim; }) {
+      return std::type_identity<typename Traits::reclaim>{};
+    } else {
+      return std::type_identity<default_faster_traits::reclaim>{};
+    }
+  }())::type;
+
+  using value_storage = decltype([] {
+    if constexpr (requires { typename Traits::value_storage; }) {
+      return std::type_identity<typename Traits::value_storage>{};
+    } else {
+      return std::type_identity<default_faster_traits::value_storage>{};
+    }
+  }())::type;
+
+  using hasher = decltype([] {
+    if constexpr (requires { typename Traits::hasher; }) {
+      return std::type_identity<typename Traits::hasher>{};
+    } else {
+      return std::type_identity<default_faster_traits::hasher>{};
+    }
+  }())::type;
+
+  template <class Key, class Value> static auto engine_type() {
+    if constexpr (requires {
+                    typename Traits::template engine<Key, Value,
+                                                     faster_traits>;
+                  }) {
+      return std::type_identity<
+          typename Traits::template engine<Key, Value, faster_traits>>{};
+    } else {
+      return std::type_identity<default_faster_traits::template engine<
+          Key, Value, faster_traits>>{};
+    }
+  }
+  template <class Key, class Value>
+  using engine = typename decltype(engine_type<Key, Value>())::type;
 };
 // store K-V
 // TODO: enable all warnings for clangd
 template <class Key, class Value, class Traits = default_faster_traits>
 class faster {
 public:
-  using list_t = tftf::list<Key, Value, std::less<Key>>;
-  faster(std::size_t table_size = 128)
-      : m_lists(table_size), m_size(table_size) {}
+  using engine_t = typename faster_traits<Traits>::template engine<Key, Value>;
+  using reclaim_t = typename faster_traits<Traits>::reclaim;
+  using hasher_t = typename faster_traits<Traits>::hasher;
+  // the default engine's list, kept around for its node layout
+  using list_t = tftf::list<Key, Value, std::less<Key>, reclaim_t,
+                            typename faster_traits<Traits>::value_storage>;
+  // size of the blocks the workers' resources hand out
+  static constexpr size_t alloc_size = engine_t::alloc_size;
+  static constexpr size_t alloc_align = engine_t::alloc_align;
+  using wal_t = write_ahead_log<Key, Value>;
+  // the wal writes keys and values byte for byte
+  static constexpr bool loggable =
+      std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>;
 
-  // NOTE: all `worker_state` variables are thread local
+  /// @brief anything after the table size goes to the engine's constructor
+  /// (hybrid_log_engine takes its hybrid_log_options there)
+  template <class... EngineArgs>
+  faster(std::size_t table_size = 128, EngineArgs &&...engine_args)
+      : m_engine(table_size, std::forward<EngineArgs>(engine_args)...) {}
+
+  faster(const faster &) = delete;
+  faster &operator=(const faster &) = delete;
+
+  ~faster() {
+    for (tftf::atomic<worker_metrics *> &metrics : m_metrics) {
+      delete metrics.load(std::memory_order_relaxed);
+    }
+  }
+
+  // NOTE: all `worker_state` variables are thread local. every operation
+  // holds an epoch_guard on its state while it touches nodes, so nothing it
+  // can see is freed under it. callers holding nodes across several calls can
+  // take their own (guards nest)
+
+  /// @brief the hash every engine uses for `key`. compute it once and pass
+  /// it to the *_hashed calls to skip rehashing (which matters for long
+  /// string keys)
+  template <lookup_key<Key, hasher_t> K>
+  static auto hash_of(const K &key) -> uint64_t {
+    return key_hash<Key, hasher_t>{}(key);
+  }
 
   /// @brief accessor function. value semantics because we don't expect values
-  /// to be large
+  /// to be large (big ones are boxed, see list.hh, but still copied out)
   auto get(worker_state &state, const Key &key) -> std::optional<Value> {
-    list_t &l = get_list(key);
-
-    return l.find(state, key);
+    return get_hashed(state, hash_of(key), key);
+  }
+  /// @brief get by a transparent key, e.g. a std::string_view for string
+  /// keys (see hash.hh), without building a Key for it
+  template <transparent_key<Key, hasher_t> K>
+  auto get(worker_state &state, const K &key) -> std::optional<Value> {
+    return get_hashed(state, hash_of(key), key);
+  }
+  /// @brief get with hash_of(key) already computed
+  template <lookup_key<Key, hasher_t> K>
+  auto get_hashed(worker_state &state, uint64_t hash, const K &key)
+      -> std::optional<Value> {
+    const op_timer timer{state.metrics, table_op::get};
+    const epoch_guard guard{state};
+    return m_engine.get_hashed(state, hash, key);
   }
 
   /// @brief put/overwrite function. Moves key and value regardless
@@ -38,39 +182,330 @@ public:
     requires std::is_convertible_v<Key_, Key> &&
              std::is_convertible_v<Value_, Value>
   auto put(worker_state &state, Key_ &&key, Value_ &&value) -> bool {
-
-    list_t &l = get_list(key);
-
+    // transparent hashes take key as is, no Key gets built for it
+    const uint64_t hash = key_hash<Key, hasher_t>{}(key);
+    return put_hashed(state, hash, std::forward<Key_>(key),
+                      std::forward<Value_>(value));
+  }
+  /// @brief put with hash_of(key) already computed
+  template <class Key_, class Value_>
+    requires std::is_convertible_v<Key_, Key> &&
+             std::is_convertible_v<Value_, Value>
+  auto put_hashed(worker_state &state, uint64_t hash, Key_ &&key,
+                  Value_ &&value) -> bool {
+    const op_timer timer{state.metrics, table_op::put};
+    // ticks after the guard is gone, so we don't hold back our own garbage
     auto scope_exit =
         tftf::on_scope_exit([this, &state]() { minor_tick(state); });
+    if constexpr (loggable) {
+      if (m_wal != nullptr) [[unlikely]] {
+        const Key k(std::forward<Key_>(key));
+        const Value v(std::forward<Value_>(value));
+        return logged(state, k, [&](const typename wal_t::stripe_lock &lock) {
+          const bool inserted = m_engine.put_hashed(state, hash, k, v);
+          m_wal->append(state, lock, wal_op::put, k, v);
+          return inserted;
+        });
+      }
+    }
+    const epoch_guard guard{state};
 
-    return l.put(state, std::forward<Key_>(key), std::forward<Value_>(value));
+    return m_engine.put_hashed(state, hash, std::forward<Key_>(key),
+                               std::forward<Value_>(value));
+  }
+
+  /// @brief look up a batch of keys (request handlers do 32-256 at a time).
+  /// the engine hashes them all up front and overlaps their cache misses.
+  /// out[i] is filled for keys[i], returns how many were found
+  auto get_batch(worker_state &state, std::span<const Key> keys,
+                 std::span<std::optional<Value>> out) -> size_t {
+    count_ops(state, table_op::get, keys.size());
+    const epoch_guard guard{state};
+    return m_engine.get_batch(state, keys, out);
+  }
+
+  /// @brief put/overwrite keys[i] -> values[i], with the same prefetching as
+  /// get_batch. returns how many were inserted
+  auto put_batch(worker_state &state, std::span<const Key> keys,
+                 std::span<const Value> values) -> size_t {
+    if constexpr (loggable) {
+      if (m_wal != nullptr) [[unlikely]] {
+        // every key takes its own stripe, nothing to batch
+        size_t inserted = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+          inserted += put(state, keys[i], values[i]);
+        }
+        return inserted;
+      }
+    }
+    count_ops(state, table_op::put, keys.size());
+    size_t inserted;
+    {
+      const epoch_guard guard{state};
+      inserted = m_engine.put_batch(state, keys, values);
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+      minor_tick(state);
+    }
+    return inserted;
   }
 
-  /// @brief update an entry. Returns the old value (if present)
+  /// @brief update an entry with fn(old) -> new. Returns the old value (if
+  /// present). concurrent updates of a key are never lost, but the list
+  /// engine retries fn with compare_exchange when the value changes under
+  /// it, so fn may run more than once and has to be pure. on a hot bucket fn
+  /// may also run on another worker's thread (see list_engine::delegate),
+  /// what it throws still comes out here
   template <class UpdateFn>
   auto update(worker_state &state, const Key &key, UpdateFn &&fn)
       -> std::optional<Value> {
-    list_t &l = get_list(key);
-    return l.update(state, key, std::forward<UpdateFn>(fn));
+    return update_hashed(state, hash_of(key), key, std::forward<UpdateFn>(fn));
+  }
+  template <transparent_key<Key, hasher_t> K, class UpdateFn>
+  auto update(worker_state &state, const K &key, UpdateFn &&fn)
+      -> std::optional<Value> {
+    return update_hashed(state, hash_of(key), key, std::forward<UpdateFn>(fn));
+  }
+  template <lookup_key<Key, hasher_t> K, class UpdateFn>
+  auto update_hashed(worker_state &state, uint64_t hash, const K &key,
+                     UpdateFn &&fn) -> std::optional<Value> {
+    const op_timer timer{state.metrics, table_op::update};
+    return apply_update(state, hash, key, std::forward<UpdateFn>(fn));
+  }
+
+  /// @brief insert `init` if the key is missing, otherwise update it with
+  /// fn like update, in one atomic step: two racing first increments of a
+  /// counter both count. returns the old value, nullopt if we inserted
+  template <class UpdateFn>
+  auto upsert_rmw(worker_state &state, const Key &key, const Value &init,
+                  UpdateFn &&fn) -> std::optional<Value> {
+    const op_timer timer{state.metrics, table_op::rmw};
+    auto scope_exit =
+        tftf::on_scope_exit([this, &state]() { minor_tick(state); });
+    if constexpr (loggable) {
+      if (m_wal != nullptr) [[unlikely]] {
+        return logged(state, key, [&](const typename wal_t::stripe_lock &lock) {
+          std::optional<Value> updated;
+          const std::optional<Value> old = m_engine.upsert_rmw(
+              state, key, init, [&](const Value &current) {
+                updated = fn(current);
+                return *updated;
+              });
+          m_wal->append(state, lock, wal_op::put, key, old ? *updated : init);
+          return old;
+        });
+      }
+    }
+    const epoch_guard guard{state};
+    return m_engine.upsert_rmw(state, key, init, std::forward<UpdateFn>(fn));
   }
 
-  // what is the allocator behavior here? we put it into our freelist
+  /// @brief atomically add `delta` to the key's value. returns the old value,
+  /// nullopt (and nothing added) if the key is missing. a single atomic
+  /// instruction on the list engine, a locked update on the others
+  auto fetch_add(worker_state &state, const Key &key, Value delta)
+      -> std::optional<Value>
+    requires std::is_integral_v<Value>
+  {
+    return fetch_op(
+        state, key,
+        [delta](std::atomic<Value> &v) {
+          return v.fetch_add(delta, std::memory_order_acq_rel);
+        },
+        [delta](Value v) { return static_cast<Value>(v + delta); });
+  }
+  /// @brief fetch_add's sibling for setting bits
+  auto fetch_or(worker_state &state, const Key &key, Value bits)
+      -> std::optional<Value>
+    requires std::is_integral_v<Value>
+  {
+    return fetch_op(
+        state, key,
+        [bits](std::atomic<Value> &v) {
+          return v.fetch_or(bits, std::memory_order_acq_rel);
+        },
+        [bits](Value v) { return static_cast<Value>(v | bits); });
+  }
+  /// @brief and for clearing them
+  auto fetch_and(worker_state &state, const Key &key, Value bits)
+      -> std::optional<Value>
+    requires std::is_integral_v<Value>
+  {
+    return fetch_op(
+        state, key,
+        [bits](std::atomic<Value> &v) {
+          return v.fetch_and(bits, std::memory_order_acq_rel);
+        },
+        [bits](Value v) { return static_cast<Value>(v & bits); });
+  }
+
+  // allocator behavior: the node goes into our limbo bags, and back to our
+  // resource once its epoch is safe
   /// @brief erase kv pair. Returns whether or not the erase was sucessful or
   /// not
   auto erase(worker_state &state, const Key &key) -> bool {
-    list_t &l = get_list(key);
-    return l.erase(state, key);
+    return erase_hashed(state, hash_of(key), key);
+  }
+  template <transparent_key<Key, hasher_t> K>
+  auto erase(worker_state &state, const K &key) -> bool {
+    return erase_hashed(state, hash_of(key), key);
+  }
+  template <lookup_key<Key, hasher_t> K>
+  auto erase_hashed(worker_state &state, uint64_t hash, const K &key)
+      -> bool {
+    const op_timer timer{state.metrics, table_op::erase};
+    auto scope_exit =
+        tftf::on_scope_exit([this, &state]() { minor_tick(state); });
+    if constexpr (loggable) {
+      if (m_wal != nullptr) [[unlikely]] {
+        return logged(state, key, [&](const typename wal_t::stripe_lock &lock) {
+          const bool erased = m_engine.erase_hashed(state, hash, key);
+          if (erased) {
+            m_wal->append(state, lock, wal_op::erase, key);
+          }
+          return erased;
+        });
+      }
+    }
+    const epoch_guard guard{state};
+    return m_engine.erase_hashed(state, hash, key);
+  }
+
+  /// @brief visit every entry as fn(key, value), bucket by bucket in no
+  /// particular key order. weakly consistent: entries present for the whole
+  /// scan are visited exactly once, ones inserted or erased meanwhile may or
+  /// may not be. the epoch guard is taken per bucket, not for the whole scan
+  template <class Fn> void for_each(worker_state &state, Fn &&fn) {
+    const size_t buckets = bucket_count();
+    m_engine.for_each(state, 0, buckets, buckets, fn);
+  }
+
+  /// @brief visit the entries with lo <= key < hi in key order as fn(key,
+  /// value), for ordered engines (skip_list_engine). weakly consistent like
+  /// for_each, the guard is retaken every few hundred entries
+  template <class Fn>
+  void range(worker_state &state, const Key &lo, const Key &hi, Fn &&fn)
+    requires requires(engine_t &e) { e.range(state, lo, hi, fn); }
+  {
+    m_engine.range(state, lo, hi, fn);
+  }
+
+  /// @brief the first entry with a key not less than `key`, for ordered
+  /// engines
+  template <lookup_key<Key, hasher_t> K>
+  auto lower_bound(worker_state &state, const K &key)
+      -> std::optional<std::pair<Key, Value>>
+    requires requires(engine_t &e) { e.lower_bound(state, key); }
+  {
+    const epoch_guard guard{state};
+    return m_engine.lower_bound(state, key);
+  }
+
+  /// @brief for_each split across one thread per state in `states` (each
+  /// registered, and not used by anyone else until this returns), the
+  /// calling thread scans with states[0]. threads claim chunks of buckets as
+  /// they go, so fn is called concurrently and has to be thread safe. no
+  /// states, no scan
+  template <class Fn>
+  void parallel_for_each(std::span<worker_state *const> states, Fn &&fn) {
+    if (states.empty()) {
+      return;
+    }
+    const size_t buckets = bucket_count();
+    const size_t chunk = std::clamp<size_t>(
+        buckets / (states.size() * 64), 1, scan_chunk_buckets);
+    tftf::atomic<size_t> next{0};
+    auto scan = [&](worker_state *state) {
+      while (true) {
+        const size_t first = next.fetch_add(chunk, std::memory_order_relaxed);
+        if (first >= buckets) {
+          return;
+        }
+        m_engine.for_each(*state, first, std::min(first + chunk, buckets),
+                          buckets, fn);
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < states.size(); ++i) {
+      threads.emplace_back(scan, states[i]);
+    }
+    scan(states[0]);
+    for (std::thread &t : threads) {
+      t.join();
+    }
+  }
+
+  /// @brief the global epoch, which moves on every retire. checkpoints stamp
+  /// themselves with it
+  auto current_epoch() const -> uint64_t {
+    return m_epoch.load(std::memory_order_acquire);
   }
 
+  /// @brief log every put/update/erase from now on to `wal` (see wal.hh),
+  /// or stop logging with nullptr. set it while no worker is using the table
+  void attach_wal(wal_t *wal)
+    requires loggable
+  {
+    m_wal = wal;
+  }
+  /// @brief the attached wal, nullptr if none
+  auto wal() const -> wal_t * { return m_wal; }
+
+  /// @brief the engine itself, for what only some engines have (like
+  /// hybrid_log_engine::get_async)
+  auto engine() -> engine_t & { return m_engine; }
+  auto engine() const -> const engine_t & { return m_engine; }
+
+  /// @brief number of entries, only exact when the table is quiescent
+  auto size() const -> std::size_t { return m_engine.size(); }
+  /// @brief current number of buckets, always a power of two
+  auto bucket_count() const -> std::size_t { return m_engine.bucket_count(); }
+
   // not sure if this is a good idea.
   // we operate on the simplifying assumption that no workers leave
   // TODO: might be a good idea to get the worker from here (and so it's private
   // and we can't construct externally, to get the invariant everything is
   // initialized)
+  /// @brief throws std::length_error once max_workers states have been
+  /// registered, their slots are never handed back
   auto register_worker(worker_state &state) -> void {
-    state.index = m_workers.fetch_add(1);
+    // never past max_workers, the scans of m_epochs go up to it
+    size_t index = m_workers.load(std::memory_order_relaxed);
+    do {
+      if (index >= max_workers) [[unlikely]] {
+        throw std::length_error("faster: more than max_workers workers");
+      }
+    } while (!m_workers.compare_exchange_weak(index, index + 1,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed));
+    state.index = index;
     state.epoch_counter = &m_epoch;
+    // starts out quiescent, so we don't hold anything back until we read
+    state.announce = &m_epochs[state.index].value;
+    // distinct per worker and never zero
+    state.random_state = (state.index + 1) * 0x9e3779b97f4a7c15ull;
+    if constexpr (metrics_enabled) {
+      state.metrics = new worker_metrics{};
+      m_metrics[state.index].store(state.metrics, std::memory_order_release);
+    }
+  }
+
+  /// @brief every registered worker's counters and latencies summed (see
+  /// metrics.hh), plus the table's size. safe to call while workers run,
+  /// render it with to_json or to_prometheus
+  auto collect_stats() const -> table_stats {
+    table_stats stats;
+    stats.size = size();
+    stats.buckets = bucket_count();
+    stats.workers = m_workers.load(std::memory_order_acquire);
+    for (size_t i = 0; i < std::min(stats.workers, max_workers); ++i) {
+      if (const worker_metrics *metrics =
+              m_metrics[i].load(std::memory_order_acquire)) {
+        stats.add(*metrics);
+      }
+    }
+    return stats;
   }
 
 private:
@@ -81,51 +516,179 @@ private:
   // mcmp queue, so will be a "objective" performance hit in tradeoff for better
   // distribution
   void major_tick(worker_state &state) {
-    // we are guaranteed at least this thread is registered
-    uint64_t safe_epoch = m_epochs[0].load(std::memory_order_acquire);
-    uint64_t current_workers = m_workers.load(std::memory_order_acquire);
+    // everything retired since the last major tick becomes one bag, and
+    // whole bags go back to the resource at once
+    state.seal_retired();
+
+    if constexpr (reclaim_t::interval_based) {
+      collect_reservations(state);
+      state.release_unreserved(alloc_size, alloc_align, engine_t::birth_of,
+                               destroy_retired);
+      return;
+    }
+
+    // the cached safe epoch is usually enough, only rescan when it can't free
+    // our oldest bag
+    uint64_t safe_epoch = m_safe_epoch.load(std::memory_order_acquire);
+    if (state.oldest_retired_epoch() > safe_epoch) {
+      safe_epoch = advance_safe_epoch(safe_epoch);
+    }
+    state.release_retired(safe_epoch, alloc_size, alloc_align,
+                          destroy_retired);
+  }
+
+  /// @brief recompute the minimum announced epoch and publish it. one worker
+  /// scans at a time, everyone else makes do with the cached value rather than
+  /// all of them walking every slot
+  auto advance_safe_epoch(uint64_t cached) -> uint64_t {
+    if (m_scanning.value.exchange(true, std::memory_order_acquire)) {
+      return cached;
+    }
+    // with nobody inside a guard, everything retired so far is safe
+    uint64_t safe_epoch = m_epoch.load(std::memory_order_acquire);
+    // pairs with the light_fence in worker_state::enter: a reader's
+    // announcement is either visible below, or it entered after this point
+    // and can't reach anything retired before it
+    heavy_fence();
+    const uint64_t current_workers = m_workers.load(std::memory_order_acquire);
+    for (size_t i = 0; i < current_workers; ++i) {
+      safe_epoch = std::min(
+          safe_epoch, m_epochs[i].value.lo.load(std::memory_order_acquire));
+    }
+    // whatever was safe stays safe, so the cache only moves forward. we're the
+    // only writer while holding m_scanning
+    safe_epoch =
+        std::max(safe_epoch, m_safe_epoch.load(std::memory_order_relaxed));
+    m_safe_epoch.store(safe_epoch, std::memory_order_release);
+    m_scanning.value.store(false, std::memory_order_release);
+    return safe_epoch;
+  }
 
-    // calculate the safe epoch each time we do a gc (we don't need to do it
-    // more than this, since this is the only place we use the epoch)
-    for (size_t i = 1; i < current_workers; ++i) {
-      safe_epoch =
-          std::min(safe_epoch, m_epochs[i].load(std::memory_order_acquire));
+  /// @brief snapshot every active reservation into state.reserved. every
+  /// worker scans for itself here: there is no single number to cache
+  void collect_reservations(worker_state &state) {
+    state.reserved.clear();
+    // same pairing as advance_safe_epoch, plus with the light_fence in
+    // worker_state::protect for readers raising their hi
+    heavy_fence();
+    const uint64_t current_workers = m_workers.load(std::memory_order_acquire);
+    for (size_t i = 0; i < current_workers; ++i) {
+      const worker_state::reservation &r = m_epochs[i].value;
+      const uint64_t lo = r.lo.load(std::memory_order_acquire);
+      if (lo == worker_state::quiescent) {
+        continue;
+      }
+      state.reserved.emplace_back(lo, r.hi.load(std::memory_order_acquire));
+    }
+  }
+  /// @brief update_hashed without the op counted, for ops built on it
+  template <lookup_key<Key, hasher_t> K, class UpdateFn>
+  auto apply_update(worker_state &state, uint64_t hash, const K &key,
+                    UpdateFn &&fn) -> std::optional<Value> {
+    if constexpr (loggable) {
+      if (m_wal != nullptr) [[unlikely]] {
+        return logged(state, key, [&](const typename wal_t::stripe_lock &lock) {
+          // engines may retry fn, the last result is the one that stuck
+          std::optional<Value> updated;
+          const std::optional<Value> old = m_engine.update_hashed(
+              state, hash, key, [&](const Value &current) {
+                updated = fn(current);
+                return *updated;
+              });
+          if (old) {
+            m_wal->append(state, lock, wal_op::put, key, *updated);
+          }
+          return old;
+        });
+      }
     }
+    const epoch_guard guard{state};
+    return m_engine.update_hashed(state, hash, key,
+                                  std::forward<UpdateFn>(fn));
+  }
 
-    auto &delete_list = state.freelist;
+  /// @brief atomic_fn(std::atomic<Value> &) -> old where the engine keeps
+  /// values in atomics, update with fn where it doesn't (or when the op has
+  /// to be logged under the key's stripe)
+  template <class AtomicFn, class Fn>
+  auto fetch_op(worker_state &state, const Key &key, AtomicFn &&atomic_fn,
+                Fn &&fn) -> std::optional<Value> {
+    const op_timer timer{state.metrics, table_op::rmw};
+    if constexpr (requires { m_engine.modify(state, key, atomic_fn); }) {
+      if (m_wal == nullptr) [[likely]] {
+        const epoch_guard guard{state};
+        return m_engine.modify(state, key, atomic_fn);
+      }
+    }
+    return apply_update(state, hash_of(key), key, fn);
+  }
 
-    while (!delete_list.empty() && delete_list.front().epoch < safe_epoch) {
-      auto front = delete_list.begin();
-      state.resource.deallocate(front->ptr, list_t::alloc_size);
+  /// @brief ops that are counted but not timed one by one (batches)
+  static void count_ops([[maybe_unused]] worker_state &state,
+                        [[maybe_unused]] table_op op,
+                        [[maybe_unused]] size_t n) {
+    if constexpr (metrics_enabled) {
+      if (state.metrics != nullptr) {
+        state.metrics->ops[static_cast<size_t>(op)].add(n);
+      }
+    }
+  }
 
-      delete_list.erase(front);
+  /// @brief run op(stripe_lock) inside a guard with the key's wal stripe
+  /// held, so the key's records hit the log in the order its writes were
+  /// applied. waiting for the commit happens after both are let go
+  template <class Op>
+  auto logged(worker_state &state, const Key &key, Op &&op) {
+    // before the op, so a worker the wal has no buffer for changes nothing
+    if (state.index >= m_wal->options().max_workers) [[unlikely]] {
+      throw std::out_of_range("wal: worker index past max_workers");
     }
+    auto result = [&]() {
+      const epoch_guard guard{state};
+      const typename wal_t::stripe_lock lock{*m_wal, key};
+      return op(lock);
+    }();
+    m_wal->wait_durable(state);
+    return result;
   }
+
   void minor_tick(worker_state &state) {
     state.ticks++;
     if (state.ticks == minors_per_major) [[unlikely]] {
-      // refresh out ack epoch
-      m_epochs[state.index].store(m_epoch.load(std::memory_order_acquire),
-                                  std::memory_order_release);
       major_tick(state);
       state.ticks = 0;
     }
   }
 
-  auto get_list(const Key &key) -> list_t & {
-    uint64_t index = std::hash<Key>{}(key) % m_lists.size();
-    return m_lists[index];
-  }
+  // what runs on a retired block before it's reused, for engines whose
+  // nodes own something (string keys)
+  static constexpr void (*destroy_retired)(void *) = [] {
+    if constexpr (requires { engine_t::destroy_retired; }) {
+      return engine_t::destroy_retired;
+    } else {
+      return static_cast<void (*)(void *)>(nullptr);
+    }
+  }();
 
-  // do not grow though!
-  std::vector<list_t> m_lists;
-  tftf::atomic<size_t> m_size;
-  tftf::atomic<uint64_t> m_epoch;
-  static constexpr uint64_t minors_per_major{Traits::minor_ticks_per_major};
+  engine_t m_engine;
+  wal_t *m_wal{nullptr};
+  // bumped on every retire, keep it away from everything else
+  alignas(cache_line) tftf::atomic<uint64_t> m_epoch;
+  static constexpr uint64_t minors_per_major{
+      faster_traits<Traits>::minor_ticks_per_major};
 
-  static constexpr size_t max_workers{Traits::max_workers};
-  // TODO: investigate cache alignment here
-  std::array<tftf::atomic<uint64_t>, max_workers> m_epochs{};
+  static constexpr size_t max_workers{faster_traits<Traits>::max_workers};
+  // most buckets a parallel_for_each thread claims at once
+  static constexpr size_t scan_chunk_buckets{4'096};
+  // what each worker's guard entered at (see worker_state::enter), one line
+  // per worker so announcements don't bounce each other's lines
+  std::array<padded<worker_state::reservation>, max_workers> m_epochs{};
+  // min over m_epochs as of the last scan, read by every major tick
+  alignas(cache_line) tftf::atomic<uint64_t> m_safe_epoch{0};
+  padded<tftf::atomic<bool>> m_scanning{};
   tftf::atomic<size_t> m_workers{0};
+  // each worker's counters, allocated on registration and only written by
+  // their worker (see metrics.hh)
+  std::array<tftf::atomic<worker_metrics *>, max_workers> m_metrics{};
 };
 } // namespace tftf
@@ -0,0 +1,195 @@
+#pragma once
+/// hashing: the hashers a table can pick with `Traits::hasher`, and key_hash,
+/// which applies one to a table's keys. every engine masks the low bits of
+/// the hash to pick a bucket (tables are powers of two, there's no modulo
+/// anywhere), so a hasher has to get entropy into the low bits.
+///
+///   std_hash             std::hash, the default. the identity on integers:
+///                        perfect for dense sequential keys, awful for
+///                        strided ones (ids << 12 all land in one bucket)
+///   multiply_shift_hash  integers only, one multiply (fibonacci hashing).
+///                        the well mixed top bytes of the product are
+///                        swapped down to the low bits
+///   wy_hash              wyhash (Wang Yi's mum/mix construction) for
+///                        integers, strings and other plain bytes. a couple
+///                        of 64x64->128 multiplies for a short key
+///
+/// `bench --hashes std,multiply_shift,wy` prints how each of them spreads a
+/// few key patterns
+
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace tftf {
+
+struct std_hash {
+  template <class K> auto operator()(const K &key) const -> std::uint64_t {
+    return std::hash<K>{}(key);
+  }
+};
+
+struct multiply_shift_hash {
+  template <class K>
+    requires std::is_integral_v<K> || std::is_enum_v<K>
+  auto operator()(K key) const -> std::uint64_t {
+    // 2^64 / phi. odd, so this and the byte swap are both bijections:
+    // distinct keys never collide
+    return std::byteswap(static_cast<std::uint64_t>(key) *
+                         0x9e3779b97f4a7c15ull);
+  }
+};
+
+namespace detail {
+inline constexpr std::uint64_t wyp[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull,
+    0x589965cc75374cc3ull};
+
+/// @brief the 128 bit product of a and b, low half into a and high into b
+inline void wymum(std::uint64_t &a, std::uint64_t &b) {
+  const unsigned __int128 r = static_cast<unsigned __int128>(a) * b;
+  a = static_cast<std::uint64_t>(r);
+  b = static_cast<std::uint64_t>(r >> 64);
+}
+inline auto wymix(std::uint64_t a, std::uint64_t b) -> std::uint64_t {
+  wymum(a, b);
+  return a ^ b;
+}
+inline auto wyr8(const std::byte *p) -> std::uint64_t {
+  std::uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;
+}
+inline auto wyr4(const std::byte *p) -> std::uint64_t {
+  std::uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+/// @brief 1 to 3 bytes
+inline auto wyr3(const std::byte *p, std::size_t k) -> std::uint64_t {
+  return (std::to_integer<std::uint64_t>(p[0]) << 16) |
+         (std::to_integer<std::uint64_t>(p[k >> 1]) << 8) |
+         std::to_integer<std::uint64_t>(p[k - 1]);
+}
+
+inline auto wyhash(const void *key, std::size_t len, std::uint64_t seed)
+    -> std::uint64_t {
+  const std::byte *p = static_cast<const std::byte *>(key);
+  seed ^= wymix(seed ^ wyp[0], wyp[1]);
+  std::uint64_t a, b;
+  if (len <= 16) [[likely]] {
+    if (len >= 4) [[likely]] {
+      a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+      b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) [[likely]] {
+      a = wyr3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    std::size_t i = len;
+    if (i > 48) [[unlikely]] {
+      std::uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+        see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+        see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) [[unlikely]] {
+      seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = wyr8(p + i - 16);
+    b = wyr8(p + i - 8);
+  }
+  a ^= wyp[1];
+  b ^= seed;
+  wymum(a, b);
+  return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+/// @brief wyhash of a single 64 bit word, without the byte loads
+inline auto wyhash64(std::uint64_t a, std::uint64_t b) -> std::uint64_t {
+  a ^= wyp[0];
+  b ^= wyp[1];
+  wymum(a, b);
+  return wymix(a ^ wyp[0], b ^ wyp[1]);
+}
+} // namespace detail
+
+struct wy_hash {
+  template <class K> auto operator()(const K &key) const -> std::uint64_t {
+    if constexpr (std::is_integral_v<K> || std::is_enum_v<K>) {
+      return detail::wyhash64(static_cast<std::uint64_t>(key), seed);
+    } else if constexpr (std::is_convertible_v<const K &, std::string_view>) {
+      const std::string_view view = key;
+      return detail::wyhash(view.data(), view.size(), seed);
+    } else {
+      static_assert(std::has_unique_object_representations_v<K>,
+                    "wy_hash hashes a key's bytes, padding would make equal "
+                    "keys hash differently");
+      return detail::wyhash(&key, sizeof(K), seed);
+    }
+  }
+
+  std::uint64_t seed{0};
+};
+
+/// @brief `Hasher` applied to a table's keys. every engine puts keys through
+/// this, so a hash computed once (faster::hash_of) can be handed to any of
+/// the *_hashed calls
+template <class Key, class Hasher = std_hash> struct key_hash {
+  auto operator()(const Key &key) const -> std::uint64_t
+    requires std::invocable<Hasher, const Key &>
+  {
+    return Hasher{}(key);
+  }
+};
+
+/// @brief string keys hash transparently: anything that converts to a view
+/// hashes like the string it views (std::hash guarantees string and
+/// string_view agree, the others hash the bytes), so lookups by string_view
+/// or literal don't build a string first
+template <class CharT, class CharTraits, class Alloc, class Hasher>
+struct key_hash<std::basic_string<CharT, CharTraits, Alloc>, Hasher> {
+  using is_transparent = void;
+  using view = std::basic_string_view<CharT, CharTraits>;
+
+  auto operator()(view key) const -> std::uint64_t
+    requires std::invocable<Hasher, view>
+  {
+    return Hasher{}(key);
+  }
+};
+
+/// @brief a `K` that can stand in for a `Key` in lookups without being
+/// converted to one: key_hash<Key, Hasher> is transparent, hashes it, and
+/// keys compare equal and ordered against it
+template <class K, class Key, class Hasher = std_hash>
+concept transparent_key =
+    !std::same_as<std::remove_cvref_t<K>, Key> &&
+    requires { typename key_hash<Key, Hasher>::is_transparent; } &&
+    requires(const K &k, const Key &key) {
+      { key_hash<Key, Hasher>{}(k) } -> std::same_as<std::uint64_t>;
+      { key == k } -> std::convertible_to<bool>;
+      { std::less<>{}(key, k) } -> std::convertible_to<bool>;
+    };
+
+/// @brief a Key itself or a transparent stand in for one
+template <class K, class Key, class Hasher = std_hash>
+concept lookup_key = std::same_as<std::remove_cvref_t<K>, Key> ||
+                     transparent_key<K, Key, Hasher>;
+
+} // namespace tftf
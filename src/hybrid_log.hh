@@ -0,0 +1,325 @@
+#pragma once
+/// the log half of hybrid_log_engine: FASTER's HybridLog over fixed size
+/// records. logical addresses only grow and double as offsets into a backing
+/// file, the newest `memory_pages` pages live in a ring of frames in memory:
+///
+///   0              head           read_only              tail
+///   | on disk only  | in memory,     | in memory, updated   |
+///   |               | read only      | in place             |
+///
+/// a background flusher keeps read_only `mutable_pages` behind the tail,
+/// writes pages that fell below it to the file once nobody is still writing
+/// them, and moves head up so the tail always finds a free frame. memory is
+/// memory_pages * page_size however big the log gets.
+///
+/// records below head are read back with pread, inline or on an io_pool.
+/// io_uring would slot in where the pool is, but we don't depend on liburing
+
+#include "common.hh"
+#include "io.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace tftf {
+
+struct hybrid_log_options {
+  // backing file, created (or truncated) with the log. empty for an
+  // unnamed temporary file that goes away with the log
+  std::string path{};
+  // bytes per page, a power of two. records never straddle pages
+  std::size_t page_size{std::size_t{1} << 20};
+  // frames kept in memory, which is all the memory the log uses
+  std::size_t memory_pages{64};
+  // newest pages updated in place, the rest of memory is read only. at most
+  // memory_pages - 2 so there's always a flushed page to evict
+  std::size_t mutable_pages{16};
+  // threads serving async reads
+  std::size_t io_threads{2};
+};
+
+/// @brief a paged, append-only log of `Record`s. Record is trivially copyable
+/// and starts with a `uint64_t version`, the log's seqlock for in place
+/// updates. at most one thread updates a given record at a time, the engine
+/// serializes them on its index
+template <class Record> class hybrid_log {
+  static_assert(std::is_trivially_copyable_v<Record>,
+                "records are copied racily and written to disk as is");
+  static_assert(offsetof(Record, version) == 0);
+
+public:
+  using address = std::uint64_t;
+  static constexpr std::size_t record_size = sizeof(Record);
+
+  explicit hybrid_log(hybrid_log_options options)
+      : m_options(std::move(options)), m_page_size(m_options.page_size),
+        m_per_page(m_page_size / record_size),
+        m_frames_count(m_options.memory_pages),
+        m_mutable_pages(m_options.mutable_pages),
+        m_writers(new padded<tftf::atomic<std::uint32_t>>[m_frames_count]) {
+    if (!std::has_single_bit(m_page_size) || m_per_page == 0 ||
+        m_mutable_pages == 0 || m_mutable_pages + 2 > m_frames_count) {
+      throw std::invalid_argument("hybrid_log: bad page configuration");
+    }
+    m_fd = open_backing_file();
+    void *frames = ::mmap(nullptr, m_frames_count * m_page_size,
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1, 0);
+    if (frames == MAP_FAILED) {
+      ::close(m_fd);
+      detail::throw_errno("mmap hybrid_log frames");
+    }
+    m_frames = static_cast<std::byte *>(frames);
+    m_flusher = std::thread{[this]() { flush_loop(); }};
+  }
+
+  hybrid_log(const hybrid_log &) = delete;
+  hybrid_log &operator=(const hybrid_log &) = delete;
+
+  ~hybrid_log() {
+    m_stop.store(true, std::memory_order_release);
+    wake_flusher();
+    m_flusher.join();
+    ::munmap(m_frames, m_frames_count * m_page_size);
+    ::close(m_fd);
+  }
+
+  /// @brief add a record at the tail: `fill(record)` writes it in place
+  /// before anyone can know its address. blocks while the tail is waiting
+  /// for a frame to be flushed
+  template <class Fill> auto append(Fill &&fill) -> address {
+    const address at = allocate();
+    Record &record = record_at(at);
+    std::memset(static_cast<void *>(&record), 0, record_size);
+    fill(record);
+    unpin(at);
+    return at;
+  }
+
+  /// @brief `fn(record)` on a record in the mutable region, under its
+  /// seqlock. false (and nothing happens) once it's read only, the caller
+  /// then appends a new version instead
+  template <class Fn> auto update_in_place(address at, Fn &&fn) -> bool {
+    // pairs with flush_step: either the flusher sees our pin and waits for
+    // us, or we see read_only past us and back off
+    m_writers[frame_of(at)].value.fetch_add(1, std::memory_order_seq_cst);
+    if (at < m_read_only.load(std::memory_order_seq_cst)) {
+      unpin(at);
+      return false;
+    }
+    Record &record = record_at(at);
+    std::atomic_ref<std::uint64_t> version{record.version};
+    const std::uint64_t v = version.load(std::memory_order_relaxed);
+    version.store(v + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    fn(record);
+    version.store(v + 2, std::memory_order_release);
+    unpin(at);
+    return true;
+  }
+
+  /// @brief copy the record at `at` if it's still in memory. optimistic:
+  /// validated against the record's seqlock and against head, since the
+  /// frame can be handed to a new page the moment head passes it. false
+  /// means it's only on disk now
+  auto read_in_memory(address at, Record &out) const -> bool {
+    while (true) {
+      if (at < m_head.load(std::memory_order_acquire)) {
+        return false;
+      }
+      Record &record = record_at(at);
+      std::atomic_ref<std::uint64_t> version{record.version};
+      const std::uint64_t v = version.load(std::memory_order_acquire);
+      if (v & 1) {
+        cpu_relax();
+        continue;
+      }
+      std::memcpy(static_cast<void *>(&out), &record, record_size);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (version.load(std::memory_order_relaxed) == v &&
+          at >= m_head.load(std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+  }
+
+  /// @brief blocking read of a record below head
+  void read_from_disk(address at, Record &out) const {
+    assert(at + record_size <= m_flushed.load(std::memory_order_acquire));
+    detail::pread_all(m_fd, &out, record_size, at, m_options.path);
+  }
+
+  /// @brief whichever of the two applies
+  void read(address at, Record &out) const {
+    if (!read_in_memory(at, out)) {
+      read_from_disk(at, out);
+    }
+  }
+
+  auto head() const -> address {
+    return m_head.load(std::memory_order_acquire);
+  }
+  auto read_only() const -> address {
+    return m_read_only.load(std::memory_order_acquire);
+  }
+  /// @brief everything below this is on disk
+  auto flushed() const -> address {
+    return m_flushed.load(std::memory_order_acquire);
+  }
+  /// @brief where the next record goes
+  auto tail() const -> address {
+    return address_of(m_next.load(std::memory_order_acquire));
+  }
+  /// @brief the frames, what the log costs in memory
+  auto memory_bytes() const -> std::size_t {
+    return m_frames_count * m_page_size;
+  }
+  auto options() const -> const hybrid_log_options & { return m_options; }
+
+private:
+  auto open_backing_file() -> int {
+    if (!m_options.path.empty()) {
+      const int fd =
+          ::open(m_options.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+        detail::throw_errno("open " + m_options.path);
+      }
+      return fd;
+    }
+    const std::string dir = std::filesystem::temp_directory_path().string();
+    const int fd = ::open(dir.c_str(), O_RDWR | O_TMPFILE, 0600);
+    if (fd < 0) {
+      detail::throw_errno("open O_TMPFILE in " + dir);
+    }
+    return fd;
+  }
+
+  auto address_of(std::uint64_t n) const -> address {
+    return (n / m_per_page) * m_page_size + (n % m_per_page) * record_size;
+  }
+  auto frame_of(address at) const -> std::size_t {
+    return (at / m_page_size) % m_frames_count;
+  }
+  auto record_at(address at) const -> Record & {
+    return *reinterpret_cast<Record *>(m_frames + frame_of(at) * m_page_size +
+                                       at % m_page_size);
+  }
+  void unpin(address at) {
+    m_writers[frame_of(at)].value.fetch_sub(1, std::memory_order_release);
+  }
+
+  /// @brief claim the next slot and pin its frame. a slot whose page went
+  /// read only before we pinned it is dropped (it's never referenced) and we
+  /// take another
+  auto allocate() -> address {
+    while (true) {
+      const std::uint64_t n = m_next.fetch_add(1, std::memory_order_acq_rel);
+      const address at = address_of(n);
+      const std::uint64_t page = at / m_page_size;
+      if (n % m_per_page == 0) {
+        // a new page, read_only has to follow
+        wake_flusher();
+      }
+      // the frame is ours once its previous page is evicted
+      address head = m_head.load(std::memory_order_acquire);
+      while (page >= head / m_page_size + m_frames_count) {
+        wake_flusher();
+        m_head.wait(head, std::memory_order_acquire);
+        head = m_head.load(std::memory_order_acquire);
+      }
+      m_writers[frame_of(at)].value.fetch_add(1, std::memory_order_seq_cst);
+      if (at >= m_read_only.load(std::memory_order_seq_cst)) [[likely]] {
+        return at;
+      }
+      unpin(at);
+    }
+  }
+
+  void wake_flusher() {
+    m_wake.fetch_add(1, std::memory_order_release);
+    m_wake.notify_one();
+  }
+
+  void flush_loop() {
+    std::uint64_t seen = m_wake.load(std::memory_order_acquire);
+    while (!m_stop.load(std::memory_order_acquire)) {
+      flush_step();
+      m_wake.wait(seen, std::memory_order_acquire);
+      seen = m_wake.load(std::memory_order_acquire);
+    }
+  }
+
+  /// @brief move read_only behind the tail, flush what fell below it and
+  /// evict enough to keep a free frame ahead of the tail
+  void flush_step() {
+    const std::uint64_t tail_page = tail() / m_page_size;
+    const std::uint64_t read_only_page =
+        tail_page + 1 > m_mutable_pages ? tail_page + 1 - m_mutable_pages : 0;
+    if (read_only_page * m_page_size >
+        m_read_only.load(std::memory_order_relaxed)) {
+      m_read_only.store(read_only_page * m_page_size,
+                        std::memory_order_seq_cst);
+    }
+
+    for (; m_flushed_page < read_only_page; ++m_flushed_page) {
+      const std::size_t frame = m_flushed_page % m_frames_count;
+      // appends and in place updates that got in before read_only moved
+      while (m_writers[frame].value.load(std::memory_order_seq_cst) != 0) {
+        std::this_thread::yield();
+      }
+      detail::pwrite_all(m_fd, m_frames + frame * m_page_size, m_page_size,
+                         m_flushed_page * m_page_size, m_options.path);
+      m_flushed.store((m_flushed_page + 1) * m_page_size,
+                      std::memory_order_release);
+    }
+
+    // keep as much as possible in memory, but a frame ahead of the tail free
+    const std::uint64_t head_page =
+        std::min(tail_page + 2 > m_frames_count ? tail_page + 2 - m_frames_count
+                                                : 0,
+                 m_flushed_page);
+    if (head_page * m_page_size > m_head.load(std::memory_order_relaxed)) {
+      m_head.store(head_page * m_page_size, std::memory_order_release);
+      m_head.notify_all();
+    }
+  }
+
+  const hybrid_log_options m_options;
+  const std::size_t m_page_size;
+  const std::size_t m_per_page;
+  const std::size_t m_frames_count;
+  const std::size_t m_mutable_pages;
+  int m_fd{-1};
+  std::byte *m_frames{nullptr};
+  // appenders and in place updaters currently writing into each frame
+  std::unique_ptr<padded<tftf::atomic<std::uint32_t>>[]> m_writers;
+
+  // records handed out, the tail is address_of(m_next)
+  alignas(cache_line) tftf::atomic<std::uint64_t> m_next{0};
+  alignas(cache_line) tftf::atomic<address> m_read_only{0};
+  alignas(cache_line) tftf::atomic<address> m_head{0};
+  tftf::atomic<address> m_flushed{0};
+  // flusher only
+  std::uint64_t m_flushed_page{0};
+
+  alignas(cache_line) tftf::atomic<std::uint64_t> m_wake{0};
+  tftf::atomic<bool> m_stop{false};
+  std::thread m_flusher;
+};
+
+} // namespace tftf
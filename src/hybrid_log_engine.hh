@@ -0,0 +1,249 @@
+#pragma once
+
+#include "bucket_engine.hh"
+#include "common.hh"
+#include "hash.hh"
+#include "hybrid_log.hh"
+#include "state.hh"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+namespace tftf {
+
+/// @brief storage engine for datasets bigger than memory, FASTER's own
+/// design: a bucket_engine index from key to log address in front of a
+/// hybrid_log (see hybrid_log.hh) holding the records. only the index and
+/// the log's frames are in memory, so memory is bounded by the key count
+/// and `memory_pages`, not by the values.
+///
+/// writes to a key serialize on its index bucket. a record still in the
+/// mutable tail is overwritten in place, anything older gets a fresh copy
+/// appended and the index repointed (read-copy-update). updates of cold
+/// records read them from disk with the bucket locked. erased and
+/// superseded records stay in the log, there's no compaction yet.
+///
+/// the index is a fixed size bucket_engine, size it up front
+template <class Key, class Value, class Traits> class hybrid_log_engine {
+  static_assert(std::is_trivially_copyable_v<Key> &&
+                    std::is_trivially_copyable_v<Value>,
+                "hybrid_log_engine writes keys and values to disk as is");
+
+public:
+  struct record {
+    std::uint64_t version;
+    Key key;
+    Value value;
+  };
+  using log_t = hybrid_log<record>;
+  using address = typename log_t::address;
+  using index_t = bucket_engine<Key, address, Traits>;
+  // the index's hash
+  using hash_t = key_hash<Key, typename Traits::hasher>;
+  // nothing comes out of the workers' resources
+  static constexpr size_t alloc_size = 0;
+  static constexpr size_t alloc_align = 1;
+  static constexpr size_t slots = index_t::slots;
+
+  hybrid_log_engine(std::size_t table_size, hybrid_log_options options = {})
+      : m_index(table_size), m_log(std::move(options)),
+        m_io(m_log.options().io_threads) {}
+
+  hybrid_log_engine(const hybrid_log_engine &) = delete;
+  hybrid_log_engine &operator=(const hybrid_log_engine &) = delete;
+
+  auto get(worker_state &state, const Key &key) -> std::optional<Value> {
+    return get_hashed(state, hash_t{}(key), key);
+  }
+
+  /// @brief the *_hashed calls take hash_t{}(key)
+  auto get_hashed(worker_state &state, uint64_t hash, const Key &key)
+      -> std::optional<Value> {
+    const std::optional<address> at = m_index.get_hashed(state, hash, key);
+    if (!at) {
+      return std::nullopt;
+    }
+    return read_value(*at, key);
+  }
+
+  template <class Key_, class Value_>
+  auto put(worker_state &state, Key_ &&key, Value_ &&value) -> bool {
+    const Key k(std::forward<Key_>(key));
+    return put_hashed(state, hash_t{}(k), k,
+                      std::forward<Value_>(value));
+  }
+
+  template <class Value_>
+  auto put_hashed(worker_state &state, uint64_t hash, const Key &k,
+                  Value_ &&value) -> bool {
+    const Value v(std::forward<Value_>(value));
+    return m_index.upsert_hashed(
+        state, hash, k, [&](const std::optional<address> &at) -> address {
+          if (at && m_log.update_in_place(
+                        *at, [&](record &r) { r.value = v; })) {
+            return *at;
+          }
+          return append(k, v);
+        });
+  }
+
+  /// @brief fn(old) -> new. runs with the key's index bucket locked, after
+  /// reading the current record (from disk if it's cold)
+  template <class UpdateFn>
+  auto update(worker_state &state, const Key &key, UpdateFn &&fn)
+      -> std::optional<Value> {
+    return update_hashed(state, hash_t{}(key), key,
+                         std::forward<UpdateFn>(fn));
+  }
+
+  template <class UpdateFn>
+  auto update_hashed(worker_state &state, uint64_t hash, const Key &key,
+                     UpdateFn &&fn) -> std::optional<Value> {
+    std::optional<Value> old;
+    m_index.update_hashed(state, hash, key, [&](address at) {
+      return rmw_at(at, key, fn, old);
+    });
+    return old;
+  }
+
+  /// @brief update with fn if the key is there, append `init` if not, in
+  /// one trip through the index lock. returns the old value
+  template <class Fn>
+  auto upsert_rmw(worker_state &state, const Key &key, const Value &init,
+                  Fn &&fn) -> std::optional<Value> {
+    std::optional<Value> old;
+    m_index.upsert(state, key,
+                   [&](const std::optional<address> &at) -> address {
+                     return at ? rmw_at(*at, key, fn, old) : append(key, init);
+                   });
+    return old;
+  }
+
+  auto erase(worker_state &state, const Key &key) -> bool {
+    return m_index.erase(state, key);
+  }
+
+  auto erase_hashed(worker_state &state, uint64_t hash, const Key &key)
+      -> bool {
+    return m_index.erase_hashed(state, hash, key);
+  }
+
+  /// @brief get without blocking on the disk. a key that's missing or still
+  /// in memory is answered right away with done(std::optional<Value>) and we
+  /// return true. for a cold one the read goes to the io pool and we return
+  /// false, done then runs on a pool thread (see complete_pending)
+  template <class Done>
+  auto get_async(worker_state &state, const Key &key, Done &&done) -> bool {
+    const std::optional<address> at = m_index.get(state, key);
+    if (!at) {
+      done(std::optional<Value>{});
+      return true;
+    }
+    record r;
+    if (m_log.read_in_memory(*at, r)) {
+      done(std::optional<Value>{r.value});
+      return true;
+    }
+    m_io.submit([this, at = *at, key,
+                 done = std::forward<Done>(done)]() mutable {
+      record cold;
+      m_log.read_from_disk(at, cold);
+      assert(cold.key == key);
+      (void)key;
+      done(std::optional<Value>{cold.value});
+    });
+    return false;
+  }
+
+  /// @brief wait for every get_async issued so far to call back
+  void complete_pending() { m_io.drain(); }
+
+  auto get_batch(worker_state &state, std::span<const Key> keys,
+                 std::span<std::optional<Value>> out) -> size_t {
+    assert(out.size() >= keys.size());
+    std::optional<address> at[batch_window];
+    size_t found = 0;
+    for (size_t base = 0; base < keys.size(); base += batch_window) {
+      const size_t n = std::min(batch_window, keys.size() - base);
+      m_index.get_batch(state, keys.subspan(base, n), std::span{at, n});
+      for (size_t i = 0; i < n; ++i) {
+        out[base + i].reset();
+        if (at[i]) {
+          out[base + i] = read_value(*at[i], keys[base + i]);
+          found++;
+        }
+      }
+    }
+    return found;
+  }
+
+  auto put_batch(worker_state &state, std::span<const Key> keys,
+                 std::span<const Value> values) -> size_t {
+    assert(values.size() >= keys.size());
+    size_t inserted = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      inserted += put(state, keys[i], values[i]);
+    }
+    return inserted;
+  }
+
+  /// @brief the index's for_each, with every record read back from the log
+  /// (cold ones from disk)
+  template <class Fn>
+  void for_each(worker_state &state, size_t first, size_t last, size_t buckets,
+                Fn &&fn) {
+    m_index.for_each(state, first, last, buckets,
+                     [&](const Key &key, address at) {
+                       fn(key, read_value(at, key));
+                     });
+  }
+
+  auto size() const -> std::size_t { return m_index.size(); }
+  auto bucket_count() const -> std::size_t { return m_index.bucket_count(); }
+  auto log() const -> const log_t & { return m_log; }
+
+private:
+  // index lookups per get_batch round
+  static constexpr size_t batch_window = 16;
+
+  auto read_value(address at, [[maybe_unused]] const Key &key) const
+      -> Value {
+    record r;
+    m_log.read(at, r);
+    assert(r.key == key);
+    return r.value;
+  }
+
+  /// @brief fn on the record at `at`, with the key's index bucket locked:
+  /// in place while it's mutable, a new copy otherwise. the value it was
+  /// applied to goes to `old`, returns where the key lives now
+  template <class Fn>
+  auto rmw_at(address at, const Key &key, Fn &fn, std::optional<Value> &old)
+      -> address {
+    record current;
+    m_log.read(at, current);
+    old = current.value;
+    const Value updated = fn(current.value);
+    if (m_log.update_in_place(at, [&](record &r) { r.value = updated; })) {
+      return at;
+    }
+    return append(key, updated);
+  }
+
+  auto append(const Key &key, const Value &value) -> address {
+    return m_log.append([&](record &r) {
+      r.key = key;
+      r.value = value;
+    });
+  }
+
+  index_t m_index;
+  log_t m_log;
+  io_pool m_io;
+};
+} // namespace tftf
@@ -0,0 +1,153 @@
+#pragma once
+/// file plumbing shared by everything that touches disk (checkpoints, the
+/// hybrid log): errno to exceptions, full reads/writes that retry short
+/// transfers, and the thread pool async reads run on
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace tftf {
+
+namespace detail {
+[[noreturn]] inline void throw_errno(const std::string &what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+inline void write_all(int fd, const void *data, std::size_t bytes,
+                      const std::string &path) {
+  const auto *p = static_cast<const std::byte *>(data);
+  while (bytes > 0) {
+    const ssize_t n = ::write(fd, p, bytes);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw_errno("write " + path);
+    }
+    p += n;
+    bytes -= static_cast<std::size_t>(n);
+  }
+}
+
+inline void pwrite_all(int fd, const void *data, std::size_t bytes,
+                       std::uint64_t offset, const std::string &path) {
+  const auto *p = static_cast<const std::byte *>(data);
+  while (bytes > 0) {
+    const ssize_t n = ::pwrite(fd, p, bytes, static_cast<off_t>(offset));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw_errno("pwrite " + path);
+    }
+    p += n;
+    offset += static_cast<std::uint64_t>(n);
+    bytes -= static_cast<std::size_t>(n);
+  }
+}
+
+inline void pread_all(int fd, void *data, std::size_t bytes,
+                      std::uint64_t offset, const std::string &path) {
+  auto *p = static_cast<std::byte *>(data);
+  while (bytes > 0) {
+    const ssize_t n = ::pread(fd, p, bytes, static_cast<off_t>(offset));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw_errno("pread " + path);
+    }
+    if (n == 0) {
+      throw std::system_error(EIO, std::generic_category(),
+                              "pread " + path + ": past the end");
+    }
+    p += n;
+    offset += static_cast<std::uint64_t>(n);
+    bytes -= static_cast<std::size_t>(n);
+  }
+}
+} // namespace detail
+
+/// @brief a few threads running blocking I/O jobs in submission order, the
+/// fallback for async reads where there's no io_uring. jobs must not throw
+class io_pool {
+public:
+  explicit io_pool(std::size_t threads) {
+    for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); ++i) {
+      m_threads.emplace_back([this]() { run(); });
+    }
+  }
+
+  io_pool(const io_pool &) = delete;
+  io_pool &operator=(const io_pool &) = delete;
+
+  /// @brief finishes whatever was submitted before returning
+  ~io_pool() {
+    {
+      const std::lock_guard lock{m_mutex};
+      m_stop = true;
+    }
+    m_ready.notify_all();
+    for (std::thread &t : m_threads) {
+      t.join();
+    }
+  }
+
+  void submit(std::function<void()> job) {
+    {
+      const std::lock_guard lock{m_mutex};
+      m_jobs.push_back(std::move(job));
+      m_pending++;
+    }
+    m_ready.notify_one();
+  }
+
+  /// @brief block until every job submitted so far has run
+  void drain() {
+    std::unique_lock lock{m_mutex};
+    m_idle.wait(lock, [this]() { return m_pending == 0; });
+  }
+
+private:
+  void run() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock lock{m_mutex};
+        m_ready.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+        if (m_jobs.empty()) {
+          return;
+        }
+        job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+      }
+      job();
+      const std::lock_guard lock{m_mutex};
+      if (--m_pending == 0) {
+        m_idle.notify_all();
+      }
+    }
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::condition_variable m_idle;
+  std::deque<std::function<void()>> m_jobs;
+  std::size_t m_pending{0};
+  bool m_stop{false};
+  std::vector<std::thread> m_threads;
+};
+
+} // namespace tftf
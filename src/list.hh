@@ -1,125 +1,326 @@
+#pragma once
+
+#include <algorithm>
 #include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
 #include <optional>
 #include <string>
+#include <type_traits>
 #include <utility>
 
 #include "state.hh"
 
 namespace tftf {
 
-template <class Key, class Value> struct node {
-public:
-  template <class _Key, class _Value>
-  node(_Key &&_key, _Value &&_value)
-      : m_key(std::forward<_Key>(_key)), m_value(std::forward<_Value>(_value)) {
+/// @brief stands in for a node's birth epoch when nobody tracks it
+struct no_birth {};
+
+/// @brief value storage policies, picked with `Traits::value_storage`.
+/// inline values live in the node as a std::atomic<Value>, which is only
+/// lock free for small trivially copyable types. boxed values live out of
+/// line in an immutable value_box that the node points to: writers build a
+/// new box and swap the pointer, readers copy out of whichever box they
+/// loaded, and replaced boxes are retired with the epoch like nodes.
+/// auto_values boxes whatever wouldn't be inline and lock free
+struct inline_values {};
+struct boxed_values {};
+struct auto_values {};
+
+namespace detail {
+template <class Value> consteval auto lock_free_inline() -> bool {
+  if constexpr (std::is_trivially_copyable_v<Value>) {
+    return std::atomic<Value>::is_always_lock_free;
+  } else {
+    return false;
   }
-  const Key &key() const { return m_key; }
-  std::atomic<Value> &value() { return m_value; }
-  bool is_marked() const { return m_next.load(std::memory_order_acquire) & 1; }
-  node *next() const {
-    return reinterpret_cast<node *>(m_next.load(std::memory_order_acquire) &
+}
+} // namespace detail
+
+template <class Storage, class Value>
+inline constexpr bool boxes_values =
+    std::is_same_v<Storage, boxed_values> ||
+    (std::is_same_v<Storage, auto_values> &&
+     !detail::lock_free_inline<Value>());
+
+/// @brief an out of line value. written once before it's published through
+/// a node, never changed after, so readers don't need to synchronize with
+/// anything but the pointer load
+template <class Value> struct value_box {
+  box_header header;
+  Value value;
+
+  static void destroy(void *p) { static_cast<value_box *>(p)->value.~Value(); }
+};
+
+/// @brief a harris link: the pointer to the next Node, with the low bit set
+/// once the Node owning the link is logically deleted. a marked link never
+/// changes again, so a node is unlinked by a compare_exchange on its
+/// predecessor's (unmarked) link, and nothing can be linked in after a node
+/// that's being deleted. list chains one per node, skip_list one per level
+template <class Node> struct marked_link : std::atomic<uintptr_t> {
+  marked_link() : std::atomic<uintptr_t>(0) {}
+
+  Node *next() const {
+    return reinterpret_cast<Node *>(load(std::memory_order_acquire) &
                                     ~uintptr_t{1});
   }
-  void set_next(node *n) {
-    m_next.store(reinterpret_cast<uintptr_t>(n), std::memory_order_release);
+  bool is_marked() const { return load(std::memory_order_acquire) & 1; }
+  std::pair<Node *, bool> get_next_and_is_marked() const {
+    uintptr_t nxt = load(std::memory_order_acquire);
+    return std::make_pair(reinterpret_cast<Node *>(nxt & ~uintptr_t{1}),
+                          nxt & 1);
   }
-  void mark() { m_next.fetch_or(1); }
-  bool cas_next(node *expected_next, node *new_next) {
+  void set_next(Node *n) {
+    store(reinterpret_cast<uintptr_t>(n), std::memory_order_release);
+  }
+  void mark() { fetch_or(1); }
+  bool cas_next(Node *expected_next, Node *new_next) {
     uintptr_t exp = reinterpret_cast<uintptr_t>(expected_next);
     uintptr_t nxt = reinterpret_cast<uintptr_t>(new_next);
-    return m_next.compare_exchange_strong(exp, nxt, std::memory_order_release,
-                                          std::memory_order_acquire);
+    return compare_exchange_strong(exp, nxt, std::memory_order_release,
+                                   std::memory_order_acquire);
   }
-  bool cas_mark(node *expected_next) {
+  bool cas_mark(Node *expected_next) {
     uintptr_t exp = reinterpret_cast<uintptr_t>(expected_next);
     uintptr_t nxt = exp | 1;
-    return m_next.compare_exchange_strong(exp, nxt, std::memory_order_release,
-                                          std::memory_order_acquire);
+    return compare_exchange_strong(exp, nxt, std::memory_order_release,
+                                   std::memory_order_acquire);
+  }
+};
+
+/// @brief `Stamped` nodes remember the epoch they were allocated in, for
+/// interval reclamation. `Boxed` nodes hold a pointer to a value_box, null
+/// once the node is erased
+template <class Key, class Value, bool Stamped = false, bool Boxed = false>
+struct node {
+public:
+  // what m_value holds
+  using slot_t = std::conditional_t<Boxed, value_box<Value> *, Value>;
+
+  template <class _Key, class _Slot>
+  node(std::uint64_t order, _Key &&_key, _Slot &&_slot)
+      : m_link(nullptr), m_key(std::forward<_Key>(_key)),
+        m_value(std::forward<_Slot>(_slot)), m_order(order) {}
+  const Key &key() const { return m_key; }
+  std::uint64_t birth() const {
+    if constexpr (Stamped) {
+      return m_birth;
+    } else {
+      return 0;
+    }
   }
+  std::atomic<slot_t> &value() { return m_value; }
+  /// @brief split-order key, see `list` for the ordering
+  std::uint64_t order() const { return m_order; }
+  bool is_sentinel() const { return !(m_order & 1); }
+  bool is_marked() const { return m_next.is_marked(); }
+  node *next() const { return m_next.next(); }
+  void set_next(node *n) { m_next.set_next(n); }
+  void mark() { m_next.mark(); }
+  bool cas_next(node *expected_next, node *new_next) {
+    return m_next.cas_next(expected_next, new_next);
+  }
+  bool cas_mark(node *expected_next) { return m_next.cas_mark(expected_next); }
   std::pair<node *, bool> get_next_and_is_marked() const {
-    uintptr_t nxt = m_next.load(std::memory_order_acquire);
-    return std::make_pair(reinterpret_cast<node *>(nxt & ~uintptr_t{1}),
-                          nxt & 1);
+    return m_next.get_next_and_is_marked();
   }
 
 private:
-  template <class K, class V, class C> friend class list;
+  template <class K, class V, class C, class R, class S> friend class list;
+  // never read by searches: a retired node is chained into its worker's
+  // limbo bags (and then the allocator's freelist) through this word while
+  // readers may still be walking through it
+  void *m_link;
+  [[no_unique_address]] std::conditional_t<Stamped, std::uint64_t, no_birth>
+      m_birth{};
   Key m_key;
-  std::atomic<Value> m_value;
-  std::atomic<uintptr_t> m_next{0};
+  std::atomic<slot_t> m_value;
+  marked_link<node> m_next;
+  std::uint64_t m_order;
 };
 
-template <class Key, class Value, class Compare> class list {
-public:
-  using node_t = node<Key, Value>;
-  static constexpr size_t alloc_size = sizeof(node_t);
+/// @brief reverse the bits of a 64 bit word
+constexpr auto reverse_bits(std::uint64_t x) -> std::uint64_t {
+  x = ((x >> 1) & 0x5555555555555555ull) | ((x & 0x5555555555555555ull) << 1);
+  x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((x & 0x0F0F0F0F0F0F0F0Full) << 4);
+  return __builtin_bswap64(x);
+}
 
-  list() {
-    head = static_cast<node_t *>(std::malloc(sizeof(node_t)));
-    tail = static_cast<node_t *>(std::malloc(sizeof(node_t)));
+/// @brief split-order key of a real entry: the bit reversed hash with the low
+/// bit set, so it sorts after the sentinel of every bucket it can belong to
+constexpr auto regular_order(std::uint64_t hash) -> std::uint64_t {
+  return reverse_bits(hash | (std::uint64_t{1} << 63));
+}
 
-    new (&(head->m_next)) std::atomic<uintptr_t>(0);
-    new (&(tail->m_next)) std::atomic<uintptr_t>(0);
+/// @brief split-order key of the sentinel starting `bucket`
+constexpr auto sentinel_order(std::uint64_t bucket) -> std::uint64_t {
+  return reverse_bits(bucket);
+}
 
+/// @brief a single harris list holding every entry of a table in split order
+/// (Shalev & Shavit): nodes are sorted by their bit reversed hash, then by
+/// `Compare`. Buckets are sentinel nodes spliced into the list, so every
+/// operation takes the sentinel to start from (any sentinel at or before the
+/// key is fine, `head()` always works). Growing a table never moves a node, it
+/// only adds sentinels.
+///
+/// `Reclaim` is the reclamation policy (see state.hh): every pointer a search
+/// follows is loaded through `Reclaim::protect`. `Storage` is the value
+/// storage policy, see inline_values. boxes come from the same worker
+/// resources as nodes, so blocks are sized for whichever is bigger
+template <class Key, class Value, class Compare, class Reclaim = epoch_reclaim,
+          class Storage = auto_values>
+class list {
+public:
+  static constexpr bool boxed = boxes_values<Storage, Value>;
+  using node_t = node<Key, Value, Reclaim::interval_based, boxed>;
+  using box_t = value_box<Value>;
+  static constexpr size_t alloc_size =
+      boxed ? std::max(sizeof(node_t), sizeof(box_t)) : sizeof(node_t);
+  static constexpr size_t alloc_align =
+      boxed ? std::max(alignof(node_t), alignof(box_t)) : alignof(node_t);
+
+  list() : list(nullptr) {}
+  /// @brief with the head sentinel built in `head_storage` (sizeof(node_t),
+  /// aligned for one) instead of inside the list, for engines that keep it
+  /// next to the other buckets' sentinels
+  explicit list(void *head_storage)
+      : head(init_sentinel(head_storage != nullptr ? head_storage
+                                                   : m_head_storage,
+                           sentinel_order(0))),
+        tail(init_sentinel(m_tail_storage, ~std::uint64_t{0})) {
     head->set_next(tail);
   }
 
-  ~list() {
-    head->m_next.~atomic();
-    tail->m_next.~atomic();
+  list(const list &) = delete;
+  list &operator=(const list &) = delete;
 
-    std::free(head);
-    std::free(tail);
+  ~list() {
+    destroy_sentinel(head);
+    destroy_sentinel(tail);
 
     // TODO: walk list and delete real nodes with proper delete
   }
 
-  template <class Key_, class Value_>
-  auto put(worker_state &state, Key_ &&key, Value_ &&value) -> bool {
-    void *new_mem = state.resource.allocate(alloc_size);
+  auto first() const -> node_t * { return head; }
 
-    node_t *new_node = new (new_mem)
-        node_t(std::forward<Key_>(key), std::forward<Value_>(value));
+  template <class Key_, class Value_>
+  auto put(worker_state &state, node_t *start, std::uint64_t order,
+           Key_ &&key, Value_ &&value) -> bool {
+    node_t *new_node = make_node(state, order, std::forward<Key_>(key),
+                                 std::forward<Value_>(value));
 
     node_t *left, *right;
 
     do {
-      right = search(state, new_node->key(), left);
-      if ((right != tail) && (right->key() == new_node->key())) {
-        right->value().store(
-            std::move(new_node->value().load(std::memory_order_acquire)),
-            std::memory_order_release);
-        new_node->~node_t();
-        state.resource.deallocate(new_mem, alloc_size);
+      right = search(state, start, order, &new_node->key(), left);
+      if (matches(right, order, new_node->key())) {
+        if constexpr (boxed) {
+          box_t *box = new_node->value().load(std::memory_order_relaxed);
+          if (!swap_box(state, right, box)) {
+            // erased under us, the next search goes past it
+            continue;
+          }
+          new_node->value().store(nullptr, std::memory_order_relaxed);
+        } else {
+          right->value().store(
+              std::move(new_node->value().load(std::memory_order_acquire)),
+              std::memory_order_release);
+        }
+        free_node(state, new_node);
         return false;
       }
       new_node->set_next(right);
       if (left->cas_next(right, new_node)) {
         return true;
       }
+      state.count(table_event::cas_retries);
     } while (true);
   }
 
+  /// @brief replace the value with f(old). retried with compare_exchange
+  /// until nobody changed the value in between, so f may run more than once
+  /// and has to be pure. returns the value f was last applied to
   template <class Key_, class Fn>
-  auto update(worker_state &state, Key_ &&key, Fn &&f) -> std::optional<Value> {
+  auto update(worker_state &state, node_t *start, std::uint64_t order,
+              Key_ &&key, Fn &&f) -> std::optional<Value> {
+    node_t *left;
+    node_t *right = search(state, start, order, &key, left);
+    if (!matches(right, order, key)) {
+      return std::nullopt;
+    }
+    if constexpr (boxed) {
+      return update_box(state, right, f);
+    } else {
+      return update_value(state, right, f);
+    }
+  }
 
-    node_t *left, *right;
+  /// @brief fn(std::atomic<Value> &) -> old value on the key's value, for
+  /// rmws that are a single atomic instruction (fetch_add and friends).
+  /// inline values only
+  template <class Fn>
+  auto modify(worker_state &state, node_t *start, std::uint64_t order,
+              const Key &key, Fn &&fn) -> std::optional<Value>
+    requires(!boxed)
+  {
+    node_t *left;
+    node_t *right = search(state, start, order, &key, left);
+    if (!matches(right, order, key)) {
+      return std::nullopt;
+    }
+    return fn(right->value());
+  }
 
-    do {
-      right = search(state, key, left);
-      if ((right != tail) && (right->key() == key)) {
-        const Value old = right->value().load(std::memory_order_acquire);
-        right->value().store(f(old), std::memory_order_release);
+  /// @brief update with f if the key is there, otherwise insert `init`.
+  /// returns the old value, nullopt if we inserted. an update racing an
+  /// erase of the same key can land on the node being erased, like update
+  template <class Key_, class Fn>
+  auto upsert_rmw(worker_state &state, node_t *start, std::uint64_t order,
+                  Key_ &&key, const Value &init, Fn &&f)
+      -> std::optional<Value> {
+    node_t *new_node = nullptr;
+    node_t *left, *right;
+    while (true) {
+      right = search(state, start, order, &key, left);
+      if (matches(right, order, key)) {
+        std::optional<Value> old;
+        if constexpr (boxed) {
+          old = update_box(state, right, f);
+          if (!old) {
+            // erased under us, insert instead
+            continue;
+          }
+        } else {
+          old = update_value(state, right, f);
+        }
+        if (new_node != nullptr) {
+          free_node(state, new_node);
+        }
         return old;
       }
-      return std::nullopt;
-    } while (true);
+      if (new_node == nullptr) {
+        new_node = make_node(state, order, key, init);
+      }
+      new_node->set_next(right);
+      if (left->cas_next(right, new_node)) {
+        return std::nullopt;
+      }
+      state.count(table_event::cas_retries);
+    }
   }
-  auto erase(worker_state &state, const Key &key) -> bool {
+
+  template <class K>
+  auto erase(worker_state &state, node_t *start, std::uint64_t order,
+             const K &key) -> bool {
     node_t *right, *right_next, *left;
     do {
-      right = search(state, key, left);
-      if ((right == tail) || (right->key() != key)) {
+      right = search(state, start, order, &key, left);
+      if (!matches(right, order, key)) {
         return false;
       }
       right_next = right->next();
@@ -127,44 +328,315 @@ public:
       if (!right->is_marked() && right->cas_mark(right_next)) {
         break;
       }
+      state.count(table_event::cas_retries);
     } while (true);
+    if constexpr (boxed) {
+      // whoever marked the node owns its last box
+      if (box_t *box =
+              right->value().exchange(nullptr, std::memory_order_acq_rel)) {
+        retire_box(state, box);
+      }
+    }
     // no idea what this does? seems like a compaction step
     if (!left->cas_next(right, right_next)) {
-      right = search(state, right->key(), left);
+      right = search(state, start, order, &right->key(), left);
     } else {
-      // doesn't this just get leaked?
       uint64_t epoch =
-          state.epoch_counter->fetch_add(1, std::memory_order_acquire);
-      state.freelist_add({right, epoch});
+          state.epoch_counter->fetch_add(1, std::memory_order_acq_rel);
+      state.retire(right, epoch, right->birth());
     }
     return true;
   }
-  auto find(worker_state &state, const Key &key) -> std::optional<Value> {
+  /// @brief `key` is a Key or anything Compare and == take against one (a
+  /// string_view with std::less<>), like erase's
+  template <class K>
+  auto find(worker_state &state, node_t *start, std::uint64_t order,
+            const K &key) -> std::optional<Value> {
     node_t *left, *right;
-    right = search(state, key, left);
-    if ((right != tail) && (right->key() == key)) {
-      return right->value();
+    right = search(state, start, order, &key, left);
+    if (matches(right, order, key)) {
+      return load_value(state, right);
     }
     return std::nullopt;
   }
 
+  /// @brief read-only lookups of several keys at once, walked in lockstep:
+  /// every round advances each unfinished lookup by one node and prefetches
+  /// the next, so the cache misses of different keys overlap. Marked nodes
+  /// are walked through rather than unlinked. returns how many were found
+  auto find_interleaved(worker_state &state, node_t *const *starts,
+                        const std::uint64_t *orders, const Key *keys,
+                        std::optional<Value> *out, size_t n) const -> size_t {
+    constexpr size_t max_lanes = 64;
+    assert(n <= max_lanes);
+    node_t *cur[max_lanes];
+    std::uint64_t active = n == max_lanes ? ~std::uint64_t{0}
+                                          : (std::uint64_t{1} << n) - 1;
+    for (size_t i = 0; i < n; ++i) {
+      // the sentinels were prefetched by the caller
+      cur[i] = next_of(state, starts[i]).first;
+      __builtin_prefetch(cur[i]);
+    }
+
+    size_t found = 0;
+    while (active != 0) {
+      for (std::uint64_t lanes = active; lanes != 0; lanes &= lanes - 1) {
+        const size_t i = std::countr_zero(lanes);
+        node_t *t = cur[i];
+        if (t == tail || !before(t, orders[i], &keys[i])) {
+          if (matches(t, orders[i], keys[i]) && !t->is_marked()) {
+            out[i] = load_value(state, t);
+          } else {
+            out[i] = std::nullopt;
+          }
+          found += out[i].has_value();
+          active &= ~(std::uint64_t{1} << i);
+          continue;
+        }
+        cur[i] = next_of(state, t).first;
+        __builtin_prefetch(cur[i]);
+      }
+    }
+    return found;
+  }
+
+  /// @brief visit every live entry after `start` with an order in
+  /// [first, last] as fn(key, value), skipping sentinels and erased nodes.
+  /// nodes never move, so concurrent inserts and erases only decide whether
+  /// their own entry is seen. the caller holds the epoch guard
+  template <class Fn>
+  void walk(worker_state &state, node_t *start, std::uint64_t first,
+            std::uint64_t last, Fn &&fn) const {
+    node_t *t = next_of(state, start).first;
+    while (t != tail && t->order() <= last) {
+      const auto [next, marked] = next_of(state, t);
+      if (!marked && !t->is_sentinel() && t->order() >= first) {
+        if constexpr (boxed) {
+          if (const box_t *box = Reclaim::protect(state, t->m_value)) {
+            fn(t->key(), box->value);
+          }
+        } else {
+          fn(t->key(), t->m_value.load(std::memory_order_acquire));
+        }
+      }
+      t = next;
+    }
+  }
+
+  /// @brief splice `sentinel` (from init_sentinel) into the list after
+  /// `start`. only one worker may splice a given order: the sentinel is
+  /// written until it's in, so racers for a bucket have to agree on who
+  /// does it first (see list_engine::init_bucket)
+  void insert_sentinel(worker_state &state, node_t *start, node_t *sentinel) {
+    const std::uint64_t order = sentinel->order();
+    node_t *left;
+    while (true) {
+      node_t *right =
+          search(state, start, order, static_cast<const Key *>(nullptr), left);
+      assert(right == tail || right->order() != order);
+      sentinel->set_next(right);
+      if (left->cas_next(right, sentinel)) {
+        return;
+      }
+      state.count(table_event::cas_retries);
+    }
+  }
+
+  /// @brief build a sentinel for `order` in `mem` (sizeof(node_t), aligned
+  /// for one), which the caller owns. sentinels never have their key or value
+  /// constructed, they are only ever compared by order. the list can't walk
+  /// itself on destruction (the real nodes may already be gone with their
+  /// workers' resources), so whoever keeps the memory destroys them
+  static auto init_sentinel(void *mem, std::uint64_t order) -> node_t * {
+    node_t *n = static_cast<node_t *>(mem);
+    new (&(n->m_next)) marked_link<node_t>();
+    n->m_order = order;
+    return n;
+  }
+  static void destroy_sentinel(node_t *n) { n->m_next.~marked_link(); }
+
 private:
+  template <class Key_, class Value_>
+  auto make_node(worker_state &state, std::uint64_t order, Key_ &&key,
+                 Value_ &&value) -> node_t * {
+    void *mem = state.resource.allocate(alloc_size, alloc_align);
+    node_t *n;
+    if constexpr (boxed) {
+      n = new (mem) node_t(order, std::forward<Key_>(key),
+                           make_box(state, std::forward<Value_>(value)));
+    } else {
+      n = new (mem)
+          node_t(order, std::forward<Key_>(key), std::forward<Value_>(value));
+    }
+    if constexpr (Reclaim::interval_based) {
+      n->m_birth = state.epoch_counter->load(std::memory_order_acquire);
+    }
+    return n;
+  }
+  /// @brief for a node nobody else ever saw, along with its box
+  static void free_node(worker_state &state, node_t *n) {
+    if constexpr (boxed) {
+      if (box_t *box = n->value().load(std::memory_order_relaxed)) {
+        free_box(state, box);
+      }
+    }
+    n->~node_t();
+    state.resource.deallocate(n, alloc_size, alloc_align);
+  }
+
+  template <class Value_>
+  static auto make_box(worker_state &state, Value_ &&value) -> box_t * {
+    void *mem = state.resource.allocate(alloc_size, alloc_align);
+    std::uint64_t birth = 0;
+    if constexpr (Reclaim::interval_based) {
+      birth = state.epoch_counter->load(std::memory_order_acquire);
+    }
+    return new (mem) box_t{{nullptr, birth, &box_t::destroy},
+                           Value(std::forward<Value_>(value))};
+  }
+  /// @brief for a box nobody else ever saw
+  static void free_box(worker_state &state, box_t *box)
+    requires boxed
+  {
+    box->~box_t();
+    state.resource.deallocate(box, alloc_size, alloc_align);
+  }
+  static void retire_box(worker_state &state, box_t *box)
+    requires boxed
+  {
+    const std::uint64_t epoch =
+        state.epoch_counter->fetch_add(1, std::memory_order_acq_rel);
+    state.retire_box(&box->header, epoch);
+  }
+
+  /// @brief a copy of n's value, nullopt if n's been erased
+  static auto load_value(worker_state &state, const node_t *n)
+      -> std::optional<Value> {
+    if constexpr (boxed) {
+      const box_t *box = Reclaim::protect(state, n->m_value);
+      if (box == nullptr) {
+        return std::nullopt;
+      }
+      return box->value;
+    } else {
+      return n->m_value.load(std::memory_order_acquire);
+    }
+  }
+
+  /// @brief publish `box` as n's value and retire the one it replaces. false
+  /// if n was erased first, `box` is still ours then
+  static auto swap_box(worker_state &state, node_t *n, box_t *box) -> bool
+    requires boxed
+  {
+    box_t *old = n->m_value.load(std::memory_order_acquire);
+    while (old != nullptr) {
+      if (n->m_value.compare_exchange_weak(old, box,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_acquire)) {
+        retire_box(state, old);
+        return true;
+      }
+      state.count(table_event::cas_retries);
+    }
+    return false;
+  }
+
+  /// @brief update_value for boxes: f(old) goes into a new box swapped in
+  /// for the one it was computed from. the box is reused across retries.
+  /// nullopt if n was erased first
+  template <class Fn>
+  static auto update_box(worker_state &state, node_t *n, Fn &f)
+      -> std::optional<Value> {
+    box_t *fresh = nullptr;
+    while (true) {
+      box_t *cur = Reclaim::protect(state, n->m_value);
+      if (cur == nullptr) {
+        if (fresh != nullptr) {
+          free_box(state, fresh);
+        }
+        return std::nullopt;
+      }
+      if (fresh == nullptr) {
+        fresh = make_box(state, f(std::as_const(cur->value)));
+      } else {
+        fresh->value = f(std::as_const(cur->value));
+      }
+      box_t *expected = cur;
+      if (n->m_value.compare_exchange_strong(expected, fresh,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_acquire)) {
+        Value old = cur->value;
+        retire_box(state, cur);
+        return old;
+      }
+      state.count(table_event::cas_retries);
+    }
+  }
+
+  template <class Fn>
+  static auto update_value(worker_state &state, node_t *n, Fn &f) -> Value {
+    Value old = n->value().load(std::memory_order_acquire);
+    while (!n->value().compare_exchange_weak(old, f(old),
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_acquire)) {
+      state.count(table_event::cas_retries);
+    }
+    return old;
+  }
+
+  // the sentinels live right here (the head unless the engine keeps it),
+  // nothing to allocate per list
+  alignas(node_t) std::byte m_head_storage[sizeof(node_t)];
+  alignas(node_t) std::byte m_tail_storage[sizeof(node_t)];
   // this kind of relies on the sentinel-ness here.
   node_t *head, *tail;
+  /// @brief t's successor and whether t is marked, with the successor
+  /// reserved under `Reclaim` before anyone dereferences it
+  static auto next_of(worker_state &state, const node_t *t)
+      -> std::pair<node_t *, bool> {
+    const uintptr_t next = Reclaim::protect(state, t->m_next);
+    return {reinterpret_cast<node_t *>(next & ~uintptr_t{1}), next & 1};
+  }
 
-  node_t *search(worker_state &state, const Key &key, node_t *&left) {
-    node_t *left_next;
-    node_t *right;
+  /// @brief the order is the key's hash (bit reversed), so a different hash
+  /// rules a node out before its key is ever compared
+  template <class K>
+  auto matches(node_t *n, std::uint64_t order, const K &key) const -> bool {
+    return (n != tail) && (n->order() == order) && (n->key() == key);
+  }
 
-    Compare cmp;
+  /// @brief whether `t` sorts strictly before (order, key). sentinels are
+  /// searched for with a null key, real nodes never share a sentinel's order
+  template <class K>
+  static auto before(const node_t *t, std::uint64_t order, const K *key)
+      -> bool {
+    if (t->order() != order) {
+      return t->order() < order;
+    }
+    return key != nullptr && Compare{}(t->key(), *key);
+  }
+
+  template <class K>
+  node_t *search(worker_state &state, node_t *start, std::uint64_t order,
+                 const K *key, node_t *&left) {
+    node_t *left_next{nullptr};
+    node_t *right;
+    // start is a sentinel and never marked, so the walk always sets this
+    left = start;
+    std::uint64_t walked = 0;
+    auto done = [&]() {
+      state.count(table_event::searches);
+      state.count(table_event::nodes_walked, walked);
+      return right;
+    };
 
   again:
     do {
-      node_t *t = head;
+      node_t *t = start;
       bool t_is_marked;
       node_t *t_next;
 
-      std::tie(t_next, t_is_marked) = t->get_next_and_is_marked();
+      std::tie(t_next, t_is_marked) = next_of(state, t);
 
       do {
         if (!t_is_marked) {
@@ -172,39 +644,43 @@ private:
           left_next = t_next;
         }
         t = t_next;
+        walked++;
         if (t == tail)
           break;
-        std::tie(t_next, t_is_marked) = t->get_next_and_is_marked();
-      } while (t_is_marked || cmp(t->key(), key));
+        std::tie(t_next, t_is_marked) = next_of(state, t);
+      } while (t_is_marked || before(t, order, key));
 
       right = t;
 
       if (left_next == right) {
         if ((right != tail) && right->is_marked()) {
+          state.count(table_event::search_restarts);
           goto again;
         }
-        return right;
+        return done();
       }
       // cas all the dead things
       if (left->cas_next(left_next, right)) {
         if ((right != tail) && right->is_marked()) {
+          state.count(table_event::search_restarts);
           goto again;
         }
 
         uint64_t epoch =
-            state.epoch_counter->fetch_add(1, std::memory_order_acquire);
+            state.epoch_counter->fetch_add(1, std::memory_order_acq_rel);
         while (left_next != right) {
-
-          left = left_next->next();
-          state.freelist_add({left_next, epoch});
-          left_next = left;
+          node_t *dead = left_next;
+          left_next = dead->next();
+          state.retire(dead, epoch, dead->birth());
+          state.count(table_event::nodes_unlinked);
         }
-        return right;
+        return done();
       }
-
+      state.count(table_event::search_restarts);
     } while (true);
   }
 };
 
 template class list<int, int, std::less<int>>;
+template class list<int, std::string, std::less<int>>;
 } // namespace tftf
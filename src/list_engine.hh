@@ -0,0 +1,545 @@
+#pragma once
+
+#include "common.hh"
+#include "hash.hh"
+#include "list.hh"
+#include "state.hh"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <optional>
+#include <span>
+#include <thread>
+#include <type_traits>
+
+namespace tftf {
+
+namespace detail {
+/// @brief whether this thread is running a list_engine combiner's batch
+inline thread_local bool combining = false;
+} // namespace detail
+
+/// @brief the default storage engine for faster: a split-ordered harris list
+/// with a lazily split bucket directory in front of it. Grows online, nodes
+/// come out of the workers' resources and are retired into their limbo bags.
+/// the directory holds the buckets' sentinels themselves, so finding a
+/// bucket is one load into its slot and nothing is allocated per bucket.
+/// buckets whose updates keep losing compare_exchanges (a few hot keys under
+/// skewed traffic) switch to flat combining for a while, see delegate.
+/// lookups (get, update, erase) also take transparent keys (see hash.hh),
+/// which is why the list compares with std::less<>
+template <class Key, class Value, class Traits> class list_engine {
+public:
+  using list_t = tftf::list<Key, Value, std::less<>, typename Traits::reclaim,
+                            typename Traits::value_storage>;
+  using node_t = typename list_t::node_t;
+  // what the workers' resources hand out
+  static constexpr size_t alloc_size = list_t::alloc_size;
+  static constexpr size_t alloc_align = list_t::alloc_align;
+
+  list_engine(std::size_t table_size)
+      : m_list(m_first_bucket.storage),
+        m_size(std::bit_ceil(std::max<std::size_t>(table_size, 1))) {
+    // bucket 0's sentinel is the head of the list, and its own parent
+    m_first_bucket.state.store(bucket_ready, std::memory_order_relaxed);
+    m_segments[0].store(&m_first_bucket, std::memory_order_release);
+  }
+
+  list_engine(const list_engine &) = delete;
+  list_engine &operator=(const list_engine &) = delete;
+
+  ~list_engine() {
+    // the list takes care of the head, bucket 0
+    for (size_t i = 1; i < max_segments; ++i) {
+      bucket *segment = m_segments[i].load(std::memory_order_acquire);
+      if (segment == nullptr) {
+        continue;
+      }
+      const size_t length = size_t{1} << (i - 1);
+      for (size_t j = 0; j < length; ++j) {
+        if (segment[j].state.load(std::memory_order_acquire) ==
+            bucket_ready) {
+          list_t::destroy_sentinel(segment[j].sentinel());
+        }
+      }
+      free_segment(segment, length);
+    }
+  }
+
+  template <class K>
+  auto get(worker_state &state, const K &key) -> std::optional<Value> {
+    return get_hashed(state, hash_of(key), key);
+  }
+
+  /// @brief get with the key's hash already computed (see faster::hash_of)
+  template <class K>
+  auto get_hashed(worker_state &state, uint64_t hash, const K &key)
+      -> std::optional<Value> {
+    return m_list.find(state, get_bucket(state, hash), regular_order(hash),
+                       key);
+  }
+
+  template <class Key_, class Value_>
+  auto put(worker_state &state, Key_ &&key, Value_ &&value) -> bool {
+    const uint64_t hash = hash_of(key);
+    return put_hashed(state, hash, std::forward<Key_>(key),
+                      std::forward<Value_>(value));
+  }
+
+  template <class Key_, class Value_>
+  auto put_hashed(worker_state &state, uint64_t hash, Key_ &&key,
+                  Value_ &&value) -> bool {
+    if (on_bucket(state, hash, [&](worker_state &s, node_t *start, size_t &) {
+          return m_list.put(s, start, regular_order(hash),
+                            std::forward<Key_>(key),
+                            std::forward<Value_>(value));
+        })) {
+      grow_if_loaded(m_count.fetch_add(1, std::memory_order_relaxed) + 1);
+      return true;
+    }
+    return false;
+  }
+
+  template <class K, class UpdateFn>
+  auto update(worker_state &state, const K &key, UpdateFn &&fn)
+      -> std::optional<Value> {
+    return update_hashed(state, hash_of(key), key,
+                         std::forward<UpdateFn>(fn));
+  }
+
+  template <class K, class UpdateFn>
+  auto update_hashed(worker_state &state, uint64_t hash, const K &key,
+                     UpdateFn &&fn) -> std::optional<Value> {
+    return on_bucket(
+        state, hash, [&](worker_state &s, node_t *start, size_t &attempts) {
+          return m_list.update(s, start, regular_order(hash), key,
+                               [&](const Value &old) {
+                                 ++attempts;
+                                 return fn(old);
+                               });
+        });
+  }
+
+  /// @brief fn(std::atomic<Value> &) -> old, straight on the node's value.
+  /// only for values stored inline
+  template <class Fn>
+  auto modify(worker_state &state, const Key &key, Fn &&fn)
+      -> std::optional<Value>
+    requires(!list_t::boxed)
+  {
+    const uint64_t hash = hash_of(key);
+    return m_list.modify(state, get_bucket(state, hash), regular_order(hash),
+                         key, std::forward<Fn>(fn));
+  }
+
+  template <class Fn>
+  auto upsert_rmw(worker_state &state, const Key &key, const Value &init,
+                  Fn &&fn) -> std::optional<Value> {
+    const uint64_t hash = hash_of(key);
+    std::optional<Value> old = on_bucket(
+        state, hash, [&](worker_state &s, node_t *start, size_t &attempts) {
+          return m_list.upsert_rmw(s, start, regular_order(hash), key, init,
+                                   [&](const Value &current) {
+                                     ++attempts;
+                                     return fn(current);
+                                   });
+        });
+    if (!old) {
+      grow_if_loaded(m_count.fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+    return old;
+  }
+
+  template <class K> auto erase(worker_state &state, const K &key) -> bool {
+    return erase_hashed(state, hash_of(key), key);
+  }
+
+  template <class K>
+  auto erase_hashed(worker_state &state, uint64_t hash, const K &key)
+      -> bool {
+    if (m_list.erase(state, get_bucket(state, hash), regular_order(hash),
+                     key)) {
+      m_count.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+
+  /// @brief look up a batch of keys: hash everything and find every bucket
+  /// up front, then walk all the chains interleaved (see
+  /// list::find_interleaved). returns how many were found
+  auto get_batch(worker_state &state, std::span<const Key> keys,
+                 std::span<std::optional<Value>> out) -> size_t {
+    assert(out.size() >= keys.size());
+    size_t found = 0;
+    for (size_t base = 0; base < keys.size(); base += batch_window) {
+      const size_t n = std::min(batch_window, keys.size() - base);
+      uint64_t orders[batch_window];
+      node_t *starts[batch_window];
+      resolve_buckets(state, keys.subspan(base, n), orders, starts);
+      found += m_list.find_interleaved(state, starts, orders,
+                                       keys.data() + base, out.data() + base,
+                                       n);
+    }
+    return found;
+  }
+
+  /// @brief insert/overwrite a batch: the bucket lookups and the first hop
+  /// of every chain are prefetched before the puts run one by one. returns
+  /// how many were inserted
+  auto put_batch(worker_state &state, std::span<const Key> keys,
+                 std::span<const Value> values) -> size_t {
+    assert(values.size() >= keys.size());
+    size_t inserted = 0;
+    for (size_t base = 0; base < keys.size(); base += batch_window) {
+      const size_t n = std::min(batch_window, keys.size() - base);
+      uint64_t orders[batch_window];
+      node_t *starts[batch_window];
+      resolve_buckets(state, keys.subspan(base, n), orders, starts);
+      for (size_t i = 0; i < n; ++i) {
+        __builtin_prefetch(starts[i]->next(), 1);
+      }
+      for (size_t i = 0; i < n; ++i) {
+        if (m_list.put(state, starts[i], orders[i], keys[base + i],
+                       values[base + i])) {
+          grow_if_loaded(m_count.fetch_add(1, std::memory_order_relaxed) + 1);
+          inserted++;
+        }
+      }
+    }
+    return inserted;
+  }
+
+  /// @brief visit the entries of buckets [first, last) of a table with
+  /// `buckets` buckets (a power of two no bigger than bucket_count() was at
+  /// some point). A bucket is a contiguous range of split orders however
+  /// much the table grows meanwhile, so every entry present for the whole
+  /// scan is visited exactly once. each bucket gets its own guard, so a long
+  /// scan doesn't hold back reclamation
+  template <class Fn>
+  void for_each(worker_state &state, size_t first, size_t last, size_t buckets,
+                Fn &&fn) {
+    assert(std::has_single_bit(buckets));
+    const unsigned bits = std::countr_zero(buckets);
+    // orders below a sentinel share its top `bits` bits
+    const uint64_t span_mask = bits == 0 ? ~uint64_t{0} : ~uint64_t{0} >> bits;
+    for (size_t b = first; b < last; ++b) {
+      const epoch_guard guard{state};
+      // may be an ancestor's sentinel while someone else splices ours, walk
+      // only takes the orders from ours on
+      node_t *start = get_bucket(state, b);
+      m_list.walk(state, start, sentinel_order(b),
+                  sentinel_order(b) | span_mask, fn);
+    }
+  }
+
+  /// @brief birth epoch of a retired node, for interval reclamation
+  static auto birth_of(const void *block) -> uint64_t {
+    return static_cast<const node_t *>(block)->birth();
+  }
+  /// @brief destructor of a retired node (a string key's buffer), run when
+  /// its bag is released. null when there's nothing to run
+  static constexpr void (*destroy_retired)(void *) =
+      std::is_trivially_destructible_v<node_t>
+          ? nullptr
+          : +[](void *block) { static_cast<node_t *>(block)->~node_t(); };
+
+  auto size() const -> std::size_t {
+    return m_count.load(std::memory_order_relaxed);
+  }
+  auto bucket_count() const -> std::size_t {
+    return m_size.load(std::memory_order_acquire);
+  }
+
+private:
+  static constexpr bool combines = Traits::combine_after_retries != 0;
+  // lone combines before a hot bucket goes back to plain compare_exchanges
+  static constexpr uint16_t hot_ops = 256;
+  // drains of the pending stack per combine
+  static constexpr size_t combine_rounds = 4;
+  // waiting for the combiner, pauses between yields
+  static constexpr size_t combine_spins = 64;
+
+  /// @brief an op waiting for a bucket's combiner, on its owner's stack
+  struct combine_request {
+    void (*run)(void *op, worker_state &state);
+    void *op;
+    combine_request *next;
+    // what op threw, rethrown on its owner's thread
+    std::exception_ptr error{};
+    tftf::atomic<bool> done{false};
+  };
+
+  /// @brief a bucket's combining side: a stack of pending ops, who's running
+  /// them, and how many lone ops are left before the bucket cools off
+  struct combiner {
+    tftf::atomic<combine_request *> pending{nullptr};
+    tftf::atomic<uint16_t> hot{0};
+    tftf::atomic<bool> busy{false};
+  };
+  struct no_combiner {};
+
+  template <class K> static auto hash_of(const K &key) -> uint64_t {
+    return key_hash<Key, typename Traits::hasher>{}(key);
+  }
+
+  // growing is just doubling the bucket count: the new buckets split off
+  // their parents lazily, the first time someone lands in them
+  void grow_if_loaded(size_t count) {
+    size_t size = m_size.load(std::memory_order_acquire);
+    if (count > size * Traits::max_load_factor && size < max_buckets)
+        [[unlikely]] {
+      m_size.compare_exchange_strong(size, size * 2, std::memory_order_acq_rel);
+    }
+  }
+
+  // lookups in flight per batch round
+  static constexpr size_t batch_window = 16;
+
+  /// @brief hash a window of keys and find their sentinels, prefetching the
+  /// directory slots (the sentinels themselves) so the misses overlap
+  void resolve_buckets(worker_state &state, std::span<const Key> keys,
+                       uint64_t *orders, node_t **starts) {
+    const uint64_t mask = m_size.load(std::memory_order_acquire) - 1;
+    uint64_t buckets[batch_window];
+    bucket *slots[batch_window];
+    for (size_t i = 0; i < keys.size(); ++i) {
+      const uint64_t hash = hash_of(keys[i]);
+      orders[i] = regular_order(hash);
+      buckets[i] = hash & mask;
+      slots[i] = &bucket_slot(buckets[i]);
+      __builtin_prefetch(slots[i]);
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+      starts[i] = slots[i]->ready() ? slots[i]->sentinel()
+                                    : init_bucket(state, buckets[i]);
+    }
+  }
+
+  /// @brief the sentinel to start searching `hash` from, initializing its
+  /// bucket if this is the first time we've used it since growing
+  auto get_bucket(worker_state &state, uint64_t hash) -> node_t * {
+    const uint64_t b = hash & (m_size.load(std::memory_order_acquire) - 1);
+    bucket &slot = bucket_slot(b);
+    if (slot.ready()) [[likely]] {
+      return slot.sentinel();
+    }
+    return init_bucket(state, b);
+  }
+
+  /// @brief op(state, start, attempts) on the bucket of `hash`, where op
+  /// counts how many times it computed a new value in `attempts`. runs it
+  /// right here unless the bucket is hot, when it goes through the bucket's
+  /// combiner instead. an op that needed too many attempts makes it hot
+  template <class Op>
+  auto on_bucket(worker_state &state, uint64_t hash, Op &&op) {
+    size_t attempts = 0;
+    if constexpr (!combines) {
+      return op(state, get_bucket(state, hash), attempts);
+    } else {
+      const uint64_t b = hash & (m_size.load(std::memory_order_acquire) - 1);
+      bucket &slot = bucket_slot(b);
+      node_t *start = slot.ready() ? slot.sentinel() : init_bucket(state, b);
+      if (slot.combining.hot.load(std::memory_order_relaxed) != 0)
+          [[unlikely]] {
+        return delegate(state, slot.combining, [&](worker_state &s) {
+          return op(s, start, attempts);
+        });
+      }
+      auto result = op(state, start, attempts);
+      if (attempts > Traits::combine_after_retries + 1) [[unlikely]] {
+        slot.combining.hot.store(hot_ops, std::memory_order_relaxed);
+      }
+      return result;
+    }
+  }
+
+  /// @brief flat combining: publish op on the bucket's combiner and wait
+  /// for whoever holds it to run it, or take it and run everything pending
+  /// ourselves. the combiner keeps the hot nodes in its own cache and its
+  /// compare_exchanges stop failing, where every worker fighting over them
+  /// retries (and reruns its fn) over and over. ops run with the combiner's
+  /// state, inside its epoch guard, and what they throw is rethrown here.
+  /// a thread that is combining runs its own table ops (an fn calling back
+  /// into a table) directly: waiting on a combiner, possibly itself, could
+  /// never end
+  template <class Op>
+  auto delegate(worker_state &state, combiner &c, Op &&op) {
+    if (detail::combining) [[unlikely]] {
+      return op(state);
+    }
+    using result_t = decltype(op(state));
+    // Value may have no default constructor
+    std::optional<result_t> result;
+    auto run = [&](worker_state &s) { result.emplace(op(s)); };
+    combine_request request{
+        .run =
+            [](void *op, worker_state &s) {
+              (*static_cast<decltype(run) *>(op))(s);
+            },
+        .op = &run,
+        .next = c.pending.load(std::memory_order_relaxed)};
+    while (!c.pending.compare_exchange_weak(request.next, &request,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+    }
+    state.count(table_event::delegated);
+
+    for (size_t spins = 1; !request.done.load(std::memory_order_acquire);
+         ++spins) {
+      if (!c.busy.load(std::memory_order_relaxed) &&
+          !c.busy.exchange(true, std::memory_order_acquire)) {
+        // our request is either done or still pending, so this gets it
+        detail::combining = true;
+        combine(state, c);
+        detail::combining = false;
+        c.busy.store(false, std::memory_order_release);
+      } else if (spins % combine_spins == 0) {
+        // the combiner may be off cpu
+        std::this_thread::yield();
+      } else {
+        cpu_relax();
+      }
+    }
+    if (request.error) {
+      std::rethrow_exception(request.error);
+    }
+    return std::move(*result);
+  }
+
+  /// @brief run what's pending on `c`, holding c.busy, for a few rounds so
+  /// one combiner can't be kept at it forever. the bucket stays hot while
+  /// the combiner has company and cools off after hot_ops lone ops. never
+  /// throws, an op's exception goes back to its owner
+  void combine(worker_state &state, combiner &c) noexcept {
+    size_t applied = 0;
+    for (size_t round = 0; round < combine_rounds; ++round) {
+      combine_request *batch = c.pending.exchange(nullptr,
+                                                  std::memory_order_acquire);
+      if (batch == nullptr) {
+        break;
+      }
+      // pushed newest first, run them oldest first
+      combine_request *oldest = nullptr;
+      while (batch != nullptr) {
+        combine_request *next = batch->next;
+        batch->next = oldest;
+        oldest = batch;
+        batch = next;
+      }
+      while (oldest != nullptr) {
+        combine_request *next = oldest->next;
+        try {
+          oldest->run(oldest->op, state);
+        } catch (...) {
+          oldest->error = std::current_exception();
+        }
+        // its owner may return (and its request go) right after this
+        oldest->done.store(true, std::memory_order_release);
+        oldest = next;
+        ++applied;
+      }
+    }
+    const uint16_t hot = c.hot.load(std::memory_order_relaxed);
+    if (applied > 1) {
+      c.hot.store(hot_ops, std::memory_order_relaxed);
+    } else if (hot != 0) {
+      c.hot.store(hot - 1, std::memory_order_relaxed);
+    }
+  }
+
+  /// @brief split a bucket off its parent (the bucket with the top bit
+  /// cleared), which is recursively initialized first. the sentinel lives in
+  /// the slot, so only one racer can splice it: the others start from the
+  /// parent's sentinel meanwhile, which comes before every key of ours
+  auto init_bucket(worker_state &state, uint64_t b) -> node_t * {
+    bucket &slot = bucket_slot(b);
+    uint8_t current = slot.state.load(std::memory_order_acquire);
+    if (current == bucket_ready) {
+      return slot.sentinel();
+    }
+    const uint64_t parent = b & ~std::bit_floor(b);
+    node_t *start = init_bucket(state, parent);
+    if (current == bucket_empty &&
+        slot.state.compare_exchange_strong(current, bucket_splicing,
+                                           std::memory_order_acq_rel)) {
+      node_t *sentinel = list_t::init_sentinel(slot.storage, sentinel_order(b));
+      m_list.insert_sentinel(state, start, sentinel);
+      slot.state.store(bucket_ready, std::memory_order_release);
+      return sentinel;
+    }
+    return start;
+  }
+
+  // a slot's sentinel goes empty -> splicing (one worker won the right to
+  // splice it) -> ready (it's in the list)
+  static constexpr uint8_t bucket_empty = 0;
+  static constexpr uint8_t bucket_splicing = 1;
+  static constexpr uint8_t bucket_ready = 2;
+
+  /// @brief a directory slot: the bucket's sentinel, built in place when the
+  /// bucket is first used, and its combiner
+  struct bucket {
+    alignas(node_t) std::byte storage[sizeof(node_t)];
+    tftf::atomic<uint8_t> state{bucket_empty};
+    [[no_unique_address]] std::conditional_t<combines, combiner, no_combiner>
+        combining;
+
+    auto ready() const -> bool {
+      return state.load(std::memory_order_acquire) == bucket_ready;
+    }
+    auto sentinel() -> node_t * { return reinterpret_cast<node_t *>(storage); }
+  };
+
+  // segment 0 holds bucket 0, segment i > 0 holds buckets [2^(i-1), 2^i), so
+  // the directory never has to be copied when the table grows
+  auto bucket_slot(uint64_t b) -> bucket & {
+    const size_t segment_index = std::bit_width(b);
+    const uint64_t offset =
+        segment_index == 0 ? 0 : b - (uint64_t{1} << (segment_index - 1));
+
+    bucket *segment = m_segments[segment_index].load(std::memory_order_acquire);
+    if (segment == nullptr) [[unlikely]] {
+      // segment 0 is there from the start
+      const size_t length = size_t{1} << (segment_index - 1);
+      bucket *fresh = alloc_segment(length);
+      if (m_segments[segment_index].compare_exchange_strong(
+              segment, fresh, std::memory_order_acq_rel)) {
+        segment = fresh;
+      } else {
+        free_segment(fresh, length);
+      }
+    }
+    return segment[offset];
+  }
+
+  /// @brief `length` empty slots starting on a cache line
+  static auto alloc_segment(size_t length) -> bucket * {
+    auto *segment = static_cast<bucket *>(::operator new(
+        length * sizeof(bucket), std::align_val_t{cache_line}));
+    std::uninitialized_value_construct_n(segment, length);
+    return segment;
+  }
+  static void free_segment(bucket *segment, size_t length) {
+    std::destroy_n(segment, length);
+    ::operator delete(segment, std::align_val_t{cache_line});
+  }
+
+  static constexpr size_t max_segments = 64;
+  static constexpr uint64_t max_buckets = uint64_t{1} << (max_segments - 2);
+
+  // bucket 0, the list's head. segment 0 points at it
+  bucket m_first_bucket;
+  list_t m_list;
+  std::array<tftf::atomic<bucket *>, max_segments> m_segments{};
+  tftf::atomic<size_t> m_size;
+  tftf::atomic<size_t> m_count{0};
+};
+} // namespace tftf
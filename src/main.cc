@@ -8,6 +8,7 @@ auto main() -> int {
   std::pmr::monotonic_buffer_resource buf{1000};
 
   tftf::worker_state state{buf};
+  f.register_worker(state);
 
   f.put(state, 1, 2);
 
@@ -0,0 +1,318 @@
+#pragma once
+/// built in instrumentation: every registered worker gets its own counters
+/// and latency histograms, written only by that worker (relaxed loads and
+/// stores, no locked instructions, no shared cache lines) and summed on
+/// demand by faster::collect_stats into a table_stats snapshot, which
+/// renders itself as JSON or Prometheus text.
+///
+/// build with -DTFTF_METRICS=0 to compile all of it out: the counting calls
+/// become empty and collect_stats only reports size and bucket count
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#ifndef TFTF_METRICS
+#define TFTF_METRICS 1
+#endif
+
+namespace tftf {
+
+inline constexpr bool metrics_enabled = TFTF_METRICS != 0;
+
+/// @brief a counter with a single writer and any number of readers. the
+/// writer's increment is a relaxed load and store, readers may see it a
+/// little late but never torn
+class relaxed_counter {
+public:
+  relaxed_counter() = default;
+  relaxed_counter(const relaxed_counter &other) : m_value(other.load()) {}
+  relaxed_counter &operator=(const relaxed_counter &other) {
+    m_value.store(other.load(), std::memory_order_relaxed);
+    return *this;
+  }
+
+  void add(std::uint64_t n = 1) {
+    m_value.store(m_value.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+  }
+  auto load() const -> std::uint64_t {
+    return m_value.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<std::uint64_t> m_value{0};
+};
+
+/// @brief log-linear latency histogram (16 sub-buckets per power of two, so
+/// ~6% precision, HDR histogram style), cheap enough to record every op.
+/// one writer at a time, readable while it records
+class latency_histogram {
+public:
+  void record(std::uint64_t ns, std::uint64_t times = 1) {
+    m_counts[index_of(ns)].add(times);
+  }
+
+  void merge(const latency_histogram &other) {
+    for (std::size_t i = 0; i < buckets; ++i) {
+      m_counts[i].add(other.m_counts[i].load());
+    }
+  }
+
+  auto count() const -> std::uint64_t {
+    std::uint64_t total = 0;
+    for (const relaxed_counter &c : m_counts) {
+      total += c.load();
+    }
+    return total;
+  }
+
+  /// @brief value at quantile q in [0, 1], reported as the bucket midpoint
+  auto percentile(double q) const -> std::uint64_t {
+    const std::uint64_t total = count();
+    if (total == 0) {
+      return 0;
+    }
+    const std::uint64_t rank = std::max<std::uint64_t>(
+        1, static_cast<std::uint64_t>(std::ceil(q * total)));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < buckets; ++i) {
+      seen += m_counts[i].load();
+      if (seen >= rank) {
+        return midpoint_of(i);
+      }
+    }
+    return midpoint_of(buckets - 1);
+  }
+
+  /// @brief the sum of everything recorded, from the bucket midpoints
+  auto approximate_sum() const -> double {
+    double sum = 0;
+    for (std::size_t i = 0; i < buckets; ++i) {
+      sum += 1.0 * m_counts[i].load() * midpoint_of(i);
+    }
+    return sum;
+  }
+
+private:
+  static constexpr unsigned sub_bits = 4;
+  static constexpr std::uint64_t sub_count = std::uint64_t{1} << sub_bits;
+  static constexpr std::size_t buckets = sub_count * (64 - sub_bits + 1);
+
+  static auto index_of(std::uint64_t v) -> std::size_t {
+    if (v < sub_count) {
+      return v;
+    }
+    const unsigned shift = std::bit_width(v) - sub_bits - 1;
+    return sub_count + shift * sub_count + ((v >> shift) - sub_count);
+  }
+  static auto midpoint_of(std::size_t i) -> std::uint64_t {
+    if (i < sub_count) {
+      return i;
+    }
+    const unsigned shift = (i - sub_count) / sub_count;
+    const std::uint64_t low = (sub_count + (i - sub_count) % sub_count)
+                              << shift;
+    return low + ((std::uint64_t{1} << shift) >> 1);
+  }
+
+  std::array<relaxed_counter, buckets> m_counts{};
+};
+
+/// @brief the operations faster counts and times
+enum class table_op : std::uint8_t { get, put, update, rmw, erase, count };
+inline constexpr std::string_view table_op_names[] = {"get", "put", "update",
+                                                      "rmw", "erase"};
+
+/// @brief what the engines and the reclaimer count along the way
+enum class table_event : std::uint8_t {
+  // list::search calls, and the nodes they stepped through (the mean chain
+  // length is nodes_walked / searches)
+  searches,
+  nodes_walked,
+  // list::search starting over after losing a race
+  search_restarts,
+  // marked nodes unlinked by searches on someone else's behalf
+  nodes_unlinked,
+  // a list compare_exchange lost and the op went around again
+  cas_retries,
+  // a bucket_engine optimistic read saw a writer and reread its bucket
+  read_retries,
+  // list_engine ops handed to a hot bucket's combiner
+  delegated,
+  // blocks into limbo, and out of it back to the resource. the difference
+  // is the reclamation backlog
+  retired,
+  reclaimed,
+  count
+};
+inline constexpr std::string_view table_event_names[] = {
+    "searches",      "nodes_walked", "search_restarts", "nodes_unlinked",
+    "cas_retries",   "read_retries", "delegated",       "retired",
+    "reclaimed"};
+
+inline constexpr std::size_t table_op_count =
+    static_cast<std::size_t>(table_op::count);
+inline constexpr std::size_t table_event_count =
+    static_cast<std::size_t>(table_event::count);
+
+/// @brief one worker's share. ops are all counted, only every
+/// `sample_period`th one is timed (a clock read costs about as much as a
+/// short op)
+struct worker_metrics {
+  static constexpr std::uint32_t sample_period = 16;
+
+  std::array<relaxed_counter, table_op_count> ops{};
+  std::array<relaxed_counter, table_event_count> events{};
+  std::array<latency_histogram, table_op_count> latency{};
+  // owner only
+  std::uint32_t until_sample{1};
+};
+
+/// @brief counts one op into `metrics` (null for unregistered workers) and
+/// times it if it's the worker's turn to sample
+class op_timer {
+  using clock = std::chrono::steady_clock;
+
+public:
+  op_timer(worker_metrics *metrics, table_op op) {
+    if constexpr (metrics_enabled) {
+      if (metrics == nullptr) {
+        return;
+      }
+      metrics->ops[static_cast<std::size_t>(op)].add();
+      if (--metrics->until_sample == 0) [[unlikely]] {
+        metrics->until_sample = worker_metrics::sample_period;
+        m_histogram = &metrics->latency[static_cast<std::size_t>(op)];
+        m_start = clock::now();
+      }
+    }
+  }
+  op_timer(const op_timer &) = delete;
+  op_timer &operator=(const op_timer &) = delete;
+  ~op_timer() {
+    if (m_histogram != nullptr) [[unlikely]] {
+      m_histogram->record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              clock::now() - m_start)
+                              .count());
+    }
+  }
+
+private:
+  latency_histogram *m_histogram{nullptr};
+  clock::time_point m_start{};
+};
+
+/// @brief every worker's metrics summed, from faster::collect_stats. the
+/// workers keep going while it's collected, so counters that move together
+/// may be off by a few ops from each other
+struct table_stats {
+  std::size_t size{0};
+  std::size_t buckets{0};
+  std::size_t workers{0};
+  std::array<std::uint64_t, table_op_count> ops{};
+  std::array<std::uint64_t, table_event_count> events{};
+  // sampled, see worker_metrics
+  std::array<latency_histogram, table_op_count> latency{};
+
+  void add(const worker_metrics &metrics) {
+    for (std::size_t i = 0; i < table_op_count; ++i) {
+      ops[i] += metrics.ops[i].load();
+      latency[i].merge(metrics.latency[i]);
+    }
+    for (std::size_t i = 0; i < table_event_count; ++i) {
+      events[i] += metrics.events[i].load();
+    }
+  }
+
+  auto op(table_op o) const -> std::uint64_t {
+    return ops[static_cast<std::size_t>(o)];
+  }
+  auto event(table_event e) const -> std::uint64_t {
+    return events[static_cast<std::size_t>(e)];
+  }
+  /// @brief retired blocks still waiting in limbo bags
+  auto reclaim_backlog() const -> std::uint64_t {
+    const std::uint64_t retired = event(table_event::retired);
+    const std::uint64_t reclaimed = event(table_event::reclaimed);
+    return retired > reclaimed ? retired - reclaimed : 0;
+  }
+
+  auto to_json() const -> std::string {
+    std::string out = "{\"size\":" + std::to_string(size) +
+                      ",\"buckets\":" + std::to_string(buckets) +
+                      ",\"workers\":" + std::to_string(workers) +
+                      ",\"reclaim_backlog\":" +
+                      std::to_string(reclaim_backlog()) + ",\"ops\":{";
+    for (std::size_t i = 0; i < table_op_count; ++i) {
+      out += (i ? ",\"" : "\"") + std::string{table_op_names[i]} +
+             "\":" + std::to_string(ops[i]);
+    }
+    out += "},\"events\":{";
+    for (std::size_t i = 0; i < table_event_count; ++i) {
+      out += (i ? ",\"" : "\"") + std::string{table_event_names[i]} +
+             "\":" + std::to_string(events[i]);
+    }
+    out += "},\"latency_ns\":{";
+    for (std::size_t i = 0; i < table_op_count; ++i) {
+      const latency_histogram &h = latency[i];
+      out += (i ? ",\"" : "\"") + std::string{table_op_names[i]} +
+             "\":{\"samples\":" + std::to_string(h.count()) +
+             ",\"p50\":" + std::to_string(h.percentile(0.5)) +
+             ",\"p99\":" + std::to_string(h.percentile(0.99)) +
+             ",\"p999\":" + std::to_string(h.percentile(0.999)) + "}";
+    }
+    return out + "}}";
+  }
+
+  /// @brief the text exposition format, metric names start with `prefix`.
+  /// latencies are summaries in seconds over the sampled ops
+  auto to_prometheus(std::string_view prefix = "tftf") const -> std::string {
+    const std::string p{prefix};
+    std::string out;
+    auto gauge = [&](const std::string &name, std::uint64_t value) {
+      out += "# TYPE " + p + "_" + name + " gauge\n" + p + "_" + name + " " +
+             std::to_string(value) + "\n";
+    };
+    gauge("entries", size);
+    gauge("buckets", buckets);
+    gauge("workers", workers);
+    gauge("reclaim_backlog", reclaim_backlog());
+
+    out += "# TYPE " + p + "_ops_total counter\n";
+    for (std::size_t i = 0; i < table_op_count; ++i) {
+      out += p + "_ops_total{op=\"" + std::string{table_op_names[i]} +
+             "\"} " + std::to_string(ops[i]) + "\n";
+    }
+    out += "# TYPE " + p + "_events_total counter\n";
+    for (std::size_t i = 0; i < table_event_count; ++i) {
+      out += p + "_events_total{event=\"" +
+             std::string{table_event_names[i]} + "\"} " +
+             std::to_string(events[i]) + "\n";
+    }
+    out += "# TYPE " + p + "_op_latency_seconds summary\n";
+    for (std::size_t i = 0; i < table_op_count; ++i) {
+      const latency_histogram &h = latency[i];
+      const std::string op = "op=\"" + std::string{table_op_names[i]} + "\"";
+      for (const double q : {0.5, 0.99, 0.999}) {
+        out += p + "_op_latency_seconds{" + op + ",quantile=\"" +
+               std::to_string(q) + "\"} " +
+               std::to_string(h.percentile(q) * 1e-9) + "\n";
+      }
+      out += p + "_op_latency_seconds_sum{" + op + "} " +
+             std::to_string(h.approximate_sum() * 1e-9) + "\n";
+      out += p + "_op_latency_seconds_count{" + op + "} " +
+             std::to_string(h.count()) + "\n";
+    }
+    return out;
+  }
+};
+
+} // namespace tftf
@@ -0,0 +1,187 @@
+#pragma once
+/// numa topology out of sysfs, thread pinning and memory placement, for
+/// sharded_faster (see sharded.hh). all of it is best effort: without numa
+/// (or off linux) there's one node with every cpu, and pinning or binding
+/// quietly does nothing when the kernel says no. the topology is read from a
+/// directory laid out like /sys/devices/system/node, so tests can hand it a
+/// fake one
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace tftf {
+
+/// @brief a sysfs cpulist ("0-3,8,10-11") as cpu ids. malformed pieces are
+/// skipped
+inline auto parse_cpulist(std::string_view list) -> std::vector<unsigned> {
+  std::vector<unsigned> cpus;
+  while (!list.empty()) {
+    const size_t comma = list.find(',');
+    std::string_view piece = list.substr(0, comma);
+    list = comma == std::string_view::npos ? std::string_view{}
+                                           : list.substr(comma + 1);
+    while (!piece.empty() && (piece.back() == '\n' || piece.back() == ' ')) {
+      piece.remove_suffix(1);
+    }
+    const size_t dash = piece.find('-');
+    unsigned first = 0;
+    unsigned last = 0;
+    const std::string_view lo = piece.substr(0, dash);
+    if (std::from_chars(lo.data(), lo.data() + lo.size(), first).ec !=
+        std::errc{}) {
+      continue;
+    }
+    last = first;
+    if (dash != std::string_view::npos) {
+      const std::string_view hi = piece.substr(dash + 1);
+      if (std::from_chars(hi.data(), hi.data() + hi.size(), last).ec !=
+              std::errc{} ||
+          last < first) {
+        continue;
+      }
+    }
+    for (unsigned cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+/// @brief the numa nodes that have cpus, in node id order. memory only nodes
+/// are left out, nobody can run next to them
+struct numa_topology {
+  // the kernel's id of each node (node3 is 3), for binding memory to it
+  std::vector<unsigned> ids;
+  // the cpus of each node, same order
+  std::vector<std::vector<unsigned>> cpus;
+
+  /// @brief read `root`/node<N>/cpulist for every node. falls back to
+  /// single_node when there's nothing readable there
+  static auto from_sysfs(const std::filesystem::path &root =
+                             "/sys/devices/system/node") -> numa_topology {
+    std::vector<std::pair<unsigned, std::vector<unsigned>>> nodes;
+    std::error_code error;
+    for (const auto &entry : std::filesystem::directory_iterator(root, error)) {
+      const std::string name = entry.path().filename().string();
+      unsigned id;
+      if (!name.starts_with("node") ||
+          std::from_chars(name.data() + 4, name.data() + name.size(), id).ptr !=
+              name.data() + name.size()) {
+        continue;
+      }
+      std::ifstream file{entry.path() / "cpulist"};
+      std::string list;
+      std::getline(file, list);
+      std::vector<unsigned> node_cpus = parse_cpulist(list);
+      if (!node_cpus.empty()) {
+        nodes.emplace_back(id, std::move(node_cpus));
+      }
+    }
+    if (nodes.empty()) {
+      return single_node();
+    }
+    std::sort(nodes.begin(), nodes.end());
+    numa_topology topology;
+    for (auto &[id, node_cpus] : nodes) {
+      topology.ids.push_back(id);
+      topology.cpus.push_back(std::move(node_cpus));
+    }
+    return topology;
+  }
+
+  /// @brief node 0 with every cpu we know of
+  static auto single_node() -> numa_topology {
+    std::vector<unsigned> all(
+        std::max(1u, std::thread::hardware_concurrency()));
+    for (unsigned cpu = 0; cpu < all.size(); ++cpu) {
+      all[cpu] = cpu;
+    }
+    return {.ids = {0}, .cpus = {std::move(all)}};
+  }
+
+  auto node_count() const -> size_t { return ids.size(); }
+
+  /// @brief the node (index, not kernel id) `cpu` belongs to
+  auto node_of_cpu(unsigned cpu) const -> std::optional<size_t> {
+    for (size_t node = 0; node < cpus.size(); ++node) {
+      if (std::find(cpus[node].begin(), cpus[node].end(), cpu) !=
+          cpus[node].end()) {
+        return node;
+      }
+    }
+    return std::nullopt;
+  }
+};
+
+/// @brief keep the calling thread on `cpus`. false if the kernel refused
+/// (cpus that aren't there, or not allowed to us), the thread runs where it
+/// did before then
+inline auto pin_thread(std::span<const unsigned> cpus) -> bool {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (unsigned cpu : cpus) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return CPU_COUNT(&set) != 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+/// @brief the cpu the calling thread is on right now
+inline auto current_cpu() -> std::optional<unsigned> {
+#if defined(__linux__)
+  const int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return static_cast<unsigned>(cpu);
+  }
+#endif
+  return std::nullopt;
+}
+
+/// @brief ask for the pages of [mem, mem + bytes) to live on node `id` (a
+/// kernel id), moving the ones already touched. `mem` has to be page
+/// aligned. a preference, not a binding: allocations still succeed when the
+/// node is full. false if the kernel refused (no such node, no numa)
+inline auto bind_to_node(void *mem, size_t bytes, unsigned id) -> bool {
+#if defined(__linux__) && defined(SYS_mbind)
+  constexpr size_t mask_bits = 8 * sizeof(unsigned long);
+  if (id >= 16 * mask_bits) {
+    return false;
+  }
+  unsigned long mask[16]{};
+  mask[id / mask_bits] = 1ul << (id % mask_bits);
+  return syscall(SYS_mbind, mem, bytes, MPOL_PREFERRED, mask,
+                 16 * mask_bits + 1, MPOL_MF_MOVE) == 0;
+#else
+  (void)mem;
+  (void)bytes;
+  (void)id;
+  return false;
+#endif
+}
+
+} // namespace tftf
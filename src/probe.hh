@@ -0,0 +1,92 @@
+#pragma once
+/// tag probe kernels: given a group of tag bytes (one per slot) find every slot
+/// whose tag equals the one we're looking for, before touching any key.
+///
+/// every kernel exposes
+///   width      - slots per group
+///   slot_shift - countr_zero(mask) >> slot_shift is the slot of the lowest
+///                match, and `mask &= mask - 1` moves to the next one
+///   match(tags, tag) -> mask
+///
+/// bucket_engine defaults to scalar_probe. the simd kernels are opt in: in
+/// bench (100% reads, one thread) they came out even with scalar, about 50ns
+/// p50 at 20k keys and 200ns at 2M either way, the lookup is bound by the
+/// entry and bucket misses rather than by checking tags. `probe_for<Key,
+/// Value>` is the widest kernel the target supports for small entries (the
+/// 8 slot scalar kernel for anything bigger, so buckets stay a few cache
+/// lines), for workloads that do spend their time probing tags
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace tftf {
+
+/// @brief SWAR over one 64 bit word, works everywhere
+struct scalar_probe {
+  static constexpr size_t width = 8;
+  static constexpr unsigned slot_shift = 3;
+
+  /// @brief 0x80 in every byte equal to `tag`
+  static auto match(const uint8_t *tags, uint8_t tag) -> uint64_t {
+    constexpr uint64_t lows = 0x0101010101010101ull;
+    constexpr uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+    uint64_t word;
+    std::memcpy(&word, tags, sizeof(word));
+    const uint64_t x = word ^ (lows * tag);
+    return ~(((x & low7) + low7) | x | low7);
+  }
+};
+
+#if defined(__SSE2__)
+/// @brief 16 tags with one compare and movemask
+struct sse2_probe {
+  static constexpr size_t width = 16;
+  static constexpr unsigned slot_shift = 0;
+
+  static auto match(const uint8_t *tags, uint8_t tag) -> uint32_t {
+    const __m128i group =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(tags));
+    return static_cast<uint32_t>(_mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8(static_cast<char>(tag)))));
+  }
+};
+#endif
+
+#if defined(__AVX2__)
+/// @brief 32 tags with one compare and movemask
+struct avx2_probe {
+  static constexpr size_t width = 32;
+  static constexpr unsigned slot_shift = 0;
+
+  static auto match(const uint8_t *tags, uint8_t tag) -> uint32_t {
+    const __m256i group =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tags));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(group, _mm256_set1_epi8(static_cast<char>(tag)))));
+  }
+};
+#endif
+
+#if defined(__AVX2__)
+using widest_probe = avx2_probe;
+#elif defined(__SSE2__)
+using widest_probe = sse2_probe;
+#else
+using widest_probe = scalar_probe;
+#endif
+
+/// @brief simd groups for keys up to a word and entries up to 16 bytes,
+/// scalar for everything else. pass it as bucket_engine's Probe to opt in
+template <class Key, class Value>
+using probe_for =
+    std::conditional_t<(sizeof(Key) <= 8 && sizeof(Key) + sizeof(Value) <= 16),
+                       widest_probe, scalar_probe>;
+
+} // namespace tftf
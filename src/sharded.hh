@@ -0,0 +1,252 @@
+#pragma once
+/// a faster per numa node. keys are split between the shards by hash, every
+/// shard is built (and its buckets first touched) by a thread pinned to its
+/// node, and the nodes of a shard come out of slabs placed on that node
+/// whichever worker allocates them. workers come from make_worker, which
+/// pins the calling thread to the worker's home node. ops on other nodes'
+/// keys still work, they just pay for the hop: callers that can choose
+/// which worker handles a key (request routers, partitioned loaders) use
+/// is_local to keep every worker on its own node's keys
+
+#include "allocator.hh"
+#include "faster.hh"
+#include "numa.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace tftf {
+
+struct shard_options {
+  // 0 for one shard per node, otherwise shard i lives on node i % nodes
+  size_t shards{0};
+  // keep every worker on its home node's cpus
+  bool pin_workers{true};
+  // place each shard's slabs on its node (slab_options::numa_node)
+  bool bind_memory{true};
+  // for every worker's per shard node_resource, numa_node is filled in
+  slab_options slabs{};
+};
+
+template <class Key, class Value, class Traits = default_faster_traits>
+class sharded_faster {
+public:
+  using table_t = faster<Key, Value, Traits>;
+  using hasher_t = typename table_t::hasher_t;
+  static constexpr size_t alloc_size = table_t::alloc_size;
+
+  /// @brief a registered worker_state (and node_resource) for every shard,
+  /// plus the home shard it was pinned next to. one thread's, like a
+  /// worker_state. the table owns it: its slabs hold live entries, so they
+  /// stay until the table goes
+  class worker {
+  public:
+    worker(const worker &) = delete;
+    worker &operator=(const worker &) = delete;
+
+    auto home_shard() const -> size_t { return m_home; }
+    /// @brief our registered state in `shard`, to use that shard directly
+    auto state(size_t shard) -> worker_state & {
+      return m_shards[shard]->state;
+    }
+
+  private:
+    friend class sharded_faster;
+
+    worker(sharded_faster &table, size_t home) : m_home(home) {
+      m_shards.reserve(table.shard_count());
+      for (size_t shard = 0; shard < table.shard_count(); ++shard) {
+        slab_options options = table.m_options.slabs;
+        if (table.m_options.bind_memory) {
+          options.numa_node = table.m_topology.ids[table.node_of_shard(shard)];
+        }
+        m_shards.push_back(std::make_unique<local>(options));
+        table.m_shards[shard]->register_worker(m_shards.back()->state);
+      }
+    }
+
+    struct local {
+      explicit local(const slab_options &options)
+          : resource(*std::pmr::new_delete_resource(), options) {}
+      // engines that allocate nothing (alloc_size 0) still get a valid one
+      node_resource<std::max(alloc_size, sizeof(void *))> resource;
+      worker_state state{resource};
+    };
+
+    size_t m_home;
+    std::vector<std::unique_ptr<local>> m_shards;
+  };
+
+  /// @brief `table_size` buckets per shard, anything after the options goes
+  /// to every shard's engine like faster's constructor. if a shard fails to
+  /// build, the first shard's error is rethrown once every builder is done
+  template <class... EngineArgs>
+  explicit sharded_faster(numa_topology topology = numa_topology::from_sysfs(),
+                          size_t table_size = 128, shard_options options = {},
+                          EngineArgs &&...engine_args)
+      : m_topology(std::move(topology)), m_options(options),
+        m_shards(m_options.shards == 0 ? m_topology.node_count()
+                                       : m_options.shards) {
+    assert(m_topology.node_count() > 0 && !m_shards.empty());
+    // each shard is built on its own node, so the table, its bucket
+    // directory and sentinels are first touched there
+    std::vector<std::exception_ptr> errors(m_shards.size());
+    std::vector<std::thread> builders;
+    auto join = [&builders] {
+      for (std::thread &builder : builders) {
+        builder.join();
+      }
+    };
+    try {
+      for (size_t shard = 0; shard < m_shards.size(); ++shard) {
+        builders.emplace_back([&, shard] {
+          try {
+            pin_thread(m_topology.cpus[node_of_shard(shard)]);
+            m_shards[shard] =
+                std::make_unique<table_t>(table_size, engine_args...);
+            // the table is still private to us, an unregistered state will do
+            worker_state builder{*std::pmr::get_default_resource()};
+            m_shards[shard]->for_each(builder,
+                                      [](const Key &, const Value &) {});
+          } catch (...) {
+            // escaping the thread would terminate, the constructor throws it
+            errors[shard] = std::current_exception();
+          }
+        });
+      }
+    } catch (...) {
+      // couldn't start a builder, the ones already running still need joining
+      join();
+      throw;
+    }
+    join();
+    for (const std::exception_ptr &error : errors) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+  }
+
+  sharded_faster(const sharded_faster &) = delete;
+  sharded_faster &operator=(const sharded_faster &) = delete;
+
+  /// @brief a worker for the calling thread, which gets pinned to the
+  /// worker's home node (round robin over the shards, so workers spread
+  /// over the nodes). lives as long as the table
+  auto make_worker() -> worker & {
+    const size_t home =
+        m_registered.fetch_add(1, std::memory_order_relaxed) % m_shards.size();
+    if (m_options.pin_workers) {
+      pin_thread(m_topology.cpus[node_of_shard(home)]);
+    }
+    auto fresh = std::unique_ptr<worker>(new worker(*this, home));
+    worker &w = *fresh;
+    const std::lock_guard lock{m_workers_mutex};
+    m_workers.push_back(std::move(fresh));
+    return w;
+  }
+
+  /// @brief the shard `hash` (hash_of(key)) belongs to. its high bits after
+  /// a multiply, the low ones already pick the bucket inside the shard
+  auto shard_of_hash(uint64_t hash) const -> size_t {
+    const uint64_t mixed = (hash * 0x9e3779b97f4a7c15ull) >> 32;
+    return static_cast<size_t>((mixed * m_shards.size()) >> 32);
+  }
+  template <lookup_key<Key, hasher_t> K>
+  auto shard_of(const K &key) const -> size_t {
+    return shard_of_hash(table_t::hash_of(key));
+  }
+  /// @brief whether `key` lives on w's home node
+  template <lookup_key<Key, hasher_t> K>
+  auto is_local(const worker &w, const K &key) const -> bool {
+    return node_of_shard(shard_of(key)) == node_of_shard(w.home_shard());
+  }
+
+  template <lookup_key<Key, hasher_t> K>
+  auto get(worker &w, const K &key) -> std::optional<Value> {
+    const uint64_t hash = table_t::hash_of(key);
+    const size_t shard = shard_of_hash(hash);
+    return m_shards[shard]->get_hashed(w.state(shard), hash, key);
+  }
+
+  template <class Key_, class Value_>
+    requires std::is_convertible_v<Key_, Key> &&
+             std::is_convertible_v<Value_, Value>
+  auto put(worker &w, Key_ &&key, Value_ &&value) -> bool {
+    const uint64_t hash = key_hash<Key, hasher_t>{}(key);
+    const size_t shard = shard_of_hash(hash);
+    return m_shards[shard]->put_hashed(w.state(shard), hash,
+                                       std::forward<Key_>(key),
+                                       std::forward<Value_>(value));
+  }
+
+  template <lookup_key<Key, hasher_t> K, class UpdateFn>
+  auto update(worker &w, const K &key, UpdateFn &&fn) -> std::optional<Value> {
+    const uint64_t hash = table_t::hash_of(key);
+    const size_t shard = shard_of_hash(hash);
+    return m_shards[shard]->update_hashed(w.state(shard), hash, key,
+                                          std::forward<UpdateFn>(fn));
+  }
+
+  template <class UpdateFn>
+  auto upsert_rmw(worker &w, const Key &key, const Value &init, UpdateFn &&fn)
+      -> std::optional<Value> {
+    const size_t shard = shard_of(key);
+    return m_shards[shard]->upsert_rmw(w.state(shard), key, init,
+                                       std::forward<UpdateFn>(fn));
+  }
+
+  template <lookup_key<Key, hasher_t> K>
+  auto erase(worker &w, const K &key) -> bool {
+    const uint64_t hash = table_t::hash_of(key);
+    const size_t shard = shard_of_hash(hash);
+    return m_shards[shard]->erase_hashed(w.state(shard), hash, key);
+  }
+
+  /// @brief faster::for_each over every shard in turn
+  template <class Fn> void for_each(worker &w, Fn &&fn) {
+    for (size_t shard = 0; shard < m_shards.size(); ++shard) {
+      m_shards[shard]->for_each(w.state(shard), fn);
+    }
+  }
+
+  auto shard_count() const -> size_t { return m_shards.size(); }
+  auto shard(size_t i) -> table_t & { return *m_shards[i]; }
+  /// @brief the node (an index into topology()) shard `i` lives on
+  auto node_of_shard(size_t i) const -> size_t {
+    return i % m_topology.node_count();
+  }
+  auto topology() const -> const numa_topology & { return m_topology; }
+
+  /// @brief number of entries, only exact when the table is quiescent
+  auto size() const -> size_t {
+    size_t total = 0;
+    for (const std::unique_ptr<table_t> &shard : m_shards) {
+      total += shard->size();
+    }
+    return total;
+  }
+
+private:
+  numa_topology m_topology;
+  shard_options m_options;
+  // before the shards, so the shards go first and the workers' slabs after
+  std::vector<std::unique_ptr<worker>> m_workers;
+  std::mutex m_workers_mutex;
+  tftf::atomic<size_t> m_registered{0};
+  std::vector<std::unique_ptr<table_t>> m_shards;
+};
+
+} // namespace tftf
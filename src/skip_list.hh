@@ -0,0 +1,462 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <optional>
+#include <tuple>
+#include <utility>
+
+#include "list.hh"
+#include "state.hh"
+
+namespace tftf {
+
+/// @brief a skip list entry: a tower of `height` harris links (see
+/// marked_link), one per level it's linked into. blocks are fixed size, so
+/// every node has room for the tallest tower
+template <class Key, class Value, bool Stamped = false> struct skip_node {
+public:
+  // each level is a quarter as likely as the one below, so 16 of them keep
+  // searches logarithmic up to ~4G entries
+  static constexpr unsigned max_height = 16;
+
+  template <class _Key, class _Value>
+  skip_node(_Key &&_key, _Value &&_value, unsigned height)
+      : m_link(nullptr), m_key(std::forward<_Key>(_key)),
+        m_value(std::forward<_Value>(_value)),
+        m_height(static_cast<std::uint8_t>(height)) {}
+  const Key &key() const { return m_key; }
+  std::uint64_t birth() const {
+    if constexpr (Stamped) {
+      return m_birth;
+    } else {
+      return 0;
+    }
+  }
+  std::atomic<Value> &value() { return m_value; }
+  unsigned height() const { return m_height; }
+  bool is_marked() const { return m_next[0].is_marked(); }
+
+private:
+  template <class K, class V, class C, class R> friend class skip_list;
+  // retired nodes are chained through this word, like list nodes
+  void *m_link;
+  [[no_unique_address]] std::conditional_t<Stamped, std::uint64_t, no_birth>
+      m_birth{};
+  Key m_key;
+  std::atomic<Value> m_value;
+  std::uint8_t m_height;
+  // the inserter and the eraser each let go of the node once, whoever is
+  // second unlinks what's left of its tower and retires it
+  std::atomic<std::uint8_t> m_owners{2};
+  marked_link<skip_node> m_next[max_height];
+};
+
+/// @brief a lock-free skip list (Fraser; Herlihy & Shavit's LockFreeSkipList)
+/// ordered by `Compare`, for when keys have to come back out in order. every
+/// level is a harris list of marked_links: a node is in the set while its
+/// bottom link is unmarked, erasing marks its tower top down and searches
+/// unlink marked nodes level by level as they pass them. readers (find,
+/// scan, lower_bound) don't unlink anything: they walk through marked nodes
+/// under epoch_reclaim and start over under interval_reclaim.
+///
+/// nodes come out of the workers' resources and are retired into their
+/// limbo bags under `Reclaim`, like list's. a node is only retired once its
+/// inserter has stopped building its tower and its eraser has marked it,
+/// by whichever of them gets there second, after a search that unlinks it
+/// from every level. values live in the node as a std::atomic<Value>, so
+/// they have to be small and trivially copyable
+template <class Key, class Value, class Compare = std::less<>,
+          class Reclaim = epoch_reclaim>
+class skip_list {
+  static_assert(detail::lock_free_inline<Value>(),
+                "skip_list keeps values inline, std::atomic<Value> has to be "
+                "lock free");
+
+public:
+  using node_t = skip_node<Key, Value, Reclaim::interval_based>;
+  static constexpr unsigned max_height = node_t::max_height;
+  static constexpr size_t alloc_size = sizeof(node_t);
+  static constexpr size_t alloc_align = alignof(node_t);
+
+  skip_list() : m_head(make_head()) {}
+
+  skip_list(const skip_list &) = delete;
+  skip_list &operator=(const skip_list &) = delete;
+
+  ~skip_list() {
+    // TODO: like list, the real nodes belong to the workers' resources
+    for (marked_link<node_t> &link : m_head->m_next) {
+      link.~marked_link();
+    }
+    std::free(m_head);
+  }
+
+  /// @brief `key` is a Key or anything Compare takes against one
+  template <class K>
+  auto find(worker_state &state, const K &key) const -> std::optional<Value> {
+    node_t *n = seek(state, key, false);
+    if (matches(n, key)) {
+      return n->m_value.load(std::memory_order_acquire);
+    }
+    return std::nullopt;
+  }
+
+  /// @brief the first entry whose key isn't less than `key`
+  template <class K>
+  auto lower_bound(worker_state &state, const K &key) const
+      -> std::optional<std::pair<Key, Value>> {
+    node_t *n = seek(state, key, false);
+    if (n == nullptr) {
+      return std::nullopt;
+    }
+    return std::pair<Key, Value>{n->key(),
+                                 n->m_value.load(std::memory_order_acquire)};
+  }
+
+  /// @brief insert, or overwrite the value if the key is there. returns if
+  /// the key was inserted
+  template <class Key_, class Value_>
+  auto put(worker_state &state, Key_ &&key, Value_ &&value) -> bool {
+    node_t *fresh =
+        make_node(state, std::forward<Key_>(key), std::forward<Value_>(value));
+    node_t *preds[max_height], *succs[max_height];
+    while (true) {
+      node_t *found = search(state, fresh->key(), false, preds, succs);
+      if (matches(found, fresh->key())) {
+        found->m_value.store(fresh->m_value.load(std::memory_order_relaxed),
+                             std::memory_order_release);
+        free_node(state, fresh);
+        return false;
+      }
+      if (link(state, fresh, preds, succs)) {
+        return true;
+      }
+    }
+  }
+
+  /// @brief replace the value with f(old), retried with compare_exchange
+  /// like list::update, so f may run more than once
+  template <class K, class Fn>
+  auto update(worker_state &state, const K &key, Fn &&f)
+      -> std::optional<Value> {
+    node_t *n = seek(state, key, false);
+    if (!matches(n, key)) {
+      return std::nullopt;
+    }
+    return update_value(state, n, f);
+  }
+
+  /// @brief fn(std::atomic<Value> &) -> old value on the key's value
+  template <class Fn>
+  auto modify(worker_state &state, const Key &key, Fn &&fn)
+      -> std::optional<Value> {
+    node_t *n = seek(state, key, false);
+    if (!matches(n, key)) {
+      return std::nullopt;
+    }
+    return fn(n->value());
+  }
+
+  /// @brief update with f if the key is there, otherwise insert `init`.
+  /// returns the old value, nullopt if we inserted
+  template <class Fn>
+  auto upsert_rmw(worker_state &state, const Key &key, const Value &init,
+                  Fn &&f) -> std::optional<Value> {
+    node_t *fresh = nullptr;
+    node_t *preds[max_height], *succs[max_height];
+    while (true) {
+      node_t *found = search(state, key, false, preds, succs);
+      if (matches(found, key)) {
+        if (fresh != nullptr) {
+          free_node(state, fresh);
+        }
+        return update_value(state, found, f);
+      }
+      if (fresh == nullptr) {
+        fresh = make_node(state, key, init);
+      }
+      if (link(state, fresh, preds, succs)) {
+        return std::nullopt;
+      }
+    }
+  }
+
+  template <class K> auto erase(worker_state &state, const K &key) -> bool {
+    node_t *preds[max_height], *succs[max_height];
+    node_t *victim = search(state, key, false, preds, succs);
+    if (!matches(victim, key)) {
+      return false;
+    }
+    // top down, so a node linked at some level is always still in the set
+    // (unmarked at the bottom) or being unlinked from every level
+    for (unsigned level = victim->m_height; level-- > 1;) {
+      while (true) {
+        const auto [next, marked] =
+            victim->m_next[level].get_next_and_is_marked();
+        if (marked || victim->m_next[level].cas_mark(next)) {
+          break;
+        }
+      }
+    }
+    // whoever marks the bottom level erased it
+    while (true) {
+      const auto [next, marked] = victim->m_next[0].get_next_and_is_marked();
+      if (marked) {
+        return false;
+      }
+      if (victim->m_next[0].cas_mark(next)) {
+        break;
+      }
+      state.count(table_event::cas_retries);
+    }
+    release(state, victim);
+    return true;
+  }
+
+  /// @brief visit live entries in key order as fn(key, value): from the
+  /// first key not less than `*from` (greater than, if `after`; the first
+  /// entry if `from` is null) up to but not including `*to` (the end if
+  /// null), at most `limit` of them. returns the last key visited if it
+  /// stopped at the limit, to resume after. the caller holds the epoch guard
+  template <class Fn>
+  auto scan(worker_state &state, const Key *from, bool after, const Key *to,
+            size_t limit, Fn &&fn) const -> std::optional<Key> {
+    node_t *n = from == nullptr ? next_of(state, m_head, 0).first
+                                : seek(state, *from, after);
+    size_t visited = 0;
+    while (n != nullptr && (to == nullptr || Compare{}(n->key(), *to))) {
+      const auto [next, marked] = next_of(state, n, 0);
+      if (!marked) {
+        fn(n->key(), n->m_value.load(std::memory_order_acquire));
+        if (++visited == limit) {
+          return n->key();
+        }
+      } else if constexpr (Reclaim::interval_based) {
+        // see must_restart, find our way back in from the top instead
+        n = seek(state, n->key(), true);
+        continue;
+      }
+      n = next;
+    }
+    return std::nullopt;
+  }
+
+private:
+  /// @brief whether `n` sorts before `key`, or before or with it if `after`
+  template <class K>
+  static auto before(const node_t *n, const K &key, bool after) -> bool {
+    return after ? !Compare{}(key, n->key()) : Compare{}(n->key(), key);
+  }
+  /// @brief n is the first node not before `key`, so it only has to not be
+  /// after it either
+  template <class K> static auto matches(const node_t *n, const K &key) -> bool {
+    return n != nullptr && !Compare{}(key, n->key());
+  }
+
+  static auto next_of(worker_state &state, const node_t *n, unsigned level)
+      -> std::pair<node_t *, bool> {
+    const uintptr_t next = Reclaim::protect(state, n->m_next[level]);
+    return {reinterpret_cast<node_t *>(next & ~uintptr_t{1}), next & 1};
+  }
+
+  /// @brief a read only walk that ran into an erased node. epoch readers
+  /// just step through it: everything its frozen links lead to was retired
+  /// after we entered. under interval reclamation that isn't enough, a node
+  /// retired before we got to it may already be gone however recently it
+  /// was born (the same rule as for hazard pointers), so those start over
+  static auto must_restart(worker_state &state, bool marked) -> bool {
+    if constexpr (Reclaim::interval_based) {
+      if (marked) {
+        state.count(table_event::search_restarts);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// @brief the first node not before `key` (see `before`) that was in the
+  /// set when we passed it, null past the end. read only: marked nodes are
+  /// walked through (see must_restart), not unlinked
+  template <class K>
+  auto seek(worker_state &state, const K &key, bool after) const -> node_t * {
+    std::uint64_t walked = 0;
+    node_t *curr = nullptr;
+  again:
+    node_t *pred = m_head;
+    for (unsigned level = max_height; level-- > 0;) {
+      bool pred_marked;
+      std::tie(curr, pred_marked) = next_of(state, pred, level);
+      if (must_restart(state, pred_marked)) {
+        goto again;
+      }
+      while (curr != nullptr) {
+        const auto [succ, marked] = next_of(state, curr, level);
+        walked++;
+        if (!marked) {
+          if (!before(curr, key, after)) {
+            break;
+          }
+          pred = curr;
+        } else if (must_restart(state, true)) {
+          goto again;
+        }
+        curr = succ;
+      }
+    }
+    state.count(table_event::searches);
+    state.count(table_event::nodes_walked, walked);
+    return curr;
+  }
+
+  /// @brief fill preds/succs with where `key` goes on every level, unlinking
+  /// the marked nodes in between. returns succs[0]
+  template <class K>
+  auto search(worker_state &state, const K &key, bool after, node_t **preds,
+              node_t **succs) -> node_t * {
+    std::uint64_t walked = 0;
+  again:
+    node_t *pred = m_head;
+    for (unsigned level = max_height; level-- > 0;) {
+      // pred was in the set one level up, so it's linked on this one too
+      // unless it has been erased since. its links are frozen then, start
+      // over rather than follow them
+      const auto [first, pred_marked] = next_of(state, pred, level);
+      if (pred_marked) {
+        state.count(table_event::search_restarts);
+        goto again;
+      }
+      node_t *curr = first;
+      while (curr != nullptr) {
+        const auto [succ, marked] = next_of(state, curr, level);
+        walked++;
+        if (marked) {
+          // only fails if pred changed or got marked itself
+          if (!pred->m_next[level].cas_next(curr, succ)) {
+            state.count(table_event::search_restarts);
+            goto again;
+          }
+          state.count(table_event::nodes_unlinked);
+          curr = succ;
+          continue;
+        }
+        if (!before(curr, key, after)) {
+          break;
+        }
+        pred = curr;
+        curr = succ;
+      }
+      preds[level] = pred;
+      succs[level] = curr;
+    }
+    state.count(table_event::searches);
+    state.count(table_event::nodes_walked, walked);
+    return succs[0];
+  }
+
+  /// @brief splice `fresh` in between preds[0] and succs[0] and then build
+  /// its tower. false if the bottom level moved first, search again then.
+  /// the tower stops early if the node is erased while it's being built
+  auto link(worker_state &state, node_t *fresh, node_t **preds,
+            node_t **succs) -> bool {
+    const unsigned height = fresh->m_height;
+    for (unsigned level = 0; level < height; ++level) {
+      fresh->m_next[level].set_next(succs[level]);
+    }
+    if (!preds[0]->m_next[0].cas_next(succs[0], fresh)) {
+      state.count(table_event::cas_retries);
+      return false;
+    }
+    for (unsigned level = 1; level < height; ++level) {
+      while (true) {
+        const auto [next, marked] =
+            fresh->m_next[level].get_next_and_is_marked();
+        if (marked) {
+          goto built;
+        }
+        if (next != succs[level] &&
+            !fresh->m_next[level].cas_next(next, succs[level])) {
+          continue;
+        }
+        if (preds[level]->m_next[level].cas_next(succs[level], fresh)) {
+          break;
+        }
+        state.count(table_event::cas_retries);
+        if (search(state, fresh->key(), false, preds, succs) != fresh) {
+          goto built;
+        }
+      }
+    }
+  built:
+    release(state, fresh);
+    return true;
+  }
+
+  /// @brief let go of `n` as its inserter or eraser. the second one to do so
+  /// unlinks it from whatever levels still have it and retires it. the
+  /// search walks past every node with n's key, so it also catches levels of
+  /// n's that ended up behind a reinserted node with the same key
+  void release(worker_state &state, node_t *n) {
+    if (n->m_owners.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    node_t *preds[max_height], *succs[max_height];
+    search(state, n->key(), true, preds, succs);
+    const uint64_t epoch =
+        state.epoch_counter->fetch_add(1, std::memory_order_acq_rel);
+    state.retire(n, epoch, n->birth());
+  }
+
+  template <class Fn>
+  static auto update_value(worker_state &state, node_t *n, Fn &f) -> Value {
+    Value old = n->value().load(std::memory_order_acquire);
+    while (!n->value().compare_exchange_weak(old, f(old),
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_acquire)) {
+      state.count(table_event::cas_retries);
+    }
+    return old;
+  }
+
+  /// @brief 1 + the number of coin flips (at 1/4) that came up heads
+  static auto random_height(worker_state &state) -> unsigned {
+    return std::min<unsigned>(max_height,
+                              1 + std::countr_zero(state.random()) / 2);
+  }
+
+  template <class Key_, class Value_>
+  auto make_node(worker_state &state, Key_ &&key, Value_ &&value)
+      -> node_t * {
+    void *mem = state.resource.allocate(alloc_size, alloc_align);
+    node_t *n = new (mem) node_t(std::forward<Key_>(key),
+                                 std::forward<Value_>(value),
+                                 random_height(state));
+    if constexpr (Reclaim::interval_based) {
+      n->m_birth = state.epoch_counter->load(std::memory_order_acquire);
+    }
+    return n;
+  }
+  /// @brief for a node nobody else ever saw
+  static void free_node(worker_state &state, node_t *n) {
+    n->~node_t();
+    state.resource.deallocate(n, alloc_size, alloc_align);
+  }
+
+  // the head is a full height tower without a key or value, never compared
+  static auto make_head() -> node_t * {
+    node_t *n = static_cast<node_t *>(std::malloc(sizeof(node_t)));
+    for (unsigned level = 0; level < max_height; ++level) {
+      new (&n->m_next[level]) marked_link<node_t>();
+    }
+    return n;
+  }
+
+  node_t *m_head;
+};
+
+template class skip_list<int, int, std::less<int>>;
+} // namespace tftf
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "common.hh"
+#include "skip_list.hh"
+#include "state.hh"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+namespace tftf {
+
+/// @brief ordered storage engine: one skip_list over the whole key space,
+/// for tables that need range scans and lower_bound (see faster::range).
+/// point operations are O(log n) rather than a hash table's O(1), and the
+/// hash faster computes is ignored (the *_hashed calls take it to fit the
+/// engine interface). grows online like list_engine, there are no buckets:
+/// bucket_count is always 1 and for_each is a single walk in key order
+template <class Key, class Value, class Traits> class skip_list_engine {
+public:
+  using list_t = skip_list<Key, Value, std::less<>, typename Traits::reclaim>;
+  using node_t = typename list_t::node_t;
+  static constexpr size_t alloc_size = list_t::alloc_size;
+  static constexpr size_t alloc_align = list_t::alloc_align;
+
+  skip_list_engine(std::size_t /* table_size */) {}
+
+  skip_list_engine(const skip_list_engine &) = delete;
+  skip_list_engine &operator=(const skip_list_engine &) = delete;
+
+  template <class K>
+  auto get(worker_state &state, const K &key) -> std::optional<Value> {
+    return m_list.find(state, key);
+  }
+  template <class K>
+  auto get_hashed(worker_state &state, uint64_t /* hash */, const K &key)
+      -> std::optional<Value> {
+    return m_list.find(state, key);
+  }
+
+  template <class Key_, class Value_>
+  auto put(worker_state &state, Key_ &&key, Value_ &&value) -> bool {
+    if (m_list.put(state, std::forward<Key_>(key),
+                   std::forward<Value_>(value))) {
+      m_count.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+  template <class Key_, class Value_>
+  auto put_hashed(worker_state &state, uint64_t /* hash */, Key_ &&key,
+                  Value_ &&value) -> bool {
+    return put(state, std::forward<Key_>(key), std::forward<Value_>(value));
+  }
+
+  template <class K, class UpdateFn>
+  auto update(worker_state &state, const K &key, UpdateFn &&fn)
+      -> std::optional<Value> {
+    return m_list.update(state, key, std::forward<UpdateFn>(fn));
+  }
+  template <class K, class UpdateFn>
+  auto update_hashed(worker_state &state, uint64_t /* hash */, const K &key,
+                     UpdateFn &&fn) -> std::optional<Value> {
+    return m_list.update(state, key, std::forward<UpdateFn>(fn));
+  }
+
+  /// @brief fn(std::atomic<Value> &) -> old, straight on the node's value
+  template <class Fn>
+  auto modify(worker_state &state, const Key &key, Fn &&fn)
+      -> std::optional<Value> {
+    return m_list.modify(state, key, std::forward<Fn>(fn));
+  }
+
+  template <class Fn>
+  auto upsert_rmw(worker_state &state, const Key &key, const Value &init,
+                  Fn &&fn) -> std::optional<Value> {
+    std::optional<Value> old =
+        m_list.upsert_rmw(state, key, init, std::forward<Fn>(fn));
+    if (!old) {
+      m_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    return old;
+  }
+
+  template <class K> auto erase(worker_state &state, const K &key) -> bool {
+    if (m_list.erase(state, key)) {
+      m_count.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+  template <class K>
+  auto erase_hashed(worker_state &state, uint64_t /* hash */, const K &key)
+      -> bool {
+    return erase(state, key);
+  }
+
+  auto get_batch(worker_state &state, std::span<const Key> keys,
+                 std::span<std::optional<Value>> out) -> size_t {
+    assert(out.size() >= keys.size());
+    size_t found = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      out[i] = m_list.find(state, keys[i]);
+      found += out[i].has_value();
+    }
+    return found;
+  }
+
+  auto put_batch(worker_state &state, std::span<const Key> keys,
+                 std::span<const Value> values) -> size_t {
+    assert(values.size() >= keys.size());
+    size_t inserted = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      inserted += put(state, keys[i], values[i]);
+    }
+    return inserted;
+  }
+
+  /// @brief the first entry with a key not less than `key`. the caller
+  /// holds the epoch guard
+  template <class K>
+  auto lower_bound(worker_state &state, const K &key)
+      -> std::optional<std::pair<Key, Value>> {
+    return m_list.lower_bound(state, key);
+  }
+
+  /// @brief visit the entries with lo <= key < hi in key order as fn(key,
+  /// value). takes its own guards, a fresh one every `scan_chunk` entries
+  /// (resuming after the last key seen), so a long scan doesn't hold back
+  /// reclamation. weakly consistent like for_each
+  template <class Fn>
+  void range(worker_state &state, const Key &lo, const Key &hi, Fn &&fn) {
+    scan(state, &lo, &hi, fn);
+  }
+
+  /// @brief the whole list in key order, for bucket 0 of 1
+  template <class Fn>
+  void for_each(worker_state &state, size_t first, size_t last,
+                size_t /* buckets */, Fn &&fn) {
+    if (first == 0 && last > 0) {
+      scan(state, nullptr, nullptr, fn);
+    }
+  }
+
+  /// @brief birth epoch of a retired node, for interval reclamation
+  static auto birth_of(const void *block) -> uint64_t {
+    return static_cast<const node_t *>(block)->birth();
+  }
+  /// @brief destructor of a retired node (a string key's buffer), run when
+  /// its bag is released. null when there's nothing to run
+  static constexpr void (*destroy_retired)(void *) =
+      std::is_trivially_destructible_v<node_t>
+          ? nullptr
+          : +[](void *block) { static_cast<node_t *>(block)->~node_t(); };
+
+  auto size() const -> std::size_t {
+    return m_count.load(std::memory_order_relaxed);
+  }
+  auto bucket_count() const -> std::size_t { return 1; }
+
+private:
+  // entries visited per guard
+  static constexpr size_t scan_chunk = 256;
+
+  template <class Fn>
+  void scan(worker_state &state, const Key *lo, const Key *hi, Fn &fn) {
+    std::optional<Key> resume;
+    {
+      const epoch_guard guard{state};
+      resume = m_list.scan(state, lo, false, hi, scan_chunk, fn);
+    }
+    while (resume) {
+      const Key after = std::move(*resume);
+      const epoch_guard guard{state};
+      resume = m_list.scan(state, &after, true, hi, scan_chunk, fn);
+    }
+  }
+
+  list_t m_list;
+  tftf::atomic<size_t> m_count{0};
+};
+} // namespace tftf
@@ -1,32 +1,366 @@
 #pragma once
 
+#include "allocator.hh"
 #include "common.hh"
+#include "metrics.hh"
 
-#include <list>
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <memory_resource>
+#include <utility>
+#include <vector>
 
 namespace tftf {
 
-struct alloc_block {
-  void *ptr;
-  std::uint64_t epoch;
+/// @brief the front of an out of line value (see list.hh's value_box). once
+/// retired it's chained through `link` like a node, and `destroy` runs the
+/// value's destructor when the box is finally released
+struct box_header {
+  void *link;
+  std::uint64_t birth;
+  void (*destroy)(void *);
 };
+
+/// @brief retired blocks waiting for their epoch to become safe. intrusive:
+/// the blocks are chained through their own first word, which is the one word
+/// of a node that readers never look at (see `node::m_link`). boxes are
+/// chained separately since they need destroying first
+struct retire_bag {
+  void *head{nullptr};
+  void *tail{nullptr};
+  std::size_t count{0};
+  void *boxes{nullptr};
+  void *boxes_tail{nullptr};
+  std::size_t box_count{0};
+  // the bag is safe to release once every worker has moved past this
+  std::uint64_t max_epoch{0};
+  // oldest birth epoch in the bag, interval reclamation only
+  std::uint64_t min_birth{UINT64_MAX};
+
+  auto empty() const -> bool { return head == nullptr && boxes == nullptr; }
+
+  void push(void *ptr, std::uint64_t epoch, std::uint64_t birth) {
+    set_link(ptr, head);
+    if (tail == nullptr) {
+      tail = ptr;
+    }
+    head = ptr;
+    count++;
+    max_epoch = std::max(max_epoch, epoch + 1);
+    min_birth = std::min(min_birth, birth);
+  }
+
+  void push_box(box_header *box, std::uint64_t epoch) {
+    set_link(box, boxes);
+    if (boxes_tail == nullptr) {
+      boxes_tail = box;
+    }
+    boxes = box;
+    box_count++;
+    max_epoch = std::max(max_epoch, epoch + 1);
+    min_birth = std::min(min_birth, box->birth);
+  }
+};
+
 /// @brief contains the thread local state
 /// to be passed around. Used by faster for local allocators and such
-/// freelist is returned to resource periodically after the epoch is deemed safe
+/// retired blocks are returned to resource periodically after the epoch is
+/// deemed safe
 struct worker_state {
+  // a few bags is plenty: one gets sealed per major tick, and they are
+  // released oldest first as soon as the safe epoch passes them
+  static constexpr std::size_t retire_bags = 8;
+
   std::pmr::memory_resource &resource;
-  // this freelist is also going to be tricky: currently, this is the default
-  // allocator but that will face contention on alloc/dealloc of the freelist
-  // nodes, using the global malloc lock. not great!
-  std::list<alloc_block> freelist{};
+  // set when the resource can take a whole chain back at once
+  block_pool *pool{dynamic_cast<block_pool *>(&resource)};
+  // ring of limbo bags, [oldest, current] are in use. retiring and releasing
+  // never allocate
+  std::array<retire_bag, retire_bags> limbo{};
+  std::size_t limbo_oldest{0};
+  std::size_t limbo_current{0};
   std::uint64_t ticks{0};
   tftf::atomic<uint64_t> *epoch_counter{nullptr};
+
+  static constexpr std::uint64_t quiescent = UINT64_MAX;
+
+  /// @brief what a worker publishes for reclaimers: while inside a guard, the
+  /// epochs it may be reading nodes from, `quiescent` otherwise. epoch
+  /// reclamation only looks at `lo`, interval reclamation raises `hi` as the
+  /// epoch moves under a reader (see `protect`)
+  struct reservation {
+    tftf::atomic<uint64_t> lo{quiescent};
+    tftf::atomic<uint64_t> hi{quiescent};
+  };
+
+  // our slot in faster, null until registered
+  reservation *announce{nullptr};
+  std::uint64_t reserved_hi{0};
+  std::uint32_t guard_depth{0};
   size_t index{0};
+  // our counters in faster, null until registered (or with metrics compiled
+  // out)
+  worker_metrics *metrics{nullptr};
+  // xorshift state for cheap per-worker coin flips (skip list tower
+  // heights), reseeded by faster::register_worker. never zero
+  std::uint64_t random_state{0x9e3779b97f4a7c15};
+  // scratch for interval reclamation: everyone's [lo, hi] as of the last scan
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> reserved{};
+
+  /// @brief start a critical section, nothing retired from here on is freed
+  /// until we exit. nests, only the outermost enter announces. an
+  /// unregistered state isn't protected, only use those on a quiescent table
+  void enter() {
+    if (guard_depth++ == 0 && announce != nullptr) {
+      reserved_hi = epoch_counter->load(std::memory_order_acquire);
+      announce->lo.store(reserved_hi, std::memory_order_relaxed);
+      announce->hi.store(reserved_hi, std::memory_order_relaxed);
+      // the announcement has to land before we read any node, faster's
+      // reclaimer pairs this with a heavy_fence
+      light_fence();
+    }
+  }
+  void exit() {
+    assert(guard_depth > 0);
+    if (--guard_depth == 0 && announce != nullptr) {
+      announce->lo.store(quiescent, std::memory_order_release);
+      announce->hi.store(quiescent, std::memory_order_release);
+    }
+  }
+
+  /// @brief load a pointer we're about to follow and extend our reservation
+  /// to the current epoch first if it has moved since we last looked (the
+  /// node may have been born after we entered). interval reclamation only
+  template <class T> auto protect(const std::atomic<T> &src) -> T {
+    while (true) {
+      const T value = src.load(std::memory_order_acquire);
+      if (announce == nullptr) {
+        return value;
+      }
+      const std::uint64_t epoch =
+          epoch_counter->load(std::memory_order_acquire);
+      if (epoch <= reserved_hi) [[likely]] {
+        return value;
+      }
+      reserved_hi = epoch;
+      announce->hi.store(epoch, std::memory_order_relaxed);
+      light_fence();
+    }
+  }
+
+  /// @brief 64 random bits (xorshift64*), good enough for balancing, not
+  /// for anything adversarial
+  auto random() -> std::uint64_t {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dull;
+  }
+
+  /// @brief bump one of our counters, see metrics.hh
+  void count([[maybe_unused]] table_event event,
+             [[maybe_unused]] std::uint64_t n = 1) {
+    if constexpr (metrics_enabled) {
+      if (metrics != nullptr) {
+        metrics->events[static_cast<std::size_t>(event)].add(n);
+      }
+    }
+  }
+
+  /// @brief retire a block unlinked at `epoch`. its first word is overwritten.
+  /// `birth` is the epoch it was allocated at, if anyone is tracking that
+  void retire(void *ptr, std::uint64_t epoch, std::uint64_t birth = 0) {
+    limbo[limbo_current].push(ptr, epoch, birth);
+    count(table_event::retired);
+  }
+  /// @brief retire an out of line value box, its birth is in its header
+  void retire_box(box_header *box, std::uint64_t epoch) {
+    limbo[limbo_current].push_box(box, epoch);
+    count(table_event::retired);
+  }
+
+  /// @brief start a new bag if there's room in the ring, otherwise keep
+  /// filling the current one
+  void seal_retired() {
+    const std::size_t next = (limbo_current + 1) % retire_bags;
+    if (!limbo[limbo_current].empty() && next != limbo_oldest) {
+      limbo_current = next;
+    }
+  }
+
+  /// @brief hand every bag retired before `safe_epoch` back to the resource.
+  /// `destroy` (if any) runs on every retired block first, like a box's
+  void release_retired(std::uint64_t safe_epoch, std::size_t block_size,
+                       std::size_t block_align,
+                       void (*destroy)(void *) = nullptr) {
+    while (true) {
+      retire_bag &bag = limbo[limbo_oldest];
+      if (bag.empty() || bag.max_epoch > safe_epoch) {
+        return;
+      }
+      release_bag(bag, block_size, block_align, destroy);
+      if (limbo_oldest == limbo_current) {
+        return;
+      }
+      limbo_oldest = (limbo_oldest + 1) % retire_bags;
+    }
+  }
+
+  /// @brief interval based release: hand back every block whose lifetime
+  /// [birth, retired] overlaps none of the intervals in `reserved`. a stalled
+  /// reader only pins what was alive while it read, so whole bags go back
+  /// when they can, the rest are sorted block by block and the survivors
+  /// regrouped into a single bag
+  template <class BirthOf>
+  void release_unreserved(std::size_t block_size, std::size_t block_align,
+                          BirthOf &&birth_of,
+                          void (*destroy)(void *) = nullptr) {
+    auto overlaps = [this](std::uint64_t birth, std::uint64_t retired) {
+      for (const auto &[lo, hi] : reserved) {
+        if (lo <= retired && birth <= hi) {
+          return true;
+        }
+      }
+      return false;
+    };
+
+    retire_bag kept{};
+    for (retire_bag &bag : limbo) {
+      if (bag.empty()) {
+        continue;
+      }
+      const std::uint64_t retired = bag.max_epoch - 1;
+      if (!overlaps(bag.min_birth, retired)) {
+        release_bag(bag, block_size, block_align, destroy);
+        continue;
+      }
+      retire_bag unreserved{};
+      void *p = bag.head;
+      while (p != nullptr) {
+        void *next = get_link(p);
+        const std::uint64_t birth = birth_of(p);
+        (overlaps(birth, retired) ? kept : unreserved).push(p, retired, birth);
+        p = next;
+      }
+      p = bag.boxes;
+      while (p != nullptr) {
+        void *next = get_link(p);
+        auto *box = static_cast<box_header *>(p);
+        (overlaps(box->birth, retired) ? kept : unreserved)
+            .push_box(box, retired);
+        p = next;
+      }
+      if (!unreserved.empty()) {
+        release_bag(unreserved, block_size, block_align, destroy);
+      }
+      bag = retire_bag{};
+    }
+    limbo[0] = kept;
+    limbo_oldest = limbo_current = 0;
+  }
+
+  /// @brief the epoch the oldest bag is waiting for, 0 if there's nothing
+  /// retired
+  auto oldest_retired_epoch() const -> std::uint64_t {
+    return limbo[limbo_oldest].max_epoch;
+  }
+
+  /// @brief number of blocks waiting to be released
+  auto retired_count() const -> std::size_t {
+    std::size_t total = 0;
+    for (const retire_bag &bag : limbo) {
+      total += bag.count + bag.box_count;
+    }
+    return total;
+  }
+
+private:
+  /// @brief a bag goes back in one splice when the resource is a matching
+  /// block_pool, block by block otherwise. boxes are destroyed first, and so
+  /// are blocks when there's a `destroy` for them (their first word, the
+  /// chain's link, is left alone)
+  void release_bag(retire_bag &bag, std::size_t block_size,
+                   std::size_t block_align, void (*destroy)(void *)) {
+    count(table_event::reclaimed, bag.count + bag.box_count);
+    if (destroy != nullptr) {
+      for (void *p = bag.head; p != nullptr;) {
+        void *next = get_link(p);
+        destroy(p);
+        p = next;
+      }
+    }
+    release_chain(bag.head, bag.tail, bag.count, block_size, block_align);
+    for (void *p = bag.boxes; p != nullptr; p = get_link(p)) {
+      static_cast<box_header *>(p)->destroy(p);
+    }
+    release_chain(bag.boxes, bag.boxes_tail, bag.box_count, block_size,
+                  block_align);
+    bag = retire_bag{};
+  }
+
+  void release_chain(void *head, void *tail, std::size_t count,
+                     std::size_t block_size, std::size_t block_align) {
+    if (head == nullptr) {
+      return;
+    }
+    if (pool != nullptr && pool->block_size() == block_size) {
+      pool->deallocate_chain(head, tail, count);
+      return;
+    }
+    void *p = head;
+    while (p != nullptr) {
+      void *next = get_link(p);
+      resource.deallocate(p, block_size, block_align);
+      p = next;
+    }
+  }
+};
+
+/// @brief keeps `state` inside a critical section for its lifetime
+class epoch_guard {
+public:
+  explicit epoch_guard(worker_state &state) : m_state(state) {
+    m_state.enter();
+  }
+  ~epoch_guard() { m_state.exit(); }
+
+  epoch_guard(const epoch_guard &) = delete;
+  epoch_guard &operator=(const epoch_guard &) = delete;
+
+private:
+  worker_state &m_state;
+};
+
+/// @brief reclamation policies, picked with `Traits::reclaim`.
+///
+/// epoch_reclaim: a block goes back once every worker inside a guard entered
+/// after it was retired. reading is free, but one reader stuck inside a guard
+/// stops reclamation for the whole table.
+struct epoch_reclaim {
+  static constexpr bool interval_based = false;
+
+  template <class T>
+  static auto protect(worker_state & /* state */, const std::atomic<T> &src)
+      -> T {
+    return src.load(std::memory_order_acquire);
+  }
+};
+
+/// @brief interval_reclaim: interval based reclamation (2GE-IBR, Wen et al.).
+/// nodes remember the epoch they were born in and readers reserve
+/// [entered, latest epoch seen], so a stalled reader only pins the nodes that
+/// were alive while it was reading and unreclaimed memory per worker stays
+/// bounded. costs an epoch load per pointer followed and a (light) fence
+/// whenever the epoch has moved
+struct interval_reclaim {
+  static constexpr bool interval_based = true;
 
-  void freelist_add(alloc_block block) {
-    // now this has allocation problems...
-    freelist.push_back(block);
+  template <class T>
+  static auto protect(worker_state &state, const std::atomic<T> &src) -> T {
+    return state.protect(src);
   }
 };
 
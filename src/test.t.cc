@@ -1,12 +1,28 @@
 
 #include "allocator.hh"
+#include "checkpoint.hh"
 #include "faster.hh"
+#include "sharded.hh"
+#include "write_buffer.hh"
 
+#include <algorithm>
 #include <cassert>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <memory_resource>
+#include <numeric>
 #include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
+
+#include <sys/resource.h>
 
 void alloc_test() {
   // extra for the freelist....
@@ -14,7 +30,8 @@ void alloc_test() {
   std::pmr::monotonic_buffer_resource buf{buffer, 1300,
                                           std::pmr::null_memory_resource()};
 
-  tftf::node_resource<500> resource{buf};
+  // one block at a time, so the buffer runs out after exactly two
+  tftf::node_resource<500> resource{buf, {.slab_size = 0}};
 
   void *p1 = resource.allocate(500);
   void *p2 = resource.allocate(500);
@@ -37,6 +54,98 @@ void alloc_test() {
   std::cerr << "passed all alloc tests!\n";
 }
 
+void slab_test() {
+  std::pmr::memory_resource &upstream = *std::pmr::new_delete_resource();
+  {
+    // small slabs so a few thousand blocks span many of them
+    tftf::node_resource<24> resource{upstream, {.slab_size = 4096}};
+    constexpr size_t per_slab = (4096 - 64) / 24;
+
+    std::vector<void *> blocks;
+    for (size_t i = 0; i < 20 * per_slab; i++) {
+      void *p = resource.allocate(24, 8);
+      assert(reinterpret_cast<uintptr_t>(p) % 8 == 0);
+      blocks.push_back(p);
+    }
+    assert(resource.m_stats.upstream_count == 20);
+    assert(resource.slab_count() == 20);
+
+    // free everything: trims along the way give back all but the current
+    // slab and one spare
+    for (void *p : blocks) {
+      resource.deallocate(p, 24, 8);
+    }
+    resource.trim();
+    assert(resource.slab_count() == 2);
+
+    // and the spare is reused before going upstream again
+    for (size_t i = 0; i < 2 * per_slab; i++) {
+      blocks[i] = resource.allocate(24, 8);
+    }
+    assert(resource.m_stats.upstream_count == 20);
+    // a chain straddling slabs goes back in one splice
+    for (size_t i = 0; i + 1 < 2 * per_slab; i++) {
+      tftf::set_link(blocks[i], blocks[i + 1]);
+    }
+    resource.deallocate_chain(blocks[0], blocks[2 * per_slab - 1],
+                              2 * per_slab);
+    resource.trim();
+    assert(resource.slab_count() == 2);
+  }
+  {
+    // default 2MB slabs, asking for huge pages is only a hint
+    tftf::node_resource<40> resource{upstream, {.hugepages = true}};
+    void *p = resource.allocate(40, 8);
+    resource.deallocate(p, 40, 8);
+    assert(resource.allocate(40, 8) == p);
+    assert(resource.slab_count() == 1);
+  }
+  std::cerr << "passed slab test!\n";
+}
+
+void exchange_test() {
+  // batches are only descriptors to the exchange, so fake ones do
+  tftf::block_exchange exchange{64, 1};
+  constexpr size_t n_threads = 4;
+  constexpr uintptr_t per_thread = 20'000;
+  std::vector<std::vector<uintptr_t>> taken(n_threads);
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < n_threads; t++) {
+    threads.emplace_back([&, t] {
+      for (uintptr_t i = 0; i < per_thread; i++) {
+        const uintptr_t id = t * per_thread + i + 1;
+        void *p = reinterpret_cast<void *>(id);
+        while (!exchange.push({p, p, 1})) {
+          tftf::block_batch batch;
+          if (exchange.pop(batch)) {
+            taken[t].push_back(reinterpret_cast<uintptr_t>(batch.first));
+          }
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  tftf::block_batch batch;
+  while (exchange.pop(batch)) {
+    taken[0].push_back(reinterpret_cast<uintptr_t>(batch.first));
+  }
+
+  // every batch comes out exactly once
+  std::vector<uintptr_t> all;
+  for (auto &ids : taken) {
+    all.insert(all.end(), ids.begin(), ids.end());
+  }
+  std::sort(all.begin(), all.end());
+  assert(all.size() == n_threads * per_thread);
+  for (size_t i = 0; i < all.size(); i++) {
+    assert(all[i] == i + 1);
+  }
+  std::cerr << "passed exchange test!\n";
+}
+
 void integration_test() {
   tftf::faster<int, int> f;
   std::pmr::monotonic_buffer_resource buf{1000};
@@ -99,18 +208,306 @@ void integration_test() {
   std::cerr << "passed all integration tests!\n";
 }
 
+struct eager_delete {
+
+  static constexpr size_t max_workers = 1'024;
+  static constexpr size_t minor_ticks_per_major = 1'000;
+};
+
 void delete_heavy_test() {
 
-  tftf::faster<int, int> f;
+  tftf::faster<int, int, eager_delete> f;
   std::pmr::monotonic_buffer_resource buf{1000};
   tftf::node_resource<tftf::faster<int, int>::list_t::alloc_size> resource{buf};
 
   tftf::worker_state state{resource};
   f.register_worker(state);
+  assert(state.pool == &resource);
+
+  // churn the same 1000 keys: once the first few bags have been recycled
+  // every node should come back off the freelist
+  uint64_t warm_upstream = 0;
+  for (int round = 0; round < 200; round++) {
+    if (round == 20) {
+      warm_upstream = resource.m_stats.upstream_count;
+    }
+    for (int i = 0; i < 1000; i++) {
+      f.put(state, i, round);
+    }
+    for (int i = 0; i < 1000; i++) {
+      assert(f.erase(state, i));
+    }
+  }
+  assert(resource.m_stats.upstream_count == warm_upstream);
+  assert(resource.m_stats.dealloc_count > 100 * 1000);
+  // only what was retired since the last safe tick is still waiting
+  assert(state.retired_count() <= 3 * 1000);
 
   std::cerr << "passed delete test!\n";
 }
 
+void epoch_test() {
+  static_assert(sizeof(tftf::padded<tftf::atomic<uint64_t>>) ==
+                tftf::cache_line);
+
+  // two workers taking turns on one thread: neither may hold the other's
+  // garbage back for longer than a tick or two
+  tftf::faster<int, int, eager_delete> f;
+  std::pmr::monotonic_buffer_resource buf{1000};
+  using resource_t =
+      tftf::node_resource<tftf::faster<int, int>::list_t::alloc_size>;
+  resource_t r1{buf}, r2{buf};
+  tftf::worker_state s1{r1}, s2{r2};
+  f.register_worker(s1);
+  f.register_worker(s2);
+
+  for (int round = 0; round < 100; round++) {
+    for (auto *state : {&s1, &s2}) {
+      const int base = state == &s1 ? 0 : 1000;
+      for (int i = base; i < base + 1000; i++) {
+        f.put(*state, i, round);
+      }
+      for (int i = base; i < base + 1000; i++) {
+        assert(f.erase(*state, i));
+      }
+    }
+    assert(s1.retired_count() <= 3 * 1000);
+    assert(s2.retired_count() <= 3 * 1000);
+  }
+  assert(r1.m_stats.dealloc_count > 90 * 1000);
+  assert(r2.m_stats.dealloc_count > 90 * 1000);
+
+  std::cerr << "passed epoch test!\n";
+}
+
+void guard_test() {
+  tftf::faster<int, int, eager_delete> f;
+  std::pmr::monotonic_buffer_resource buf{1000};
+  using resource_t =
+      tftf::node_resource<tftf::faster<int, int>::list_t::alloc_size>;
+  resource_t r_writer{buf}, r_reader{buf};
+  tftf::worker_state writer{r_writer}, reader{r_reader};
+  f.register_worker(writer);
+  // registered but idle: must not hold anything back
+  f.register_worker(reader);
+
+  auto churn = [&](int rounds) {
+    for (int round = 0; round < rounds; round++) {
+      for (int i = 0; i < 1000; i++) {
+        f.put(writer, i, round);
+      }
+      for (int i = 0; i < 1000; i++) {
+        assert(f.erase(writer, i));
+      }
+    }
+  };
+
+  churn(20);
+  assert(writer.retired_count() <= 3 * 1000);
+
+  {
+    // a reader parked in a critical section pins everything retired after it
+    // entered (nested guards don't change that)
+    const tftf::epoch_guard outer{reader};
+    const tftf::epoch_guard inner{reader};
+    assert(!f.get(reader, 1));
+    const uint64_t released = r_writer.m_stats.dealloc_count;
+    churn(20);
+    assert(r_writer.m_stats.dealloc_count - released <= 3 * 1000);
+    assert(writer.retired_count() >= 19 * 1000);
+  }
+  assert(reader.guard_depth == 0);
+
+  churn(20);
+  assert(writer.retired_count() <= 3 * 1000);
+
+  std::cerr << "passed guard test!\n";
+}
+
+struct interval_reclaimed : eager_delete {
+  using reclaim = tftf::interval_reclaim;
+};
+
+struct few_workers : eager_delete {
+  static constexpr size_t max_workers = 4;
+};
+
+void max_workers_test() {
+  tftf::faster<int, int, few_workers> f;
+  std::vector<tftf::worker_state> states;
+  states.reserve(5);
+  for (int i = 0; i < 5; i++) {
+    states.emplace_back(*std::pmr::get_default_resource());
+  }
+  for (int i = 0; i < 4; i++) {
+    f.register_worker(states[i]);
+  }
+  bool threw = false;
+  try {
+    f.register_worker(states[4]);
+  } catch (const std::length_error &) {
+    threw = true;
+  }
+  assert(threw);
+  assert(f.collect_stats().workers == 4);
+
+  // a wal with fewer buffers than the table has workers refuses the rest
+  const std::string path =
+      (std::filesystem::temp_directory_path() / "tftf_max_workers_test.wal")
+          .string();
+  {
+    tftf::write_ahead_log<int, int> wal{{.path = path, .max_workers = 2}};
+    f.attach_wal(&wal);
+    f.put(states[1], 1, 1);
+    threw = false;
+    try {
+      f.put(states[3], 3, 3);
+    } catch (const std::out_of_range &) {
+      threw = true;
+    }
+    assert(threw && !f.get(states[0], 3).has_value());
+    f.attach_wal(nullptr);
+  }
+  std::filesystem::remove(path);
+  std::cerr << "passed max workers test!\n";
+}
+
+void interval_test() {
+  tftf::faster<int, int, interval_reclaimed> f;
+  std::pmr::monotonic_buffer_resource buf{1000};
+  using resource_t =
+      tftf::node_resource<tftf::faster<int, int,
+                                       interval_reclaimed>::list_t::alloc_size>;
+  resource_t r_writer{buf}, r_reader{buf};
+  tftf::worker_state writer{r_writer}, reader{r_reader};
+  f.register_worker(writer);
+  f.register_worker(reader);
+
+  auto churn = [&](int rounds) {
+    for (int round = 0; round < rounds; round++) {
+      for (int i = 0; i < 1000; i++) {
+        f.put(writer, i, round);
+      }
+      for (int i = 0; i < 1000; i++) {
+        assert(f.erase(writer, i));
+      }
+    }
+  };
+
+  for (int i = 0; i < 1000; i++) {
+    f.put(writer, i, -1);
+  }
+  {
+    // the same stall that pins everything under epochs (see guard_test) only
+    // pins the 1000 nodes that were alive when the reader entered
+    const tftf::epoch_guard stalled{reader};
+    assert(f.get(reader, 1) == -1);
+    for (int i = 0; i < 1000; i++) {
+      assert(f.erase(writer, i));
+    }
+    churn(50);
+    assert(writer.retired_count() <= 1000 + 3 * 1000);
+    assert(r_writer.m_stats.dealloc_count >= 45 * 1000);
+  }
+
+  churn(5);
+  assert(writer.retired_count() <= 3 * 1000);
+
+  std::cerr << "passed interval test!\n";
+}
+
+void rebalance_test() {
+  // one worker only inserts, another only erases: without the exchange the
+  // inserter keeps going upstream while the eraser's freelist grows
+  using table_t = tftf::faster<int, int, eager_delete>;
+  table_t f;
+  tftf::block_exchange exchange{256, 64};
+  const tftf::slab_options options{.slab_size = 1 << 16,
+                                   .exchange = &exchange,
+                                   .low_watermark = 64,
+                                   .high_watermark = 512};
+  std::pmr::memory_resource &upstream = *std::pmr::new_delete_resource();
+  tftf::node_resource<table_t::alloc_size> r_ingest{upstream, options};
+  tftf::node_resource<table_t::alloc_size> r_erase{upstream, options};
+  tftf::worker_state ingest{r_ingest}, eraser{r_erase};
+  f.register_worker(ingest);
+  f.register_worker(eraser);
+
+  uint64_t warm_upstream = 0;
+  for (int round = 0; round < 100; round++) {
+    if (round == 10) {
+      warm_upstream = r_ingest.m_stats.upstream_count;
+    }
+    for (int i = 0; i < 2000; i++) {
+      f.put(ingest, round * 2000 + i, i);
+    }
+    for (int i = 0; i < 2000; i++) {
+      assert(f.erase(eraser, round * 2000 + i));
+    }
+  }
+  assert(r_ingest.m_stats.upstream_count == warm_upstream);
+  assert(r_ingest.m_stats.refilled_count > 50 * 2000);
+  assert(r_erase.m_stats.donated_count > 50 * 2000);
+  assert(r_erase.m_stats.upstream_count == 0);
+
+  // a resource can go while others still use blocks from its slabs: they
+  // stay alive until the exchange goes
+  {
+    tftf::block_exchange shared{64, 32};
+    const tftf::slab_options small{.slab_size = 1 << 12,
+                                   .exchange = &shared,
+                                   .low_watermark = 32,
+                                   .high_watermark = 64};
+    tftf::node_resource<64> keeper{upstream, small};
+    std::vector<void *> held;
+    {
+      tftf::node_resource<64> leaver{upstream, small};
+      std::vector<void *> blocks;
+      for (int i = 0; i < 1'000; i++) {
+        blocks.push_back(leaver.allocate(64, 64));
+      }
+      for (void *p : blocks) {
+        leaver.deallocate(p, 64, 64);
+      }
+      assert(leaver.m_stats.donated_count > 0);
+      // some of the leaver's blocks are live elsewhere when it goes
+      for (int i = 0; i < 100; i++) {
+        held.push_back(keeper.allocate(64, 64));
+      }
+      assert(keeper.m_stats.upstream_count == 0);
+    }
+    for (int i = 0; i < 2'000; i++) {
+      held.push_back(keeper.allocate(64, 64));
+      std::memset(held.back(), 0xab, 64);
+    }
+    for (void *p : held) {
+      keeper.deallocate(p, 64, 64);
+    }
+    assert(keeper.m_stats.refilled_count > 100);
+  }
+
+  // resources whose blocks can't find their slab the same way are refused
+  auto refused = [&](tftf::slab_options bad, auto block) {
+    try {
+      tftf::node_resource<decltype(block)::value> r{upstream, bad};
+    } catch (const std::invalid_argument &) {
+      return true;
+    }
+    return false;
+  };
+  tftf::slab_options other_slabs = options;
+  other_slabs.slab_size = 1 << 17;
+  tftf::slab_options no_slabs = options;
+  no_slabs.slab_size = 0;
+  using same_block = std::integral_constant<size_t, table_t::alloc_size>;
+  assert(refused(other_slabs, same_block{}));
+  assert(refused(no_slabs, same_block{}));
+  assert(refused(options, std::integral_constant<size_t, 256>{}));
+  assert(!refused(options, same_block{}));
+
+  std::cerr << "passed rebalance test!\n";
+}
+
 void basic_multithread_test() {
 
   double mn = 10000;
@@ -195,11 +592,6 @@ void basic_multithread_test() {
   std::cerr << "passed multi test 1!: for reference, min was " << mn << "\n";
 }
 
-struct eager_delete {
-
-  static constexpr size_t max_workers = 1'024;
-  static constexpr size_t minor_ticks_per_major = 1'000;
-};
 void basic_multithread_mixed_test() {
   // i don't know the proportion for this yet
 
@@ -306,12 +698,1756 @@ void basic_multithread_mixed_test() {
             << ", max was " << mx << "\n";
 }
 
+void resize_test() {
+  // starts with a single bucket and has to grow the whole way
+  tftf::faster<int, int> f{1};
+  assert(f.bucket_count() == 1);
+
+  constexpr size_t n_threads = 4;
+  constexpr int n_inserts = 50'000;
+
+  std::atomic<size_t> done_count{0};
+  std::atomic<bool> done_flag{false};
+  std::atomic<size_t> misses{0};
+
+  auto insert_job = [&](int thread) {
+    std::pmr::monotonic_buffer_resource buf{100000};
+    tftf::node_resource<tftf::faster<int, int>::list_t::alloc_size> resource{
+        buf};
+    tftf::worker_state state{resource};
+    f.register_worker(state);
+
+    for (int i = 0; i < n_inserts; i++) {
+      int k = i * static_cast<int>(n_threads) + thread;
+      f.put(state, k, -k);
+      // our own writes have to survive every concurrent split
+      if (auto y = f.get(state, k); !y || *y != -k) {
+        misses++;
+      }
+    }
+    for (int i = 0; i < n_inserts; i += 2) {
+      int k = i * static_cast<int>(n_threads) + thread;
+      if (!f.erase(state, k)) {
+        misses++;
+      }
+    }
+
+    done_count.fetch_add(1);
+    while (!done_flag.load()) {
+      std::this_thread::yield();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < n_threads; i++) {
+    threads.push_back(std::thread{insert_job, static_cast<int>(i)});
+  }
+  while (done_count.load() < n_threads) {
+    std::this_thread::yield();
+  }
+
+  assert(misses.load() == 0);
+  assert(f.size() == n_threads * n_inserts / 2);
+  assert(f.bucket_count() >= n_threads * n_inserts / 2 / 2);
+
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  for (int k = 0; k < static_cast<int>(n_threads) * n_inserts; k++) {
+    auto y = f.get(state, k);
+    if ((k / static_cast<int>(n_threads)) % 2 == 0) {
+      assert(!y);
+    } else {
+      assert(y && *y == -k);
+    }
+  }
+
+  done_flag.store(true);
+  for (auto &t : threads) {
+    t.join();
+  }
+  std::cerr << "passed resize test! grew to " << f.bucket_count()
+            << " buckets\n";
+}
+
+struct bucketed {
+  static constexpr size_t max_workers = 1'024;
+  static constexpr size_t minor_ticks_per_major = 10'000;
+  template <class Key, class Value, class Traits>
+  using engine = tftf::bucket_engine<Key, Value, Traits>;
+};
+
+struct scannable : tftf::default_faster_traits {
+  static constexpr size_t scan_table_size = 16;
+};
+struct bucketed_scannable : bucketed {
+  // 20k stable keys plus up to 10k churning ones, with plenty of overflow
+  static constexpr size_t scan_table_size = 1'024;
+};
+
+struct skip_listed : tftf::default_faster_traits {
+  template <class Key, class Value, class Traits>
+  using engine = tftf::skip_list_engine<Key, Value, Traits>;
+  // there are no buckets to size
+  static constexpr size_t scan_table_size = 1;
+};
+struct interval_skip_listed : skip_listed {
+  using reclaim = tftf::interval_reclaim;
+};
+
+struct simd_bucketed : bucketed {
+  template <class Key, class Value, class Traits>
+  using engine =
+      tftf::bucket_engine<Key, Value, Traits, tftf::probe_for<Key, Value>>;
+};
+
+template <class Probe> void check_probe() {
+  std::mt19937 rng{7};
+  std::uniform_int_distribution<int> small(0, 3);
+  alignas(32) uint8_t tags[Probe::width];
+  for (int round = 0; round < 1000; round++) {
+    // few distinct values so there are plenty of multi-matches
+    for (auto &t : tags) {
+      t = small(rng) == 0 ? 0 : static_cast<uint8_t>(0x80 | small(rng));
+    }
+    const uint8_t tag = round % 2 ? 0 : static_cast<uint8_t>(0x80 | small(rng));
+
+    uint64_t expected = 0;
+    for (size_t i = 0; i < Probe::width; i++) {
+      expected |= uint64_t{tags[i] == tag} << i;
+    }
+    uint64_t got = 0;
+    for (auto m = Probe::match(tags, tag); m != 0; m &= m - 1) {
+      got |= uint64_t{1} << (std::countr_zero(m) >> Probe::slot_shift);
+    }
+    assert(got == expected);
+  }
+}
+
+void probe_test() {
+  check_probe<tftf::scalar_probe>();
+#if defined(__SSE2__)
+  check_probe<tftf::sse2_probe>();
+#endif
+#if defined(__AVX2__)
+  check_probe<tftf::avx2_probe>();
+#endif
+  static_assert(std::is_same_v<tftf::probe_for<int, int>, tftf::widest_probe>);
+  static_assert(std::is_same_v<tftf::probe_for<uint64_t, uint64_t>,
+                               tftf::widest_probe>);
+  static_assert(
+      std::is_same_v<tftf::probe_for<uint64_t, std::array<char, 64>>,
+                     tftf::scalar_probe>);
+  std::cerr << "passed probe test! widest kernel has "
+            << tftf::widest_probe::width << " slots\n";
+}
+
+template <class Traits> void bucket_engine_test() {
+  using table_t = tftf::faster<int, int, Traits>;
+  {
+    // 4 small buckets, so almost everything lands in overflow buckets
+    table_t f{4};
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+
+    for (int i = 0; i < 1000; i++) {
+      assert(f.put(state, i, i));
+    }
+    assert(!f.put(state, 7, 70));
+    assert(f.size() == 1000);
+    assert(f.bucket_count() == 4);
+    assert(*f.get(state, 7) == 70);
+
+    for (int i = 0; i < 1000; i += 2) {
+      assert(f.erase(state, i));
+      assert(!f.erase(state, i));
+    }
+    for (int i = 1; i < 1000; i += 2) {
+      auto z = f.update(state, i, [](int v) { return -v; });
+      assert(z && (*z == i || i == 7));
+    }
+    assert(!f.update(state, 0, [](int v) { return v; }));
+    for (int i = 0; i < 1000; i++) {
+      auto y = f.get(state, i);
+      if (i % 2 == 0) {
+        assert(!y);
+      } else {
+        assert(y && *y == (i == 7 ? -70 : -i));
+      }
+    }
+    // freed slots get reused before the chain grows again
+    for (int i = 0; i < 1000; i += 2) {
+      assert(f.put(state, i, i));
+    }
+    assert(f.size() == 1000);
+  }
+
+  // concurrent increments on a handful of hot keys must never be lost, and
+  // readers have to keep seeing every key while writers churn the buckets
+  constexpr size_t n_threads = 4;
+  constexpr int n_counters = 16;
+  constexpr int n_increments = 20'000;
+
+  table_t f{64};
+  {
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    for (int i = 0; i < n_counters; i++) {
+      f.put(state, i, 0);
+    }
+  }
+  std::atomic<size_t> misses{0};
+  auto job = [&](int thread) {
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    for (int i = 0; i < n_increments; i++) {
+      f.update(state, i % n_counters, [](int v) { return v + 1; });
+      const int k = 1'000 + thread * n_increments + i;
+      f.put(state, k, k);
+      if (!f.get(state, i % n_counters) || f.get(state, k) != k) {
+        misses++;
+      }
+      if (i % 3 == 0) {
+        f.erase(state, k);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < n_threads; i++) {
+    threads.emplace_back(job, static_cast<int>(i));
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  assert(misses.load() == 0);
+
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  int total = 0;
+  for (int i = 0; i < n_counters; i++) {
+    total += *f.get(state, i);
+  }
+  assert(total == static_cast<int>(n_threads) * n_increments);
+  assert(f.size() == n_counters + n_threads * (n_increments * 2 / 3));
+
+  std::cerr << "passed bucket engine test! (" << table_t::engine_t::slots
+            << " slots per bucket)\n";
+}
+
+template <class Traits> void batch_test() {
+  using table_t = tftf::faster<int, int, Traits>;
+  table_t f{64};
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  f.register_worker(state);
+
+  // repeats inside the batch overwrite, last one wins
+  std::vector<int> keys, values;
+  for (int i = 0; i < 1000; i++) {
+    keys.push_back(i % 700);
+    values.push_back(i);
+  }
+  assert(f.put_batch(state, keys, values) == 700);
+  assert(f.size() == 700);
+
+  std::vector<int> lookups;
+  for (int i = 0; i < 300; i++) {
+    lookups.push_back((i * 7919) % 1400);
+  }
+  std::vector<std::optional<int>> out(lookups.size(), -1);
+  size_t found = f.get_batch(state, lookups, out);
+
+  size_t expected_found = 0;
+  for (size_t i = 0; i < lookups.size(); i++) {
+    assert(out[i] == f.get(state, lookups[i]));
+    if (lookups[i] < 700) {
+      expected_found++;
+      assert(*out[i] == (lookups[i] < 300 ? lookups[i] + 700 : lookups[i]));
+    }
+  }
+  assert(found == expected_found);
+
+  // batched readers racing an eraser only ever miss the keys being erased
+  std::atomic<bool> stop{false};
+  std::thread eraser{[&]() {
+    tftf::worker_state local{*std::pmr::get_default_resource()};
+    f.register_worker(local);
+    for (int round = 0; round < 50; round++) {
+      for (int k = 0; k < 700; k += 2) {
+        f.erase(local, k);
+      }
+      for (int k = 0; k < 700; k += 2) {
+        f.put(local, k, k);
+      }
+    }
+    stop.store(true);
+  }};
+  std::vector<int> all(700);
+  std::iota(all.begin(), all.end(), 0);
+  std::vector<std::optional<int>> got(all.size());
+  do {
+    f.get_batch(state, all, got);
+    for (int k = 1; k < 700; k += 2) {
+      assert(got[k]);
+    }
+  } while (!stop.load());
+  eraser.join();
+
+  std::cerr << "passed batch test!\n";
+}
+
+template <class Traits> void scan_test() {
+  // start small so the list engine splits buckets while we scan
+  tftf::faster<int, int, Traits> f{Traits::scan_table_size};
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  f.register_worker(state);
+
+  constexpr int n_stable = 20'000;
+  for (int i = 0; i < n_stable; i++) {
+    f.put(state, i, i * 3);
+  }
+
+  {
+    std::vector<int> seen(n_stable, 0);
+    size_t visited = 0;
+    f.for_each(state, [&](const int &k, const int &v) {
+      assert(v == k * 3);
+      seen[k]++;
+      visited++;
+    });
+    assert(visited == n_stable);
+    assert(std::all_of(seen.begin(), seen.end(), [](int c) { return c == 1; }));
+  }
+
+  // keys above n_stable come and go while we scan, the stable ones must
+  // still show up exactly once
+  std::atomic<bool> stop{false};
+  std::thread churn{[&] {
+    tftf::worker_state local{*std::pmr::get_default_resource()};
+    f.register_worker(local);
+    for (int round = 0; !stop.load(); round++) {
+      for (int i = 0; i < 5'000; i++) {
+        f.put(local, n_stable + (round % 4) * 5'000 + i, -1);
+      }
+      for (int i = 0; i < 5'000; i++) {
+        f.erase(local, n_stable + ((round + 2) % 4) * 5'000 + i);
+      }
+    }
+  }};
+
+  std::vector<tftf::worker_state> scanners;
+  scanners.reserve(3);
+  std::vector<tftf::worker_state *> scanner_ptrs;
+  for (int i = 0; i < 3; i++) {
+    scanners.push_back(tftf::worker_state{*std::pmr::get_default_resource()});
+    f.register_worker(scanners.back());
+    scanner_ptrs.push_back(&scanners.back());
+  }
+
+  for (int pass = 0; pass < 5; pass++) {
+    std::vector<std::atomic<int>> seen(n_stable);
+    auto visit = [&](const int &k, const int &v) {
+      if (k < n_stable) {
+        assert(v == k * 3);
+        seen[k].fetch_add(1, std::memory_order_relaxed);
+      } else {
+        assert(v == -1);
+      }
+    };
+    if (pass % 2 == 0) {
+      f.for_each(state, visit);
+    } else {
+      f.parallel_for_each(scanner_ptrs, visit);
+    }
+    for (const auto &c : seen) {
+      assert(c.load() == 1);
+    }
+  }
+  // nobody to scan with, nothing scanned
+  bool visited = false;
+  f.parallel_for_each({}, [&](const int &, const int &) { visited = true; });
+  assert(!visited);
+  stop.store(true);
+  churn.join();
+
+  std::cerr << "passed scan test! (" << f.bucket_count() << " buckets)\n";
+}
+
+template <class Traits> void checkpoint_test() {
+  using table_t = tftf::faster<int, int, Traits>;
+  const std::string path =
+      (std::filesystem::temp_directory_path() / "tftf_checkpoint_test.ckpt")
+          .string();
+
+  table_t f{Traits::scan_table_size};
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  f.register_worker(state);
+  constexpr int n_stable = 50'000;
+  for (int i = 0; i < n_stable; i++) {
+    f.put(state, i, i * 7);
+  }
+
+  // writers keep going during the checkpoint
+  std::atomic<bool> stop{false};
+  std::thread churn{[&] {
+    tftf::worker_state local{*std::pmr::get_default_resource()};
+    f.register_worker(local);
+    for (int round = 0; !stop.load(); round++) {
+      for (int i = 0; i < 1'000; i++) {
+        f.put(local, n_stable + (round % 4) * 1'000 + i, -1);
+      }
+      for (int i = 0; i < 1'000; i++) {
+        f.erase(local, n_stable + ((round + 2) % 4) * 1'000 + i);
+      }
+    }
+  }};
+  const tftf::checkpoint_header header = tftf::write_checkpoint(f, state, path);
+  stop.store(true);
+  churn.join();
+  assert(header.count >= n_stable);
+  assert(header.start_epoch <= header.end_epoch);
+
+  tftf::checkpoint_reader reader{path};
+  assert(reader.count() == header.count);
+  table_t restored{reader.bucket_count()};
+  tftf::worker_state restore_state{*std::pmr::get_default_resource()};
+  restored.register_worker(restore_state);
+  assert(reader.load_into(restored, restore_state) == header.count);
+  assert(restored.size() == header.count);
+  for (int i = 0; i < n_stable; i++) {
+    assert(restored.get(restore_state, i) == i * 7);
+  }
+
+  // a file that isn't a checkpoint is refused
+  {
+    std::FILE *junk = std::fopen(path.c_str(), "wb");
+    const char bytes[128] = "definitely not a checkpoint";
+    std::fwrite(bytes, 1, sizeof(bytes), junk);
+    std::fclose(junk);
+    bool threw = false;
+    try {
+      tftf::checkpoint_reader bad{path};
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+  std::filesystem::remove(path);
+
+  std::cerr << "passed checkpoint test! (" << header.count << " entries)\n";
+}
+
+struct hybrid {
+  static constexpr size_t max_workers = 1'024;
+  static constexpr size_t minor_ticks_per_major = 10'000;
+  template <class Key, class Value, class Traits>
+  using engine = tftf::hybrid_log_engine<Key, Value, Traits>;
+};
+
+// big enough that a few thousand of them don't fit in the log's frames
+struct blob {
+  uint64_t id;
+  uint64_t payload[7];
+  auto operator==(const blob &) const -> bool = default;
+};
+
+auto make_blob(uint64_t id) -> blob {
+  blob b{id, {}};
+  for (size_t i = 0; i < 7; i++) {
+    b.payload[i] = id * 31 + i;
+  }
+  return b;
+}
+
+void hybrid_log_test() {
+  // 4 pages of 4k in memory (2 of them mutable), against ~1.6MB of records
+  const tftf::hybrid_log_options options{
+      .page_size = 4'096, .memory_pages = 4, .mutable_pages = 2};
+  tftf::faster<int, blob, hybrid> f{1'024, options};
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  f.register_worker(state);
+  const auto &log = f.engine().log();
+  assert(log.memory_bytes() == 4 * 4'096);
+
+  constexpr int n = 20'000;
+  for (int i = 0; i < n; i++) {
+    assert(f.put(state, i, make_blob(i)));
+  }
+  assert(f.size() == n);
+  // almost everything has been pushed out to the file
+  assert(log.head() > 40 * log.memory_bytes());
+  for (int i = 0; i < n; i++) {
+    assert(f.get(state, i) == make_blob(i));
+  }
+  assert(!f.get(state, n).has_value());
+  {
+    std::vector<int> keys{3, n + 3, 17'000, 1};
+    std::vector<std::optional<blob>> out(keys.size());
+    assert(f.get_batch(state, keys, out) == 3);
+    assert(out[0] == make_blob(3) && !out[1] && out[2] == make_blob(17'000));
+  }
+
+  // the newest record is still in the mutable tail: overwritten in place
+  const auto tail = log.tail();
+  assert(!f.put(state, n - 1, make_blob(1)));
+  assert(log.tail() == tail);
+  assert(f.get(state, n - 1) == make_blob(1));
+  // a cold one gets a new copy at the tail
+  auto old = f.update(state, 0, [](blob b) {
+    b.id += 1'000'000;
+    return b;
+  });
+  assert(old == make_blob(0));
+  assert(log.tail() > tail);
+  assert(f.get(state, 0)->id == 1'000'000);
+
+  // async reads: cold ones call back from the io pool
+  std::atomic<int> answered{0};
+  std::atomic<int> wrong{0};
+  int deferred = 0;
+  for (int i = 1; i < n; i += 7) {
+    const blob expected = i == n - 1 ? make_blob(1) : make_blob(i);
+    deferred += !f.engine().get_async(
+        state, i, [&answered, &wrong, expected](std::optional<blob> b) {
+          wrong += b != expected;
+          answered++;
+        });
+  }
+  f.engine().complete_pending();
+  assert(answered.load() == (n - 1 + 6) / 7);
+  assert(wrong.load() == 0);
+  assert(deferred > 0);
+
+  assert(f.erase(state, 5));
+  assert(!f.get(state, 5).has_value());
+  size_t seen = 0;
+  f.for_each(state, [&](int key, const blob &b) {
+    assert(key != 5);
+    assert(b.payload[0] == static_cast<uint64_t>(key) * 31 ||
+           key == 0 || key == n - 1);
+    seen++;
+  });
+  assert(seen == n - 1);
+
+  // concurrent increments of a few hot keys while another thread appends
+  // enough to push them through read only and out to disk. none get lost
+  constexpr int counters = 8;
+  constexpr int rounds = 2'000;
+  for (int c = 0; c < counters; c++) {
+    f.put(state, -1 - c, blob{});
+  }
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; t++) {
+    threads.emplace_back([&f] {
+      tftf::worker_state local{*std::pmr::get_default_resource()};
+      f.register_worker(local);
+      for (int r = 0; r < rounds; r++) {
+        f.update(local, -1 - (r % counters), [](blob b) {
+          b.id++;
+          return b;
+        });
+      }
+    });
+  }
+  threads.emplace_back([&f] {
+    tftf::worker_state local{*std::pmr::get_default_resource()};
+    f.register_worker(local);
+    for (int i = 0; i < 5'000; i++) {
+      f.put(local, n + i, make_blob(n + i));
+    }
+  });
+  for (auto &t : threads) {
+    t.join();
+  }
+  for (int c = 0; c < counters; c++) {
+    assert(f.get(state, -1 - c)->id == 2 * rounds / counters);
+  }
+
+  std::cerr << "passed hybrid log test! (" << log.tail() / 1'024
+            << "KB of log, " << log.memory_bytes() / 1'024 << "KB in memory)\n";
+}
+
+/// @brief every entry of `f`, sorted, to compare tables
+template <class Table>
+auto contents(Table &f, tftf::worker_state &state)
+    -> std::vector<std::pair<int, int>> {
+  std::vector<std::pair<int, int>> out;
+  f.for_each(state, [&](int key, int value) { out.emplace_back(key, value); });
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+void wal_test() {
+  const auto dir = std::filesystem::temp_directory_path();
+  const std::string path = (dir / "tftf_wal_test.wal").string();
+  const std::string rotated = (dir / "tftf_wal_test.2.wal").string();
+  const std::string ckpt = (dir / "tftf_wal_test.ckpt").string();
+
+  std::vector<std::pair<int, int>> expected;
+  {
+    tftf::faster<int, int> f;
+    tftf::write_ahead_log<int, int> wal{{.path = path}};
+    f.attach_wal(&wal);
+    // two writers on overlapping keys, so the stripes have to order them
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; t++) {
+      threads.emplace_back([&f, t] {
+        tftf::worker_state local{*std::pmr::get_default_resource()};
+        f.register_worker(local);
+        for (int i = 0; i < 20'000; i++) {
+          const int key = i % 5'000;
+          switch ((i + t) % 4) {
+          case 0:
+          case 1:
+            f.put(local, key, i * 2 + t);
+            break;
+          case 2:
+            f.update(local, key, [](int v) { return v + 1; });
+            break;
+          case 3:
+            f.erase(local, key + 2'500);
+            break;
+          }
+        }
+      });
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    expected = contents(f, state);
+    // the wal's destructor commits what's left
+  }
+  assert(!expected.empty());
+
+  // a crash mid-commit leaves a torn record at the end, which is skipped
+  {
+    std::FILE *file = std::fopen(path.c_str(), "ab");
+    const char junk[13] = "torn record.";
+    std::fwrite(junk, 1, sizeof(junk), file);
+    std::fclose(file);
+  }
+  {
+    tftf::faster<int, int> recovered;
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    recovered.register_worker(state);
+    assert(tftf::replay_wal(recovered, state, path) > 0);
+    assert(contents(recovered, state) == expected);
+  }
+
+  // a new worker's first append racing a commit is still on disk when its
+  // put comes back
+  {
+    tftf::faster<int, int> f;
+    tftf::write_ahead_log<int, int> wal{
+        {.path = path,
+         .mode = tftf::durability::group_sync,
+         .interval = std::chrono::seconds{10},
+         .max_wait = std::chrono::seconds{10}}};
+    f.attach_wal(&wal);
+    using record = tftf::write_ahead_log<int, int>::record;
+    const auto on_disk = [&path](int key) {
+      std::ifstream in{path, std::ios::binary};
+      in.seekg(sizeof(tftf::wal_header));
+      record r;
+      while (in.read(reinterpret_cast<char *>(&r), sizeof(r))) {
+        if (r.key == key) {
+          return true;
+        }
+      }
+      return false;
+    };
+    std::atomic<int> done{0};
+    std::thread committer{[&] {
+      while (done.load() < 64) {
+        wal.commit();
+      }
+    }};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 64; t++) {
+      threads.emplace_back([&, t] {
+        tftf::worker_state local{*std::pmr::get_default_resource()};
+        f.register_worker(local);
+        f.put(local, t, t);
+        assert(on_disk(t));
+        done++;
+      });
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    committer.join();
+    assert(wal.timeouts() == 0);
+  }
+
+  // group sync: a put only returns once its record is on disk
+  {
+    tftf::faster<int, int> f;
+    tftf::write_ahead_log<int, int> wal{
+        {.path = path, .mode = tftf::durability::group_sync}};
+    f.attach_wal(&wal);
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    for (int i = 0; i < 50; i++) {
+      f.put(state, i, i);
+    }
+    assert(wal.timeouts() == 0);
+    assert(wal.commits() > 0);
+    assert(std::filesystem::file_size(path) ==
+           sizeof(tftf::wal_header) +
+               50 * sizeof(tftf::write_ahead_log<int, int>::record));
+
+    // checkpoint after rotating, keep writing, then recover from both
+    for (int i = 0; i < 1'000; i++) {
+      f.put(state, i, i * 3);
+    }
+    wal.rotate(rotated);
+    tftf::write_checkpoint(f, state, ckpt);
+    for (int i = 500; i < 1'500; i++) {
+      f.put(state, i, -i);
+    }
+    f.erase(state, 0);
+    // rmws are logged with the value they produced
+    for (int i = 0; i < 2; i++) {
+      f.upsert_rmw(state, 5'000, 7, [](int v) { return v * 2; });
+    }
+    f.fetch_add(state, 1, 100);
+    expected = contents(f, state);
+  }
+  {
+    tftf::checkpoint_reader reader{ckpt};
+    tftf::faster<int, int> recovered{reader.bucket_count()};
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    recovered.register_worker(state);
+    reader.load_into(recovered, state);
+    assert(tftf::replay_wal(recovered, state, rotated) == 1'004);
+    assert(contents(recovered, state) == expected);
+  }
+
+  // a failed write sticks: commit keeps throwing and nothing is acked
+  {
+    tftf::faster<int, int> f;
+    tftf::write_ahead_log<int, int> wal{
+        {.path = path,
+         .mode = tftf::durability::group_sync,
+         .max_wait = std::chrono::milliseconds{1}}};
+    f.attach_wal(&wal);
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    // writes past the size limit fail with EFBIG instead of a signal
+    std::signal(SIGXFSZ, SIG_IGN);
+    rlimit old;
+    getrlimit(RLIMIT_FSIZE, &old);
+    rlimit limit = old;
+    limit.rlim_cur = sizeof(tftf::wal_header);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    f.put(state, 1, 1);
+    bool threw = false;
+    try {
+      wal.commit();
+    } catch (const std::system_error &) {
+      threw = true;
+    }
+    setrlimit(RLIMIT_FSIZE, &old);
+    std::signal(SIGXFSZ, SIG_DFL);
+    assert(threw && wal.failed());
+    assert(!wal.wait_durable(state));
+    threw = false;
+    try {
+      wal.commit();
+    } catch (const std::system_error &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+  std::filesystem::remove(path);
+  std::filesystem::remove(rotated);
+  std::filesystem::remove(ckpt);
+  std::cerr << "passed wal test!\n";
+}
+
+/// @brief counters hammered from several threads through every rmw entry
+/// point, starting from missing keys. nothing may be lost
+template <class Traits> void rmw_test() {
+  using table_t = tftf::faster<int, long, Traits>;
+  table_t f{1'024};
+  constexpr int n_threads = 4;
+  constexpr int counters = 16;
+  constexpr int rounds = 16 * 2'000;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n_threads; t++) {
+    threads.emplace_back([&f, t] {
+      tftf::worker_state local{*std::pmr::get_default_resource()};
+      f.register_worker(local);
+      for (int r = 0; r < rounds; r++) {
+        const int key = r % counters;
+        f.upsert_rmw(local, key, 1, [](long v) { return v + 1; });
+        assert(f.update(local, key, [](long v) { return v + 1; }));
+        assert(f.fetch_add(local, key, 2).has_value());
+      }
+      f.upsert_rmw(local, 100, 0, [](long v) { return v; });
+      f.fetch_or(local, 100, long{1} << t);
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  f.register_worker(state);
+  for (int key = 0; key < counters; key++) {
+    assert(f.get(state, key) == n_threads * (rounds / counters) * 4);
+  }
+  assert(f.get(state, 100) == (1 << n_threads) - 1);
+  assert(f.fetch_and(state, 100, 1) == (1 << n_threads) - 1);
+  assert(f.get(state, 100) == 1);
+  // the atomic entry points never insert
+  assert(!f.fetch_add(state, 200, 1).has_value());
+  assert(!f.get(state, 200).has_value());
+  assert(f.size() == counters + 1);
+  std::cerr << "passed rmw test!\n";
+}
+
+struct eagerly_combining : tftf::default_faster_traits {
+  static constexpr size_t combine_after_retries = 1;
+};
+struct never_combining : tftf::default_faster_traits {
+  static constexpr size_t combine_after_retries = 0;
+};
+
+template <class Traits> void combining_test() {
+  using tftf::table_event;
+  using table_t = tftf::faster<int, long, Traits>;
+  constexpr bool combines = Traits::combine_after_retries != 0;
+  table_t f{64};
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  tftf::worker_state other{*std::pmr::get_default_resource()};
+  f.register_worker(state);
+  f.register_worker(other);
+  auto delegated = [&f] {
+    return f.collect_stats().event(table_event::delegated);
+  };
+
+  f.put(state, 7, 0);
+  // the first two values we compute lose to a write from `other`, so the
+  // update retries twice and the bucket turns hot
+  int interfere = 2;
+  assert(f.update(state, 7, [&](long v) {
+    if (interfere > 0) {
+      interfere--;
+      f.fetch_add(other, 7, 10);
+    }
+    return v + 1;
+  }) == 20);
+  assert(f.get(state, 7) == 21);
+  assert(delegated() == 0);
+
+  // from now on its writes go through the combiner, which is us
+  for (int i = 0; i < 10; i++) {
+    f.upsert_rmw(state, 7, 0, [](long v) { return v + 1; });
+  }
+  assert(f.get(state, 7) == 31);
+  if constexpr (tftf::metrics_enabled) {
+    assert(delegated() == (combines ? 10 : 0));
+  }
+
+  // what fn throws comes out of our call, and the combiner is let go
+  bool threw = false;
+  try {
+    f.update(state, 7, [](long v) -> long {
+      throw std::runtime_error(std::to_string(v));
+    });
+  } catch (const std::runtime_error &e) {
+    threw = e.what() == std::string{"31"};
+  }
+  assert(threw);
+  // fn can call back into the table, hot bucket and all
+  assert(f.update(state, 7, [&](long v) {
+    f.upsert_rmw(other, 7, 0, [](long w) { return w; });
+    return v + 1;
+  }) == 31);
+  assert(f.get(state, 7) == 32);
+  f.update(state, 7, [](long v) { return v - 1; });
+
+  // and everyone's, from several threads at once
+  constexpr int n_threads = 4;
+  constexpr int rounds = 2'000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n_threads; t++) {
+    threads.emplace_back([&f, t] {
+      tftf::worker_state local{*std::pmr::get_default_resource()};
+      f.register_worker(local);
+      for (int r = 0; r < rounds; r++) {
+        f.upsert_rmw(local, 7, 0, [](long v) { return v + 1; });
+        assert(f.update(local, 7, [](long v) { return v + 2; }));
+        f.put(local, 1'000 + t * rounds + r, long{r});
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  assert(f.get(state, 7) == 31 + n_threads * rounds * 3);
+  for (int t = 0; t < n_threads; t++) {
+    for (int r = 0; r < rounds; r++) {
+      assert(f.get(state, 1'000 + t * rounds + r) == r);
+    }
+  }
+
+  // alone, the bucket cools off and goes back to plain compare_exchanges
+  for (int i = 0; i < 1'000; i++) {
+    f.update(state, 7, [](long v) { return v - 1; });
+  }
+  const uint64_t cooled = delegated();
+  f.update(state, 7, [](long v) { return v - 1; });
+  assert(delegated() == cooled);
+  assert(f.get(state, 7) == 31 + n_threads * rounds * 3 - 1'001);
+  std::cerr << "passed combining test!\n";
+}
+
+// a value whose copies throw on demand
+struct fussy {
+  static inline bool fail = false;
+  int v;
+
+  fussy(int x) : v(x) {}
+  fussy(const fussy &other) : v(other.v) {
+    if (fail) {
+      throw std::runtime_error("copy");
+    }
+  }
+  fussy(fussy &&) = default;
+  fussy &operator=(const fussy &) = default;
+  fussy &operator=(fussy &&) = default;
+};
+
+void write_buffer_test() {
+  const std::string path =
+      (std::filesystem::temp_directory_path() / "tftf_write_buffer_test.wal")
+          .string();
+  {
+    tftf::faster<int, int> f{64};
+    tftf::write_ahead_log<int, int> wal{{.path = path}};
+    f.attach_wal(&wal);
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    tftf::worker_state other{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    f.register_worker(other);
+    tftf::write_buffer<int, int> buffer{f, state, 8};
+
+    // repeated puts of a key merge, and only we see them until the flush
+    for (int i = 0; i < 100; i++) {
+      buffer.put(1, i);
+    }
+    buffer.put(2, 2);
+    assert(buffer.pending() == 2);
+    assert(buffer.get(1) == 99 && buffer.get(2) == 2);
+    assert(!f.get(other, 1).has_value());
+
+    // erasing a buffered key drops it, and takes the flushed one too
+    f.put(state, 3, 3);
+    buffer.put(3, 30);
+    assert(buffer.get(3) == 30 && f.get(other, 3) == 3);
+    assert(buffer.erase(3));
+    assert(!buffer.get(3).has_value() && !f.get(other, 3).has_value());
+    assert(!buffer.erase(3));
+    buffer.put(3, 33);
+    assert(buffer.get(3) == 33);
+
+    buffer.flush();
+    assert(buffer.pending() == 0);
+    assert(f.get(other, 1) == 99 && f.get(other, 2) == 2 &&
+           f.get(other, 3) == 33);
+    // buffered puts shadow flushed ones
+    buffer.put(1, -1);
+    assert(buffer.get(1) == -1 && f.get(other, 1) == 99);
+
+    // filling the buffer flushes it
+    for (int k = 10; k < 10 + 7; k++) {
+      buffer.put(k, k);
+    }
+    assert(buffer.pending() == 8);
+    buffer.put(100, 100);
+    assert(buffer.pending() == 1);
+    assert(f.get(other, 1) == -1 && f.get(other, 16) == 16);
+    assert(!f.get(other, 100).has_value());
+
+    const uint64_t commits = wal.commits();
+    buffer.sync();
+    assert(f.get(other, 100) == 100);
+    assert(wal.commits() > commits);
+  }
+  std::filesystem::remove(path);
+
+  // a put that throws keeps its entry (and the ones after it) buffered, and
+  // the destructor swallows what it can't report
+  {
+    tftf::faster<int, fussy> f{64};
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    {
+      tftf::write_buffer<int, fussy> buffer{f, state, 8};
+      buffer.put(1, fussy{1});
+      buffer.put(2, fussy{2});
+      fussy::fail = true;
+      bool threw = false;
+      try {
+        buffer.flush();
+      } catch (const std::runtime_error &) {
+        threw = true;
+      }
+      assert(threw && buffer.pending() >= 1);
+      fussy::fail = false;
+      buffer.put(2, fussy{22});
+      assert(buffer.get(2)->v == 22);
+      buffer.flush();
+      assert(buffer.pending() == 0);
+      assert(f.get(state, 1)->v == 1 && f.get(state, 2)->v == 22);
+      buffer.put(3, fussy{3});
+      fussy::fail = true;
+    }
+    fussy::fail = false;
+    assert(!f.get(state, 3).has_value());
+  }
+
+  // an ingest per thread, each through its own buffer
+  tftf::faster<int, int> f{16};
+  constexpr int n_threads = 4;
+  constexpr int keys = 5'000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n_threads; t++) {
+    threads.emplace_back([&f, t] {
+      tftf::worker_state local{*std::pmr::get_default_resource()};
+      f.register_worker(local);
+      tftf::write_buffer<int, int> buffer{f, local, 64};
+      for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < keys; i++) {
+          const int key = t * keys + i;
+          buffer.put(key, key + round);
+          assert(buffer.get(key) == key + round);
+        }
+      }
+      // the destructor flushes the rest
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  f.register_worker(state);
+  assert(f.size() == n_threads * keys);
+  for (int key = 0; key < n_threads * keys; key++) {
+    assert(f.get(state, key) == key + 2);
+  }
+  std::cerr << "passed write buffer test!\n";
+}
+
+// counts its live copies, so we can tell boxes get destroyed
+struct tracked {
+  static inline std::atomic<long> live{0};
+  std::string text;
+
+  tracked(std::string t) : text(std::move(t)) { live++; }
+  tracked(const tracked &other) : text(other.text) { live++; }
+  tracked &operator=(const tracked &) = default;
+  ~tracked() { live--; }
+};
+
+void boxed_value_test() {
+  static_assert(!tftf::faster<int, int>::list_t::boxed);
+  static_assert(tftf::faster<int, blob>::list_t::boxed);
+  static_assert(tftf::faster<int, std::string>::list_t::boxed);
+
+  {
+    using table_t = tftf::faster<int, tracked, eager_delete>;
+    table_t f;
+    std::pmr::monotonic_buffer_resource buf{1000};
+    tftf::node_resource<table_t::list_t::alloc_size> resource{buf};
+    tftf::worker_state state{resource};
+    f.register_worker(state);
+
+    // long enough that every string owns a heap buffer
+    auto text = [](int i, int round) {
+      return std::string(32, 'a' + round % 26) + std::to_string(i);
+    };
+    uint64_t warm_upstream = 0;
+    for (int round = 0; round < 100; round++) {
+      if (round == 20) {
+        warm_upstream = resource.m_stats.upstream_count;
+      }
+      for (int i = 0; i < 1000; i++) {
+        f.put(state, i, tracked{text(i, round)});
+      }
+      for (int i = 0; i < 1000; i++) {
+        assert(!f.put(state, i, tracked{text(i, round + 1)}));
+        const auto old = f.update(state, i, [](const tracked &t) {
+          return tracked{t.text + "!"};
+        });
+        assert(old && old->text == text(i, round + 1));
+      }
+      assert(f.get(state, 7)->text == text(7, round + 1) + "!");
+      for (int i = 0; i < 1000; i += 2) {
+        assert(f.erase(state, i));
+      }
+      assert(!f.get(state, 8));
+      assert(!f.update(state, 8, [](const tracked &t) { return t; }));
+    }
+    // replaced and erased boxes go back to the freelist, values destroyed
+    assert(resource.m_stats.upstream_count == warm_upstream);
+    assert(tracked::live >= static_cast<long>(f.size()));
+    assert(tracked::live <=
+           static_cast<long>(f.size() + state.retired_count()));
+  }
+
+  {
+    // writers swap whole blobs in while readers check they never see one
+    // half written
+    tftf::faster<int, blob, interval_reclaimed> f{64};
+    constexpr int keys = 64;
+    constexpr int n_writers = 2;
+    constexpr int n_readers = 2;
+    {
+      tftf::worker_state state{*std::pmr::get_default_resource()};
+      f.register_worker(state);
+      for (int i = 0; i < keys; i++) {
+        f.put(state, i, make_blob(i));
+      }
+    }
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_writers; t++) {
+      threads.emplace_back([&f, t] {
+        tftf::worker_state local{*std::pmr::get_default_resource()};
+        f.register_worker(local);
+        for (int r = 0; r < 20'000; r++) {
+          const int key = (r * 7 + t) % keys;
+          if (r % 2 == 0) {
+            f.put(local, key, make_blob(r));
+          } else {
+            f.update(local, key,
+                     [](const blob &b) { return make_blob(b.id + 1); });
+          }
+        }
+      });
+    }
+    for (int t = 0; t < n_readers; t++) {
+      threads.emplace_back([&f, &done] {
+        tftf::worker_state local{*std::pmr::get_default_resource()};
+        f.register_worker(local);
+        while (!done.load(std::memory_order_acquire)) {
+          for (int key = 0; key < keys; key++) {
+            const std::optional<blob> b = f.get(local, key);
+            assert(b && *b == make_blob(b->id));
+          }
+        }
+      });
+    }
+    for (int t = 0; t < n_writers; t++) {
+      threads[t].join();
+    }
+    done.store(true, std::memory_order_release);
+    for (int t = n_writers; t < n_writers + n_readers; t++) {
+      threads[t].join();
+    }
+    assert(f.size() == keys);
+  }
+
+  std::cerr << "passed boxed value test!\n";
+}
+
+// a string key that counts how often one gets built: lookups by view
+// shouldn't build any
+struct counted_key {
+  static inline int built = 0;
+  std::string text;
+
+  explicit counted_key(std::string_view t) : text(t) { built++; }
+  counted_key(const counted_key &other) : text(other.text) { built++; }
+  auto operator==(const counted_key &) const -> bool = default;
+  auto operator==(std::string_view other) const -> bool {
+    return text == other;
+  }
+  auto operator<(const counted_key &other) const -> bool {
+    return text < other.text;
+  }
+  auto operator<(std::string_view other) const -> bool { return text < other; }
+};
+
+template <> struct tftf::key_hash<counted_key> {
+  using is_transparent = void;
+  auto operator()(std::string_view key) const -> uint64_t {
+    return std::hash<std::string_view>{}(key);
+  }
+  auto operator()(const counted_key &key) const -> uint64_t {
+    return (*this)(key.text);
+  }
+};
+
+template <class Traits> void hashed_test() {
+  using table_t = tftf::faster<int, int, Traits>;
+  table_t f{64};
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  f.register_worker(state);
+  for (int i = 0; i < 100; i++) {
+    const uint64_t hash = table_t::hash_of(i);
+    assert(f.put_hashed(state, hash, i, i));
+    assert(f.get_hashed(state, hash, i) == i);
+    assert(f.update_hashed(state, hash, i, [](int v) { return v + 1; }) == i);
+    // the plain calls agree on where the key is
+    assert(f.get(state, i) == i + 1);
+  }
+  for (int i = 0; i < 100; i += 2) {
+    assert(f.erase_hashed(state, table_t::hash_of(i), i));
+    assert(!f.get(state, i));
+  }
+  assert(f.size() == 50);
+}
+
+// a key that owns something, like a string's buffer
+struct live_key {
+  static inline std::atomic<long> live{0};
+  int k;
+
+  live_key(int x) : k(x) { live++; }
+  live_key(const live_key &other) : k(other.k) { live++; }
+  ~live_key() { live--; }
+  auto operator==(const live_key &other) const -> bool {
+    return k == other.k;
+  }
+  auto operator<(const live_key &other) const -> bool {
+    return k < other.k;
+  }
+};
+struct live_hash {
+  auto operator()(const live_key &key) const -> uint64_t {
+    return static_cast<uint64_t>(key.k);
+  }
+};
+struct live_keys : eager_delete {
+  using hasher = live_hash;
+};
+struct live_skip_keys : live_keys {
+  template <class Key, class Value, class Traits>
+  using engine = tftf::skip_list_engine<Key, Value, Traits>;
+};
+
+/// @brief erased nodes' keys are destroyed once their bags are released
+template <class Traits> void retired_key_test() {
+  const long before = live_key::live;
+  {
+    tftf::faster<live_key, int, Traits> f{1'024};
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    for (int i = 0; i < 2'000; i++) {
+      f.put(state, live_key{i}, i);
+    }
+    for (int i = 0; i < 2'000; i++) {
+      assert(f.erase(state, live_key{i}));
+    }
+    // enough ops for a few major ticks, with nobody else holding epochs back
+    for (int i = 0; i < 5'000; i++) {
+      f.put(state, live_key{-1}, i);
+    }
+    assert(live_key::live - before < 1'000);
+  }
+  std::cerr << "passed retired key test!\n";
+}
+
+void heterogeneous_test() {
+  {
+    tftf::faster<counted_key, int> f;
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    auto name = [](int i) {
+      return "a key long enough to allocate " + std::to_string(i);
+    };
+    for (int i = 0; i < 100; i++) {
+      f.put(state, counted_key{name(i)}, i);
+    }
+    assert(f.hash_of(counted_key{name(7)}) ==
+           f.hash_of(std::string_view{name(7)}));
+
+    const int built = counted_key::built;
+    for (int i = 0; i < 100; i++) {
+      const std::string text = name(i);
+      const std::string_view view{text};
+      assert(f.get(state, view) == i);
+      const uint64_t hash = f.hash_of(view);
+      assert(f.get_hashed(state, hash, view) == i);
+      assert(f.update(state, view, [](int v) { return v + 1; }) == i);
+      assert(f.update_hashed(state, hash, view, [](int v) { return v + 1; }) ==
+             i + 1);
+    }
+    for (int i = 0; i < 100; i += 2) {
+      const std::string text = name(i);
+      assert(f.erase(state, std::string_view{text}));
+      assert(!f.get(state, std::string_view{text}));
+    }
+    assert(counted_key::built == built);
+    assert(f.size() == 50);
+    assert(f.get(state, std::string_view{name(1)}) == 3);
+  }
+  {
+    tftf::faster<std::string, int> f;
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    f.put(state, "alpha", 1);
+    f.put(state, std::string{"beta"}, 2);
+    assert(f.get(state, "alpha") == 1);
+    assert(f.get(state, std::string_view{"beta"}) == 2);
+    assert(f.get(state, std::string{"beta"}) == 2);
+    assert(f.hash_of(std::string{"alpha"}) ==
+           f.hash_of(std::string_view{"alpha"}));
+    assert(f.erase(state, "alpha"));
+    assert(!f.get(state, "alpha"));
+  }
+  hashed_test<tftf::default_faster_traits>();
+  hashed_test<bucketed>();
+  hashed_test<hybrid>();
+  std::cerr << "passed heterogeneous lookup test!\n";
+}
+
+struct wy_hashed : tftf::default_faster_traits {
+  using hasher = tftf::wy_hash;
+};
+struct multiply_shift_hashed : bucketed {
+  using hasher = tftf::multiply_shift_hash;
+};
+
+/// @brief most keys any of `buckets` (a power of two) gets when masking the
+/// hashes of `keys`
+template <class Hasher, class Key>
+auto max_bucket_load(const std::vector<Key> &keys, size_t buckets) -> size_t {
+  std::vector<size_t> load(buckets);
+  for (const Key &key : keys) {
+    load[Hasher{}(key) & (buckets - 1)]++;
+  }
+  return *std::max_element(load.begin(), load.end());
+}
+
+void hasher_test() {
+  constexpr size_t buckets = 1'024;
+  constexpr size_t n = 16 * buckets;
+  // ids with the low 12 bits clear, like aligned addresses
+  std::vector<uint64_t> strided(n);
+  std::vector<std::string> names(n);
+  for (size_t i = 0; i < n; i++) {
+    strided[i] = i << 12;
+    names[i] = "user:" + std::to_string(i);
+  }
+  // the identity puts every one of them in bucket 0, the others spread them
+  // within a few times the mean of 16
+  assert(max_bucket_load<tftf::std_hash>(strided, buckets) == n);
+  assert(max_bucket_load<tftf::multiply_shift_hash>(strided, buckets) <= 48);
+  assert(max_bucket_load<tftf::wy_hash>(strided, buckets) <= 48);
+  assert(max_bucket_load<tftf::wy_hash>(names, buckets) <= 48);
+
+  // every length branch of wyhash, no two prefixes of one string collide
+  const std::string text(200, 'x');
+  std::vector<uint64_t> prefixes;
+  for (size_t len = 0; len <= text.size(); len++) {
+    prefixes.push_back(tftf::wy_hash{}(std::string_view{text}.substr(0, len)));
+  }
+  std::sort(prefixes.begin(), prefixes.end());
+  assert(std::adjacent_find(prefixes.begin(), prefixes.end()) ==
+         prefixes.end());
+  assert(tftf::wy_hash{}(std::string{"abc"}) ==
+         tftf::wy_hash{}(std::string_view{"abc"}));
+  assert(tftf::wy_hash{.seed = 1}(uint64_t{7}) != tftf::wy_hash{}(uint64_t{7}));
+
+  {
+    tftf::faster<std::string, int, wy_hashed> f;
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    for (int i = 0; i < 1'000; i++) {
+      f.put(state, names[i], i);
+    }
+    for (int i = 0; i < 1'000; i++) {
+      assert(f.get(state, std::string_view{names[i]}) == i);
+    }
+    assert(f.hash_of(names[3]) == tftf::wy_hash{}(names[3]));
+  }
+  hashed_test<wy_hashed>();
+  hashed_test<multiply_shift_hashed>();
+  std::cerr << "passed hasher test!\n";
+}
+
+template <class Traits> void stats_test() {
+  using tftf::table_event;
+  using tftf::table_op;
+  tftf::faster<uint64_t, uint64_t, Traits> f(256);
+  {
+    tftf::worker_state state{*std::pmr::get_default_resource()};
+    f.register_worker(state);
+    for (uint64_t i = 0; i < 100; i++) {
+      f.put(state, i, i);
+    }
+    for (uint64_t i = 0; i < 50; i++) {
+      assert(f.get(state, i) == i);
+    }
+    for (uint64_t i = 0; i < 10; i++) {
+      f.update(state, i, [](uint64_t v) { return v + 1; });
+      f.fetch_add(state, i, 1);
+      f.erase(state, 90 + i);
+    }
+    const std::vector<uint64_t> keys{1, 2, 3, 4};
+    std::vector<std::optional<uint64_t>> out(keys.size());
+    f.get_batch(state, keys, out);
+
+    const tftf::table_stats stats = f.collect_stats();
+    assert(stats.size == 90 && stats.workers == 1);
+    if constexpr (tftf::metrics_enabled) {
+      assert(stats.op(table_op::put) == 100);
+      assert(stats.op(table_op::get) == 54);
+      assert(stats.op(table_op::update) == 10);
+      assert(stats.op(table_op::rmw) == 10);
+      assert(stats.op(table_op::erase) == 10);
+      // the first op and every 16th after it is timed, batches aren't
+      uint64_t samples = 0;
+      for (const tftf::latency_histogram &h : stats.latency) {
+        samples += h.count();
+      }
+      assert(samples == (180 + 15) / 16);
+      assert(stats.event(table_event::retired) >=
+             stats.event(table_event::reclaimed));
+      assert(stats.reclaim_backlog() ==
+             stats.event(table_event::retired) -
+                 stats.event(table_event::reclaimed));
+
+      const std::string json = stats.to_json();
+      assert(json.front() == '{' && json.back() == '}');
+      assert(json.find("\"size\":90") != std::string::npos);
+      assert(json.find("\"put\":100") != std::string::npos);
+      const std::string prom = stats.to_prometheus("kv");
+      assert(prom.find("kv_ops_total{op=\"get\"} 54\n") != std::string::npos);
+      assert(prom.find("# TYPE kv_op_latency_seconds summary\n") !=
+             std::string::npos);
+    } else {
+      assert(stats.op(table_op::put) == 0);
+    }
+  }
+
+  // everyone bumps the same few counters, nothing is lost across workers
+  constexpr size_t threads = 4;
+  constexpr uint64_t rounds = 5'000;
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&f]() {
+      tftf::worker_state state{*std::pmr::get_default_resource()};
+      f.register_worker(state);
+      for (uint64_t i = 0; i < rounds; i++) {
+        f.upsert_rmw(state, 1'000 + i % 4, uint64_t{1},
+                     [](uint64_t v) { return v + 1; });
+      }
+    });
+  }
+  for (std::thread &t : workers) {
+    t.join();
+  }
+  const tftf::table_stats stats = f.collect_stats();
+  assert(stats.workers == 1 + threads);
+  if constexpr (tftf::metrics_enabled) {
+    assert(stats.op(table_op::rmw) == 10 + threads * rounds);
+  }
+}
+
+void metrics_test() {
+  tftf::latency_histogram h;
+  for (uint64_t ns = 1; ns <= 1'000; ns++) {
+    h.record(ns);
+  }
+  assert(h.count() == 1'000);
+  // within the ~6% a bucket spans
+  assert(h.percentile(0.5) >= 470 && h.percentile(0.5) <= 530);
+  assert(h.percentile(0.99) >= 930 && h.percentile(0.99) <= 1'050);
+  assert(h.approximate_sum() >= 0.94 * 500'500 &&
+         h.approximate_sum() <= 1.06 * 500'500);
+
+  stats_test<tftf::default_faster_traits>();
+  stats_test<bucketed>();
+  std::cerr << "passed metrics test!\n";
+}
+
+template <class Traits> void skip_list_test() {
+  tftf::faster<int, int, Traits> f;
+  tftf::worker_state state{*std::pmr::get_default_resource()};
+  f.register_worker(state);
+
+  // even keys, inserted out of order
+  constexpr int n = 10'000;
+  std::vector<int> keys(n);
+  for (int i = 0; i < n; i++) {
+    keys[i] = 2 * i;
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937{3});
+  for (int k : keys) {
+    assert(f.put(state, k, -k));
+  }
+  assert(!f.put(state, 42, 42));
+  assert(f.get(state, 42) == 42);
+  assert(f.put(state, 42, -42) == false);
+  assert(!f.get(state, 43));
+  assert(f.size() == n);
+
+  int last = -1;
+  size_t visited = 0;
+  f.for_each(state, [&](const int &k, const int &v) {
+    assert(k > last && v == -k);
+    last = k;
+    visited++;
+  });
+  assert(visited == n);
+
+  std::vector<int> in_range;
+  f.range(state, 101, 201, [&](const int &k, const int &) {
+    in_range.push_back(k);
+  });
+  assert(in_range.size() == 50 && in_range.front() == 102 &&
+         in_range.back() == 200);
+  in_range.clear();
+  f.range(state, 7, 7, [&](const int &k, const int &) {
+    in_range.push_back(k);
+  });
+  assert(in_range.empty());
+  assert(f.lower_bound(state, 101) == std::pair(102, -102));
+  assert(f.lower_bound(state, 100) == std::pair(100, -100));
+  assert(!f.lower_bound(state, 2 * n));
+
+  for (int k = 0; k < 2 * n; k += 4) {
+    assert(f.erase(state, k));
+    assert(!f.erase(state, k));
+  }
+  assert(f.size() == n / 2);
+  assert(f.lower_bound(state, 0) == std::pair(2, -2));
+
+  // odd keys churn while we scan, every even key left must come back exactly
+  // once and in order
+  std::atomic<bool> stop{false};
+  std::thread churn{[&] {
+    tftf::worker_state local{*std::pmr::get_default_resource()};
+    f.register_worker(local);
+    while (!stop.load()) {
+      for (int k = 1; k < 2 * n; k += 2) {
+        f.put(local, k, 0);
+      }
+      for (int k = 1; k < 2 * n; k += 2) {
+        f.erase(local, k);
+      }
+    }
+  }};
+  for (int pass = 0; pass < 20; pass++) {
+    int prev = -1;
+    size_t evens = 0;
+    f.range(state, 0, 2 * n, [&](const int &k, const int &) {
+      assert(k > prev);
+      prev = k;
+      evens += k % 2 == 0;
+    });
+    assert(evens == n / 2);
+  }
+  stop.store(true);
+  churn.join();
+
+  // a handful of keys inserted and erased from everywhere at once, so towers
+  // get erased while they're still being built
+  constexpr int hot = 64;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&f, t] {
+      tftf::worker_state local{*std::pmr::get_default_resource()};
+      f.register_worker(local);
+      std::mt19937 rng(t);
+      for (int i = 0; i < 50'000; i++) {
+        const int k = -1 - static_cast<int>(rng() % hot);
+        if (rng() % 2) {
+          f.put(local, k, k);
+        } else {
+          f.erase(local, k);
+        }
+      }
+    });
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  size_t live = 0;
+  f.range(state, -hot, 0, [&](const int &k, const int &v) {
+    assert(k == v && f.get(state, k) == v);
+    live++;
+  });
+  assert(f.size() == n / 2 + live);
+
+  std::cerr << "passed skip list test!\n";
+}
+
+void sharded_test() {
+  assert((tftf::parse_cpulist("0-3,8,10-11\n") ==
+          std::vector<unsigned>{0, 1, 2, 3, 8, 10, 11}));
+  assert((tftf::parse_cpulist("x,5,3-1") == std::vector<unsigned>{5}));
+  assert(tftf::parse_cpulist("").empty());
+
+  // a made up two socket box: node1 before node0 on disk, a memory only
+  // node2, node3 on cpus this machine may not have, and the usual clutter
+  const auto root = std::filesystem::temp_directory_path() / "tftf_numa_test";
+  std::filesystem::remove_all(root);
+  for (const auto &[node, cpus] :
+       {std::pair{"node1", "1\n"}, {"node0", "0\n"}, {"node2", "\n"},
+        {"node3", "2-3\n"}}) {
+    std::filesystem::create_directories(root / node);
+    std::ofstream{root / node / "cpulist"} << cpus;
+  }
+  std::filesystem::create_directories(root / "power");
+  std::ofstream{root / "possible"} << "0-3\n";
+
+  const tftf::numa_topology topology = tftf::numa_topology::from_sysfs(root);
+  assert((topology.ids == std::vector<unsigned>{0, 1, 3}));
+  assert((topology.cpus[2] == std::vector<unsigned>{2, 3}));
+  assert(topology.node_of_cpu(1) == 1 && topology.node_of_cpu(3) == 2);
+  assert(!topology.node_of_cpu(9));
+  assert(tftf::numa_topology::from_sysfs(root / "missing").node_count() == 1);
+  std::filesystem::remove_all(root);
+
+  // pinning to cpus that aren't there and binding to nodes that aren't
+  // there both fail quietly, so this runs anywhere
+  tftf::sharded_faster<int, int> f{topology, 64};
+  assert(f.shard_count() == 3);
+  constexpr int per_thread = 20'000;
+  std::vector<size_t> homes(3);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 3; t++) {
+    threads.emplace_back([&f, &homes, t] {
+      auto &w = f.make_worker();
+      homes[t] = w.home_shard();
+      size_t local = 0;
+      for (int i = 0; i < per_thread; i++) {
+        const int k = t * per_thread + i;
+        assert(f.put(w, k, k));
+        // the key went to shard_of's shard and nowhere else
+        for (size_t shard = 0; shard < f.shard_count(); ++shard) {
+          assert(f.shard(shard).get(w.state(shard), k).has_value() ==
+                 (shard == f.shard_of(k)));
+        }
+        // one shard per node here, shard i on the topology's i-th node
+        if (f.is_local(w, k)) {
+          assert(f.shard_of(k) == w.home_shard());
+          local++;
+        } else {
+          assert(f.shard_of(k) != w.home_shard());
+        }
+      }
+      // about a third of the keys are on any one node
+      assert(local > per_thread / 6 && local < per_thread / 2);
+      for (int i = 0; i < per_thread; i += 2) {
+        const int k = t * per_thread + i;
+        assert(f.erase(w, k));
+        assert(f.upsert_rmw(w, k, -1, [](int v) { return v; }) == std::nullopt);
+        assert(f.update(w, k, [](int v) { return v - 1; }) == -1);
+      }
+    });
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  // home shards went round robin
+  std::sort(homes.begin(), homes.end());
+  assert((homes == std::vector<size_t>{0, 1, 2}));
+
+  assert(f.size() == 3 * per_thread);
+  size_t total = 0;
+  for (size_t shard = 0; shard < f.shard_count(); ++shard) {
+    // the hash spreads sequential keys over every shard
+    assert(f.shard(shard).size() > per_thread / 2);
+    total += f.shard(shard).size();
+  }
+  assert(total == f.size());
+  // on a thread of its own, make_worker pins whoever calls it
+  std::thread{[&f] {
+    auto &w = f.make_worker();
+    size_t visited = 0;
+    f.for_each(w, [&](const int &k, const int &v) {
+      assert(v == (k % 2 == 0 ? -2 : k));
+      visited++;
+    });
+    assert(visited == f.size());
+    for (int k = 0; k < 3 * per_thread; k++) {
+      assert(f.get(w, k) == (k % 2 == 0 ? -2 : k));
+    }
+    assert(!f.get(w, -1));
+  }}.join();
+
+  // more shards than nodes wrap around them, shards 0 and 3 share node 0
+  {
+    tftf::sharded_faster<int, int> six{
+        topology, 16, {.shards = 6, .pin_workers = false}};
+    for (size_t home = 0; home < 6; ++home) {
+      auto &w = six.make_worker();
+      assert(w.home_shard() == home);
+      for (int k = 0; k < 1'000; k++) {
+        assert(six.is_local(w, k) == (six.shard_of(k) % 3 == home % 3));
+      }
+    }
+  }
+
+  // a shard that fails to build throws from the constructor, not its thread
+  {
+    const tftf::hybrid_log_options unopenable{
+        .path = (root / "missing" / "shard.log").string()};
+    bool threw = false;
+    try {
+      tftf::sharded_faster<int, blob, hybrid> broken{topology, 16, {},
+                                                     unopenable};
+    } catch (const std::system_error &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  std::cerr << "passed sharded test!\n";
+}
+
 auto main() -> int {
   alloc_test();
+  slab_test();
+  exchange_test();
   integration_test();
   delete_heavy_test();
+  epoch_test();
+  guard_test();
+  interval_test();
+  max_workers_test();
+  rebalance_test();
   basic_multithread_test();
   basic_multithread_mixed_test();
+  resize_test();
+  probe_test();
+  bucket_engine_test<bucketed>();
+  bucket_engine_test<simd_bucketed>();
+  batch_test<tftf::default_faster_traits>();
+  batch_test<bucketed>();
+  batch_test<interval_reclaimed>();
+  scan_test<scannable>();
+  scan_test<bucketed_scannable>();
+  checkpoint_test<scannable>();
+  checkpoint_test<bucketed_scannable>();
+  rmw_test<tftf::default_faster_traits>();
+  rmw_test<interval_reclaimed>();
+  rmw_test<bucketed>();
+  rmw_test<hybrid>();
+  combining_test<eagerly_combining>();
+  combining_test<never_combining>();
+  write_buffer_test();
+  hybrid_log_test();
+  wal_test();
+  boxed_value_test();
+  retired_key_test<live_keys>();
+  retired_key_test<live_skip_keys>();
+  heterogeneous_test();
+  hasher_test();
+  metrics_test();
+  skip_list_test<skip_listed>();
+  skip_list_test<interval_skip_listed>();
+  batch_test<skip_listed>();
+  scan_test<skip_listed>();
+  checkpoint_test<skip_listed>();
+  rmw_test<skip_listed>();
+  sharded_test();
 
   std::cerr << "all tests passed!\n";
 }
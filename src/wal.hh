@@ -0,0 +1,496 @@
+#pragma once
+/// write-ahead log: attach one to a faster (faster::attach_wal) and every
+/// put/update/erase that changes something appends a redo record to its
+/// worker's buffer. a flusher thread group commits all the buffers with one
+/// write and one fdatasync every `interval`, and `replay_wal` rebuilds a
+/// table from the file.
+///
+/// records are physical (the key and the whole new value), so replaying a
+/// key's records in order always ends on its last value. writes of a key are
+/// ordered by a striped lock held across the table op and the append, and
+/// each stripe numbers its records; replay sorts by (stripe, seq).
+///
+/// every record also takes a global lsn when it's appended (under its
+/// stripe's lock, so a stripe's lsns go up with its seqs). a commit cuts
+/// every buffer at one lsn, writes everything below the cut in lsn order and
+/// only then calls it durable. the file is always an lsn prefix, and so is
+/// whatever part of it survives a crash, so the recovered table is one a
+/// prefix of every stripe's history produces.
+///
+/// a failed write or sync sticks: commit rethrows it from then on, and
+/// group_sync waits return false instead of acknowledging anything.
+///
+/// with a checkpoint (checkpoint.hh), `rotate` the log to a new file right
+/// before write_checkpoint: everything in the old file happened before the
+/// scan started and is in the checkpoint, so recovery is load_into from the
+/// checkpoint and replay_wal of the new file on top.
+///
+/// file layout (native endianness): wal_header, then wal records back to
+/// back. each record carries a checksum, replay stops at the first torn one
+
+#include "common.hh"
+#include "hash.hh"
+#include "io.hh"
+#include "state.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace tftf {
+
+template <class Key, class Value, class Traits> class faster;
+
+enum class durability {
+  // ops return once their record is buffered, a crash loses up to one
+  // interval of them
+  async,
+  // ops wait (up to max_wait) for the commit that makes their record durable
+  group_sync,
+};
+
+struct wal_options {
+  std::string path{};
+  durability mode{durability::async};
+  // how long the flusher gathers records into one commit
+  std::chrono::microseconds interval{1'000};
+  // longest a group_sync op waits for its commit before returning anyway
+  std::chrono::microseconds max_wait{10'000};
+  // a worker buffering this many records wakes the flusher early
+  std::size_t buffer_records{4'096};
+  // worker_state::index has to stay below this
+  std::size_t max_workers{1'024};
+};
+
+struct wal_header {
+  char magic[8];
+  std::uint32_t key_size;
+  std::uint32_t value_size;
+  // how keys were split into stripes
+  std::uint64_t stripes;
+};
+
+enum class wal_op : std::uint32_t { put = 1, erase = 2 };
+
+namespace detail {
+inline constexpr char wal_magic[8] = {'t', 'f', 't', 'f', 'w', 'a', 'l', '1'};
+
+/// @brief fnv-1a, enough to tell a torn record from a whole one
+inline auto checksum(const void *data, std::size_t bytes) -> std::uint64_t {
+  const auto *p = static_cast<const unsigned char *>(data);
+  std::uint64_t hash = 0xcbf29ce484222325ull;
+  for (std::size_t i = 0; i < bytes; ++i) {
+    hash = (hash ^ p[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+} // namespace detail
+
+template <class Key, class Value> class write_ahead_log {
+public:
+  struct record {
+    std::uint64_t seq;
+    std::uint32_t stripe;
+    wal_op op;
+    Key key;
+    Value value;
+    // over every byte above
+    std::uint64_t check;
+  };
+  static constexpr std::size_t stripes = 1'024;
+
+  /// @brief the key's stripe, held across the table op and its append
+  class stripe_lock {
+  public:
+    stripe_lock(write_ahead_log &wal, const Key &key)
+        : m_wal(wal), m_stripe(stripe_of(key)) {
+      auto &locked = m_wal.m_stripes[m_stripe].value.locked;
+      while (locked.exchange(true, std::memory_order_acquire)) {
+        cpu_relax();
+      }
+    }
+    ~stripe_lock() {
+      m_wal.m_stripes[m_stripe].value.locked.store(false,
+                                                   std::memory_order_release);
+    }
+
+    stripe_lock(const stripe_lock &) = delete;
+    stripe_lock &operator=(const stripe_lock &) = delete;
+
+    auto stripe() const -> std::uint32_t { return m_stripe; }
+
+  private:
+    write_ahead_log &m_wal;
+    std::uint32_t m_stripe;
+  };
+
+  explicit write_ahead_log(wal_options options)
+      : m_options(std::move(options)),
+        m_buffers(new padded<buffer>[m_options.max_workers]),
+        m_stripes(new padded<stripe>[stripes]) {
+    // here rather than on the class, so any faster can name its wal type
+    static_assert(std::is_trivially_copyable_v<Key> &&
+                      std::is_trivially_copyable_v<Value>,
+                  "wal records copy keys and values byte for byte");
+    m_fd = open_log(m_options.path);
+    m_flusher = std::thread{[this]() { flush_loop(); }};
+  }
+
+  write_ahead_log(const write_ahead_log &) = delete;
+  write_ahead_log &operator=(const write_ahead_log &) = delete;
+
+  /// @brief commits whatever is still buffered. a failure here has nobody
+  /// to go to, call commit first to see it
+  ~write_ahead_log() {
+    {
+      const std::lock_guard lock{m_wake_mutex};
+      m_stop = true;
+    }
+    m_wake.notify_one();
+    m_flusher.join();
+    try {
+      commit();
+    } catch (...) {
+    }
+    ::close(m_fd);
+  }
+
+  /// @brief buffer a record for an op that just went through on the table,
+  /// with `lock` still held
+  void append(worker_state &state, const stripe_lock &lock, wal_op op,
+              const Key &key, const Value &value = Value{}) {
+    if (state.index >= m_options.max_workers) [[unlikely]] {
+      throw std::out_of_range("wal: worker index past max_workers");
+    }
+    record r;
+    std::memset(static_cast<void *>(&r), 0, sizeof(r));
+    r.seq = ++m_stripes[lock.stripe()].value.seq;
+    r.stripe = lock.stripe();
+    r.op = op;
+    r.key = key;
+    if (op == wal_op::put) {
+      r.value = value;
+    }
+    r.check = detail::checksum(&r, offsetof(record, check));
+
+    buffer &b = m_buffers[state.index].value;
+    b.lock();
+    // our buffer has to be counted before the lsn goes out, or a committer
+    // could cut past the lsn and never look at the buffer holding it
+    std::size_t used = m_used.load(std::memory_order_relaxed);
+    while (used <= state.index &&
+           !m_used.compare_exchange_weak(used, state.index + 1,
+                                         std::memory_order_release)) {
+    }
+    // taken under the buffer lock: once a committer sees an lsn handed out,
+    // locking the buffer it went to finds the record there
+    const std::uint64_t lsn = m_next_lsn.fetch_add(1, std::memory_order_acq_rel);
+    b.records.push_back({lsn, r});
+    b.last = lsn + 1;
+    const bool full = b.records.size() >= m_options.buffer_records;
+    b.unlock();
+
+    if (full) [[unlikely]] {
+      {
+        const std::lock_guard wake_lock{m_wake_mutex};
+        m_urgent = true;
+      }
+      m_wake.notify_one();
+    }
+  }
+
+  /// @brief in group_sync mode, wait until everything `state` appended (and
+  /// everything appended before it) is on disk, or max_wait. false if we
+  /// gave up waiting or the log has failed. async returns straight away
+  /// unless the log has failed
+  auto wait_durable(worker_state &state) -> bool {
+    if (m_options.mode != durability::group_sync) {
+      return !m_failed.load(std::memory_order_acquire);
+    }
+    // only we bump last, so no lock needed to read it
+    const std::uint64_t target = m_buffers[state.index].value.last;
+    std::unique_lock lock{m_durable_mutex};
+    const bool woken = m_durable.wait_for(lock, m_options.max_wait, [&]() {
+      return m_failed.load(std::memory_order_acquire) ||
+             m_durable_lsn.load(std::memory_order_acquire) >= target;
+    });
+    if (m_failed.load(std::memory_order_acquire)) {
+      return false;
+    }
+    if (!woken) {
+      m_timeouts.fetch_add(1, std::memory_order_relaxed);
+    }
+    return woken;
+  }
+
+  /// @brief write and sync everything buffered so far, now. throws if this
+  /// or any earlier commit (the flusher's included) failed
+  void commit() {
+    const std::lock_guard lock{m_commit_mutex};
+    commit_locked();
+  }
+
+  /// @brief whether a write or sync has failed, after which nothing more is
+  /// acknowledged as durable
+  auto failed() const -> bool {
+    return m_failed.load(std::memory_order_acquire);
+  }
+
+  /// @brief commit, then carry on in a fresh file at `path`. see the top of
+  /// the file for how this pairs with checkpoints
+  void rotate(const std::string &path) {
+    const std::lock_guard lock{m_commit_mutex};
+    commit_locked();
+    const int fd = open_log(path);
+    ::close(m_fd);
+    m_fd = fd;
+    m_options.path = path;
+  }
+
+  /// @brief number of group commits (write + fdatasync) so far
+  auto commits() const -> std::uint64_t {
+    return m_commits.load(std::memory_order_relaxed);
+  }
+  /// @brief group_sync waits that hit max_wait
+  auto timeouts() const -> std::uint64_t {
+    return m_timeouts.load(std::memory_order_relaxed);
+  }
+  auto options() const -> const wal_options & { return m_options; }
+
+  static auto stripe_of(const Key &key) -> std::uint32_t {
+    // stripes is a power of two, take the top bits of a remix
+    return static_cast<std::uint32_t>(
+        (key_hash<Key>{}(key) * 0x9e3779b97f4a7c15ull) >>
+        (64 - std::countr_zero(stripes)));
+  }
+
+private:
+  struct logged {
+    std::uint64_t lsn;
+    record r;
+  };
+
+  struct buffer {
+    // the owner appends under it, the flusher takes records out under it
+    tftf::atomic<bool> locked{false};
+    // in lsn order
+    std::vector<logged> records{};
+    // one past the lsn of the last record appended, owner only
+    std::uint64_t last{0};
+
+    void lock() {
+      while (locked.exchange(true, std::memory_order_acquire)) {
+        cpu_relax();
+      }
+    }
+    void unlock() { locked.store(false, std::memory_order_release); }
+  };
+
+  struct stripe {
+    tftf::atomic<bool> locked{false};
+    // last sequence number handed out, under the lock
+    std::uint64_t seq{0};
+  };
+
+  auto open_log(const std::string &path) -> int {
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      detail::throw_errno("open " + path);
+    }
+    wal_header header{};
+    std::memcpy(header.magic, detail::wal_magic, sizeof(header.magic));
+    header.key_size = sizeof(Key);
+    header.value_size = sizeof(Value);
+    header.stripes = stripes;
+    detail::write_all(fd, &header, sizeof(header), path);
+    if (::fdatasync(fd) != 0) {
+      ::close(fd);
+      detail::throw_errno("fdatasync " + path);
+    }
+    return fd;
+  }
+
+  /// @brief commit every interval (or sooner when a buffer fills up) until
+  /// told to stop. the first failure is kept for commit to rethrow, and ends
+  /// the loop: the file is in no shape for more after it
+  void flush_loop() {
+    std::unique_lock lock{m_wake_mutex};
+    while (!m_stop) {
+      m_wake.wait_for(lock, m_options.interval,
+                      [this]() { return m_stop || m_urgent; });
+      m_urgent = false;
+      lock.unlock();
+      try {
+        commit();
+      } catch (...) {
+        return;
+      }
+      lock.lock();
+    }
+  }
+
+  /// @brief cut every buffer at the next lsn, write what's below the cut in
+  /// lsn order, sync, then let the waiters know
+  void commit_locked() {
+    if (m_error) {
+      std::rethrow_exception(m_error);
+    }
+    // every lsn below the cut is in its buffer by the time we lock it
+    const std::uint64_t cut = m_next_lsn.load(std::memory_order_acquire);
+    const std::size_t used = m_used.load(std::memory_order_acquire);
+    m_pending.clear();
+    for (std::size_t i = 0; i < used; ++i) {
+      buffer &b = m_buffers[i].value;
+      b.lock();
+      const auto end = std::find_if(
+          b.records.begin(), b.records.end(),
+          [cut](const logged &l) { return l.lsn >= cut; });
+      m_pending.insert(m_pending.end(), b.records.begin(), end);
+      b.records.erase(b.records.begin(), end);
+      b.unlock();
+    }
+    if (m_pending.empty()) {
+      return;
+    }
+    std::sort(m_pending.begin(), m_pending.end(),
+              [](const logged &a, const logged &b) { return a.lsn < b.lsn; });
+    m_write.clear();
+    for (const logged &l : m_pending) {
+      m_write.push_back(l.r);
+    }
+    try {
+      detail::write_all(m_fd, m_write.data(), m_write.size() * sizeof(record),
+                        m_options.path);
+      if (::fdatasync(m_fd) != 0) {
+        detail::throw_errno("fdatasync " + m_options.path);
+      }
+    } catch (...) {
+      m_error = std::current_exception();
+      {
+        const std::lock_guard lock{m_durable_mutex};
+        m_failed.store(true, std::memory_order_release);
+      }
+      m_durable.notify_all();
+      throw;
+    }
+    {
+      const std::lock_guard lock{m_durable_mutex};
+      m_durable_lsn.store(cut, std::memory_order_release);
+    }
+    m_durable.notify_all();
+    m_commits.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  wal_options m_options;
+  int m_fd{-1};
+  std::unique_ptr<padded<buffer>[]> m_buffers;
+  std::unique_ptr<padded<stripe>[]> m_stripes;
+  // buffers [0, m_used) have been appended to
+  alignas(cache_line) tftf::atomic<std::size_t> m_used{0};
+  // the lsn the next record gets
+  alignas(cache_line) tftf::atomic<std::uint64_t> m_next_lsn{0};
+
+  // committer only (flusher, commit, rotate), under m_commit_mutex
+  std::mutex m_commit_mutex;
+  std::vector<logged> m_pending;
+  std::vector<record> m_write;
+  std::exception_ptr m_error;
+
+  std::mutex m_wake_mutex;
+  std::condition_variable m_wake;
+  bool m_urgent{false};
+  bool m_stop{false};
+
+  std::mutex m_durable_mutex;
+  std::condition_variable m_durable;
+  // every record below this lsn is on disk
+  tftf::atomic<std::uint64_t> m_durable_lsn{0};
+  tftf::atomic<bool> m_failed{false};
+
+  tftf::atomic<std::uint64_t> m_commits{0};
+  tftf::atomic<std::uint64_t> m_timeouts{0};
+  std::thread m_flusher;
+};
+
+/// @brief rebuild a table from a wal: every whole record is applied in
+/// (stripe, seq) order with put/erase. `table` mustn't have a wal attached.
+/// returns how many records were replayed
+template <class Key, class Value, class Traits>
+auto replay_wal(faster<Key, Value, Traits> &table, worker_state &state,
+                const std::string &path) -> std::size_t {
+  using wal_t = write_ahead_log<Key, Value>;
+  using record = typename wal_t::record;
+
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    detail::throw_errno("open " + path);
+  }
+  auto close_on_exit = on_scope_exit([fd]() { ::close(fd); });
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    detail::throw_errno("stat " + path);
+  }
+  const auto size = static_cast<std::size_t>(st.st_size);
+
+  wal_header header;
+  if (size < sizeof(header)) {
+    throw std::runtime_error(path + ": too small to be a wal");
+  }
+  detail::pread_all(fd, &header, sizeof(header), 0, path);
+  if (std::memcmp(header.magic, detail::wal_magic, sizeof(header.magic)) !=
+      0) {
+    throw std::runtime_error(path + ": not a wal");
+  }
+  if (header.key_size != sizeof(Key) || header.value_size != sizeof(Value) ||
+      header.stripes != wal_t::stripes) {
+    throw std::runtime_error(path + ": key/value sizes don't match");
+  }
+
+  // a crash mid-commit leaves a partial record (or garbage) at the end
+  std::vector<record> records((size - sizeof(header)) / sizeof(record));
+  detail::pread_all(fd, records.data(), records.size() * sizeof(record),
+                    sizeof(header), path);
+  const auto torn = std::find_if(records.begin(), records.end(),
+                                 [](const record &r) {
+                                   return r.check != detail::checksum(
+                                                         &r, offsetof(record,
+                                                                      check));
+                                 });
+  records.erase(torn, records.end());
+  std::stable_sort(records.begin(), records.end(),
+                   [](const record &a, const record &b) {
+                     return a.stripe != b.stripe ? a.stripe < b.stripe
+                                                 : a.seq < b.seq;
+                   });
+
+  for (const record &r : records) {
+    if (r.op == wal_op::put) {
+      table.put(state, r.key, r.value);
+    } else {
+      table.erase(state, r.key);
+    }
+  }
+  return records.size();
+}
+
+} // namespace tftf
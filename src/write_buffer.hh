@@ -0,0 +1,189 @@
+#pragma once
+/// write combining for blind upserts: ingest paths that put keys nobody
+/// reads for a while. a worker's puts land in a small open-addressed buffer
+/// of its own, where repeated puts of a key merge into one. when the buffer
+/// fills up (or on flush) its entries go into the table sorted by bucket, so
+/// consecutive puts land in neighbouring buckets and their cache lines.
+///
+/// the worker's own get and erase see its buffered puts. nobody else does
+/// until they're flushed, and for_each, checkpoints and the wal don't either.
+///
+/// flushing is asynchronous only in that puts are published later than they
+/// are made: it runs on the worker's own thread, in flush, sync or the put
+/// that finds the buffer full (which pays for the whole batch). a flusher
+/// thread would need a registered worker_state of its own per buffer, and
+/// erases and reads racing its half-applied batch. ingest loops that can't
+/// take the occasional long put call flush at points of their choosing
+
+#include "faster.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace tftf {
+
+template <class Key, class Value, class Traits = default_faster_traits>
+class write_buffer {
+public:
+  using table_t = faster<Key, Value, Traits>;
+
+  /// @brief buffers up to `capacity` distinct keys for `state` (registered
+  /// with `table`, and only used by the buffer's thread) before flushing
+  write_buffer(table_t &table, worker_state &state, size_t capacity = 256)
+      : m_table(table), m_state(state),
+        m_capacity(std::max<size_t>(capacity, 1)),
+        // at most half full, so probes stay short
+        m_slots(std::bit_ceil(m_capacity * 2), empty_slot) {
+    m_entries.reserve(m_capacity);
+  }
+
+  write_buffer(const write_buffer &) = delete;
+  write_buffer &operator=(const write_buffer &) = delete;
+
+  /// @brief whatever is still buffered goes into the table. a failure here
+  /// (out of memory, a failed wal) has nowhere to go and drops the rest:
+  /// flush or sync first to see it
+  ~write_buffer() {
+    try {
+      flush();
+    } catch (...) {
+    }
+  }
+
+  /// @brief put/overwrite, without saying whether the key was new (that's
+  /// only known once it's flushed)
+  template <class Key_, class Value_>
+    requires std::is_convertible_v<Key_, Key> &&
+             std::is_convertible_v<Value_, Value>
+  void put(Key_ &&key_, Value_ &&value) {
+    Key key(std::forward<Key_>(key_));
+    const uint64_t hash = table_t::hash_of(key);
+    if (entry *e = find(hash, key)) {
+      e->value = std::forward<Value_>(value);
+      e->live = true;
+      return;
+    }
+    if (m_entries.size() == m_capacity) {
+      flush();
+    }
+    m_slots[free_slot(hash)] = static_cast<uint32_t>(m_entries.size());
+    m_entries.push_back(
+        {hash, std::move(key), Value(std::forward<Value_>(value)), true});
+  }
+
+  /// @brief our buffered value if we have one, the table's otherwise
+  auto get(const Key &key) -> std::optional<Value> {
+    const uint64_t hash = table_t::hash_of(key);
+    if (const entry *e = find(hash, key)) {
+      if (e->live) {
+        return e->value;
+      }
+    }
+    return m_table.get_hashed(m_state, hash, key);
+  }
+
+  /// @brief drop the buffered put of `key`, and erase it from the table.
+  /// true if either had it
+  auto erase(const Key &key) -> bool {
+    const uint64_t hash = table_t::hash_of(key);
+    bool buffered = false;
+    if (entry *e = find(hash, key)) {
+      buffered = std::exchange(e->live, false);
+    }
+    return m_table.erase_hashed(m_state, hash, key) || buffered;
+  }
+
+  /// @brief put everything buffered into the table, bucket by bucket. other
+  /// workers see it once this returns. if a put throws, the entries from it
+  /// on stay buffered for the next flush
+  void flush() {
+    if (m_entries.empty()) {
+      return;
+    }
+    // the low bits of the hash pick the bucket in every engine
+    const uint64_t mask = m_table.bucket_count() - 1;
+    std::sort(m_entries.begin(), m_entries.end(),
+              [mask](const entry &a, const entry &b) {
+                return (a.hash & mask) < (b.hash & mask);
+              });
+    std::fill(m_slots.begin(), m_slots.end(), empty_slot);
+    size_t flushed = 0;
+    try {
+      // copied rather than moved, so a put that throws leaves its entry whole
+      for (; flushed < m_entries.size(); ++flushed) {
+        const entry &e = m_entries[flushed];
+        if (e.live) {
+          m_table.put_hashed(m_state, e.hash, e.key, e.value);
+        }
+      }
+    } catch (...) {
+      m_entries.erase(m_entries.begin(), m_entries.begin() + flushed);
+      for (size_t i = 0; i < m_entries.size(); ++i) {
+        m_slots[free_slot(m_entries[i].hash)] = static_cast<uint32_t>(i);
+      }
+      throw;
+    }
+    m_entries.clear();
+  }
+
+  /// @brief flush, then commit the table's wal (if it has one) so the
+  /// flushed puts are on disk too
+  void sync() {
+    flush();
+    if constexpr (table_t::loggable) {
+      if (typename table_t::wal_t *wal = m_table.wal()) {
+        wal->commit();
+      }
+    }
+  }
+
+  /// @brief distinct keys buffered (erased ones included, until the flush)
+  auto pending() const -> size_t { return m_entries.size(); }
+  auto capacity() const -> size_t { return m_capacity; }
+
+private:
+  struct entry {
+    uint64_t hash;
+    Key key;
+    Value value;
+    // false once erased, so a later put can take the slot back
+    bool live;
+  };
+  static constexpr uint32_t empty_slot = ~uint32_t{0};
+
+  auto free_slot(uint64_t hash) const -> size_t {
+    size_t slot = hash & (m_slots.size() - 1);
+    while (m_slots[slot] != empty_slot) {
+      slot = (slot + 1) & (m_slots.size() - 1);
+    }
+    return slot;
+  }
+
+  auto find(uint64_t hash, const Key &key) -> entry * {
+    for (size_t slot = hash & (m_slots.size() - 1);
+         m_slots[slot] != empty_slot;
+         slot = (slot + 1) & (m_slots.size() - 1)) {
+      entry &e = m_entries[m_slots[slot]];
+      if (e.hash == hash && e.key == key) {
+        return &e;
+      }
+    }
+    return nullptr;
+  }
+
+  table_t &m_table;
+  worker_state &m_state;
+  size_t m_capacity;
+  // open addressed (linear probing) indices into m_entries
+  std::vector<uint32_t> m_slots;
+  std::vector<entry> m_entries;
+};
+
+} // namespace tftf